@@ -1,4 +1,17 @@
+// Chat client. Interactive by default, with a readline prompt; --headless
+// runs it as a pipe for bots and bridges instead: lines from stdin or
+// --input are sent as they are read, and everything the server sends is
+// written to stdout as it arrives, with keep-alive pings answered.
+//
+//     ./client [--host=H] [--port=N] [--name=NAME] [--compress=on|off]
+//              [--headless] [--input=FILE] [--linger=MS]
+
 #include "client.hpp"
+#include "compression.hpp"
+#include <fcntl.h>
+#include <poll.h>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
 #include <stdexcept>
 #include <readline/history.h>
@@ -6,32 +19,239 @@
 #include <sys/select.h>
 #include <unistd.h>
 
+static constexpr size_t RECV_CHUNK = 64 * 1024;         // bytes per read from the server or the input
+static constexpr size_t MAX_PENDING_INPUT = 1024 * 1024; // unsent input before reading pauses
+
 // Initialize static pointer
 ChatClient* ChatClient::current_instance_ = nullptr;
 
-ChatClient::ChatClient(const std::string& host, const std::string& port) 
-    : sock_(connect_to_server(host.c_str(), port.c_str())) {
+ChatClient::ChatClient(const ClientOptions& options)
+    : options_(options), sock_(connect_to_server(options.host.c_str(), options.port.c_str())),
+      name_(options.name), recv_buf_(RECV_CHUNK) {
     if (!sock_) {
         throw std::runtime_error("Failed to connect to server");
     }
     current_instance_ = this;
 }
 
-void ChatClient::run() {
-    std::cout << "Enter your name: ";
-    std::getline(std::cin, name_);
-    if (!send_all(sock_.get(), name_ + "\n")) {
-        std::cerr << "Failed to send handshake.\n";
-        return;
-    }
+bool ChatClient::run() {
+    if (!handshake()) return false;
+    if (options_.headless) return headless_loop();
 
     setup_readline();
     event_loop();
     cleanup_readline();
 
     std::cout << "\nGoodbye!\n";
+    return true;
+}
+
+// Sends the name and waits for the server's answer. If the name is taken,
+// the interactive client asks for another; a headless one gives up.
+bool ChatClient::handshake() {
+    while (true) {
+        if (name_.empty()) {
+            std::cout << "Enter your name: ";
+            if (!std::getline(std::cin, name_)) return false;
+        }
+        if (!send_hello()) return false;
+
+        std::string reply;
+        while (reply.empty()) {
+            if (!receive(reply)) {
+                std::cerr << "Server closed the connection.\n";
+                return false;
+            }
+        }
+        if (reply.rfind("[Error]: ", 0) != 0) {
+            std::cout << reply << std::flush;
+            return flush_output();
+        }
+        std::cerr << reply;
+        if (options_.headless) return false;
+        name_.clear();
+    }
+}
+
+bool ChatClient::send_hello() {
+    // $hello options are split on spaces, so such names use the bare form.
+    // Replies stay plain until the server confirms the codec.
+    compress_ = false;
+    await_codec_ = options_.compress && name_.find(' ') == std::string::npos;
+    std::string hello = await_codec_ ? "$hello name=" + name_ + " compress=deflate\n" : name_ + "\n";
+    if (!send_all(sock_.get(), hello)) {
+        std::cerr << "Failed to send handshake.\n";
+        return false;
+    }
+    return true;
 }
 
+// --- Server Input ---
+
+// Reads once from the server and appends every complete line received to
+// `lines`. Keep-alive pings are answered (queued in out_) rather than
+// returned. False once the server has closed the connection or sent
+// something undecodable.
+bool ChatClient::receive(std::string& lines) {
+    ssize_t n = ::recv(sock_.get(), recv_buf_.data(), recv_buf_.size(), 0);
+    if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    if (n == 0) return false;
+
+    size_t pos = partial_.size();
+    if (!compress_) {
+        partial_.append(recv_buf_.data(), n);
+        if (await_codec_) {
+            if (!take_codec()) {
+                std::cerr << "Corrupt data from server.\n";
+                return false;
+            }
+            pos = 0;
+        }
+    } else {
+        envelopes_.append(recv_buf_.data(), n);
+        if (!inflate_envelopes(envelopes_, partial_)) {
+            std::cerr << "Corrupt data from server.\n";
+            return false;
+        }
+    }
+
+    size_t start = 0;
+    while ((pos = partial_.find('\n', pos)) != std::string::npos) {
+        ++pos;
+        if (std::string_view(partial_).substr(start, pos - start) == "$ping\n") {
+            out_ += "$pong\n";
+        } else {
+            lines.append(partial_, start, pos - start);
+        }
+        start = pos;
+    }
+    partial_.erase(0, start);
+    return true;
+}
+
+// The server answers compress= with a plain "$hello compress=<codec>" line
+// ahead of any other reply; whatever follows it is in that codec. A first
+// line that is not such an answer (a server too old to send one) is left
+// for the caller, and the connection stays plain.
+bool ChatClient::take_codec() {
+    size_t end = partial_.find('\n');
+    if (end == std::string::npos) return true;
+    await_codec_ = false;
+
+    std::string_view line = std::string_view(partial_).substr(0, end + 1);
+    if (line == "$hello compress=none\n") {
+        partial_.erase(0, end + 1);
+    } else if (line == "$hello compress=deflate\n") {
+        compress_ = true;
+        envelopes_.assign(partial_, end + 1);
+        partial_.clear();
+        return inflate_envelopes(envelopes_, partial_);
+    }
+    return true;
+}
+
+// Sends as much of out_ as the socket takes without blocking (all of it,
+// on the interactive client's blocking socket).
+bool ChatClient::flush_output() {
+    while (out_sent_ < out_.size()) {
+        ssize_t n = ::send(sock_.get(), out_.data() + out_sent_, out_.size() - out_sent_, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            perror("send");
+            return false;
+        }
+        out_sent_ += static_cast<size_t>(n);
+    }
+    if (out_sent_ == out_.size()) {
+        out_.clear();
+        out_sent_ = 0;
+    } else if (out_sent_ > out_.size() / 2) {
+        out_.erase(0, out_sent_);
+        out_sent_ = 0;
+    }
+    return true;
+}
+
+static bool write_all(int fd, std::string_view bytes) {
+    while (!bytes.empty()) {
+        ssize_t n = ::write(fd, bytes.data(), bytes.size());
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        bytes.remove_prefix(static_cast<size_t>(n));
+    }
+    return true;
+}
+
+// --- Headless Mode ---
+// Input is forwarded in large reads, without waiting for any reply, and
+// only pauses while a megabyte of it is still unsent. Once all of it is
+// sent the client waits until the server has been quiet for --linger ms,
+// so the replies to the last lines are not lost, then exits.
+
+bool ChatClient::headless_loop() {
+    Socket input_file;
+    int in_fd = STDIN_FILENO;
+    if (!options_.input.empty()) {
+        input_file = Socket(::open(options_.input.c_str(), O_RDONLY | O_CLOEXEC));
+        if (!input_file) {
+            perror(options_.input.c_str());
+            return false;
+        }
+        in_fd = input_file.get();
+    }
+    if (!set_non_blocking(sock_.get())) return false;
+
+    std::vector<char> in_buf(RECV_CHUNK);
+    bool input_done = false;
+    bool line_open = false; // the input so far does not end in a newline
+    std::string lines;
+    while (true) {
+        bool unsent = out_sent_ < out_.size();
+        bool want_input = !input_done && out_.size() - out_sent_ < MAX_PENDING_INPUT;
+        pollfd fds[2] = {{sock_.get(), static_cast<short>(POLLIN | (unsent ? POLLOUT : 0)), 0}, {in_fd, POLLIN, 0}};
+        int timeout = input_done && !unsent ? static_cast<int>(options_.linger) : -1;
+
+        int ready = ::poll(fds, want_input ? 2 : 1, timeout);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return false;
+        }
+        if (ready == 0) return true; // quiet for the whole linger time
+
+        if (want_input && fds[1].revents) {
+            ssize_t n = ::read(in_fd, in_buf.data(), in_buf.size());
+            if (n > 0) {
+                out_.append(in_buf.data(), n);
+                line_open = in_buf[n - 1] != '\n';
+            } else if (n == 0) {
+                input_done = true;
+                if (line_open) out_ += '\n';
+            } else if (errno != EINTR && errno != EAGAIN) {
+                perror("read");
+                return false;
+            }
+        }
+
+        if (fds[0].revents) {
+            lines.clear();
+            bool open = receive(lines);
+            if (!write_all(STDOUT_FILENO, lines)) return false;
+            if (!open) {
+                if (input_done) return true;
+                std::cerr << "Server closed the connection.\n";
+                return false;
+            }
+        }
+        if (!flush_output()) return false;
+    }
+}
+
+// --- Interactive Mode ---
+
 void ChatClient::setup_readline() {
     rl_callback_handler_install(">> ", ChatClient::line_handler);
 }
@@ -67,10 +287,8 @@ void ChatClient::handle_user_input() {
 }
 
 void ChatClient::handle_network_message() {
-    char buf[MAXDATASIZE];
-    ssize_t n = ::recv(sock_.get(), buf, sizeof(buf) - 1, 0);
-
-    if (n <= 0) { // Handle disconnect
+    std::string msg;
+    if (!receive(msg)) { // Handle disconnect
         if (running_) {
             std::cout << "\r\x1b[K[disconnected]\n" << std::flush;
             rl_redisplay(); // Just redisplay here, no need for full save/restore
@@ -78,8 +296,8 @@ void ChatClient::handle_network_message() {
         running_ = false;
         return;
     }
-    buf[n] = '\0';
-    std::string msg(buf);
+    if (!flush_output()) running_ = false;
+    if (msg.empty()) return;
     
     // 1. Save what the user is currently typing
     char *saved_line = rl_copy_text(0, rl_end);
@@ -90,8 +308,8 @@ void ChatClient::handle_network_message() {
     
     // 3. Format the message (handle "You:" case)
     const std::string my_tag = "[" + name_ + "]";
-    if (msg.find(my_tag) != std::string::npos) {
-        msg.replace(msg.find(my_tag), my_tag.length(), "You:");
+    if (size_t tag = msg.find(my_tag); tag != std::string::npos) {
+        msg.replace(tag, my_tag.length(), "You:");
         std::cout << "\x1b[A\x1b[2K";
     }
     
@@ -124,13 +342,55 @@ void ChatClient::line_handler(char* line) {     // static (c-style) fn as requir
     free(line);
 }
 
-int main() {
+// --- Command Line ---
+
+static bool parse_args(int argc, char** argv, ClientOptions& options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--headless") {
+            options.headless = true;
+            continue;
+        }
+        auto eq = arg.find('=');
+        if (eq == std::string_view::npos) return false;
+        std::string_view key = arg.substr(0, eq);
+        std::string value(arg.substr(eq + 1));
+        char* end = nullptr;
+        if (key == "--host" && !value.empty()) {
+            options.host = value;
+        } else if (key == "--port" && !value.empty()) {
+            options.port = value;
+        } else if (key == "--name" && !value.empty()) {
+            options.name = value;
+        } else if (key == "--compress" && (value == "on" || value == "off")) {
+            options.compress = value == "on";
+        } else if (key == "--input" && !value.empty()) {
+            options.input = value;
+        } else if (key == "--linger" && !value.empty()) {
+            options.linger = std::strtoul(value.c_str(), &end, 10);
+        } else {
+            return false;
+        }
+        if (end && *end != '\0') return false;
+    }
+    // A headless client has no one to ask for a name.
+    return !options.headless || !options.name.empty();
+}
+
+int main(int argc, char** argv) {
+    ClientOptions options;
+    if (!parse_args(argc, argv, options)) {
+        std::fprintf(stderr,
+                     "Usage: %s [--host=H] [--port=N] [--name=NAME] [--compress=on|off]\n"
+                     "          [--headless --name=NAME [--input=FILE] [--linger=MS]]\n",
+                     argv[0]);
+        return 1;
+    }
     try {
-        ChatClient client("127.0.0.1", PORT);
-        client.run();
+        ChatClient client(options);
+        return client.run() ? 0 : 1;
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
         return 1;
     }
-    return 0;
-}
\ No newline at end of file
+}
@@ -1,33 +1,60 @@
 #pragma once
 
 #include "network_utils.hpp"
+#include <cstdint>
 #include <string>
 #include <atomic>
+#include <vector>
+
+struct ClientOptions {
+    std::string host = "127.0.0.1";
+    std::string port = PORT;
+    std::string name;      // prompted for when empty (interactive only)
+    bool compress = true;  // ask the server for compressed envelopes
+    bool headless = false; // no readline: input lines in, raw server output out
+    std::string input;     // headless input file; stdin when empty
+    uint64_t linger = 1000; // headless: ms to keep reading after the input is sent
+};
 
 class ChatClient {
 public:
-    ChatClient(const std::string& host, const std::string& port);
-    void run();
+    explicit ChatClient(const ClientOptions& options);
+    // False if the session ended on an error.
+    bool run();
 
 private:
     // --- Member Variables (State) ---
+    ClientOptions options_;
     Socket sock_;
     std::string name_;
     std::atomic<bool> running_{true};
+    bool compress_ = false;      // the server confirmed compress=deflate
+    bool await_codec_ = false;   // asked for it; its answer is still to come
+    std::string envelopes_;      // received bytes not yet decoded into whole envelopes
+    std::string partial_;        // decoded output not yet ending in a newline
+    std::vector<char> recv_buf_; // one read's worth of socket input
+    std::string out_;            // bytes for the server not yet sent
+    size_t out_sent_ = 0;        // prefix of out_ already sent
 
     // Static pointer to the current instance, used as a bridge for the C-style callback.
     static ChatClient* current_instance_;
 
     // --- Private Helper Functions ---
+    bool handshake();
+    bool send_hello();
+    bool receive(std::string& lines);
+    bool take_codec();
+    bool flush_output();
     void setup_readline();
     void event_loop();
     void cleanup_readline();
-    
+    bool headless_loop();
+
     // --- Event Handlers ---
     void handle_user_input();
     void handle_network_message();
-    
+
     // --- Readline Callback ---
     // Must be static to be used as a C-style function pointer.
     static void line_handler(char* line);
-};
\ No newline at end of file
+};
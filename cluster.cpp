@@ -0,0 +1,394 @@
+#include "cluster.hpp"
+#include "server.hpp"
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <stdexcept>
+#include <sys/eventfd.h>
+
+static constexpr uint64_t NEVER = UINT64_MAX;
+static constexpr uint64_t REDIAL_MS = 1000;
+static constexpr int WAIT_MS = 250;                      // bounds how late a redial can be
+static constexpr size_t MAX_PEER_BACKLOG = 64 << 20;     // unsent bytes before a link is dropped
+
+static uint64_t monotonic_ms() { return monotonic_ns() / 1000000; }
+
+bool parse_cluster_peers(std::string_view text, std::vector<ClusterPeer>& out) {
+    out.clear();
+    while (!text.empty()) {
+        size_t comma = text.find(',');
+        std::string_view item = text.substr(0, comma);
+        text = comma == std::string_view::npos ? std::string_view{} : text.substr(comma + 1);
+
+        size_t at = item.find('@');
+        size_t colon = item.rfind(':');
+        if (at == std::string_view::npos || colon == std::string_view::npos || colon < at) return false;
+        uint32_t node;
+        auto [end, ec] = std::from_chars(item.data(), item.data() + at, node);
+        if (ec != std::errc() || end != item.data() + at || node == 0 || node >= MAX_CLUSTER_NODES) return false;
+        std::string host(item.substr(at + 1, colon - at - 1));
+        std::string port(item.substr(colon + 1));
+        if (host.empty() || port.empty()) return false;
+        out.push_back({node, std::move(host), std::move(port)});
+    }
+    return !out.empty();
+}
+
+ClusterNode::ClusterNode(const ClusterOptions& options, size_t max_line, ShardGroup& group)
+    : options_(options), max_frame_(3 * max_line + 64), group_(group),
+      listener_(get_listener_socket(options.port.c_str())), wake_fd_(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      next_dial_(options.peers.size(), 0) {
+    if (!listener_) throw std::runtime_error("Failed to initialize cluster listener socket.");
+    if (!wake_fd_) throw std::runtime_error("Failed to create cluster wakeup eventfd.");
+    if (!set_non_blocking(listener_.get()) || !reactor_.add(listener_.get()) || !reactor_.add(wake_fd_.get())) {
+        throw std::runtime_error("Failed to register cluster listener socket.");
+    }
+    // Lower ids dial higher ones, so each pair of nodes shares one link.
+    for (size_t i = 0; i < options_.peers.size(); ++i) {
+        if (options_.peers[i].node <= options_.node_id) next_dial_[i] = NEVER;
+    }
+}
+
+void ClusterNode::start() {
+    std::thread([this] { run(); }).detach();
+}
+
+void ClusterNode::post(ClusterEvent event) {
+    inbox_.push(std::move(event));
+    if (!wake_pending_.exchange(true, std::memory_order_acq_rel)) {
+        uint64_t one = 1;
+        if (::write(wake_fd_.get(), &one, sizeof one) < 0 && errno != EAGAIN) {
+            static LogRateLimit failures;
+            log_error(&failures) << "eventfd write: " << errno_text(errno);
+        }
+    }
+}
+
+// --- Link Thread ---
+
+void ClusterNode::run() {
+    log_info() << "Cluster node " << options_.node_id << " listening on port " << options_.port << ".";
+    std::vector<ReactorEvent> events;
+    while (true) {
+        dial_peers(monotonic_ms());
+        if (reactor_.wait(events, WAIT_MS) < 0) {
+            log_error() << "cluster poll: " << errno_text(errno);
+            return;
+        }
+        for (const ReactorEvent& ev : events) {
+            if (ev.fd == listener_.get()) {
+                accept_peers();
+            } else if (ev.fd == wake_fd_.get()) {
+                drain_inbox();
+            } else if (auto it = peers_.find(ev.fd); it != peers_.end()) {
+                handle_peer(*it->second, ev);
+            }
+        }
+        for (int fd : dirty_) {
+            if (auto it = peers_.find(fd); it != peers_.end()) flush(*it->second);
+        }
+        dirty_.clear();
+    }
+}
+
+// Starts a non-blocking connect to every peer that is due one.
+void ClusterNode::dial_peers(uint64_t now) {
+    for (size_t i = 0; i < options_.peers.size(); ++i) {
+        if (next_dial_[i] > now) continue;
+        next_dial_[i] = now + REDIAL_MS;
+        const ClusterPeer& target = options_.peers[i];
+
+        addrinfo hints{}, *servinfo;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (int rv = getaddrinfo(target.host.c_str(), target.port.c_str(), &hints, &servinfo); rv != 0) {
+            static LogRateLimit failures;
+            log_warn(&failures) << "Cluster node " << target.node << ": " << gai_strerror(rv);
+            continue;
+        }
+        int fd = -1;
+        for (addrinfo* p = servinfo; p != nullptr; p = p->ai_next) {
+            fd = ::socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol);
+            if (fd < 0) continue;
+            if (::connect(fd, p->ai_addr, p->ai_addrlen) == 0 || errno == EINPROGRESS) break;
+            ::close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(servinfo);
+        if (fd < 0 || !reactor_.add(fd)) {
+            if (fd >= 0) ::close(fd);
+            continue;
+        }
+        set_tcp_options(fd, SocketOptions{}); // no Nagle delay on relayed messages
+
+        auto peer = std::make_unique<Peer>(fd, max_frame_);
+        peer->dial = static_cast<int>(i);
+        peer->connecting = true;
+        reactor_.set_interest(fd, false, true);
+        send(*peer, encode_frame(PeerOp::Hello, Varint{options_.node_id}));
+        next_dial_[i] = NEVER;
+        peers_.emplace(fd, std::move(peer));
+    }
+}
+
+void ClusterNode::accept_peers() {
+    while (true) {
+        int fd = ::accept4(listener_.get(), nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                static LogRateLimit failures;
+                log_error(&failures) << "cluster accept: " << errno_text(errno);
+            }
+            return;
+        }
+        if (!reactor_.add(fd)) {
+            ::close(fd);
+            continue;
+        }
+        set_tcp_options(fd, SocketOptions{});
+        auto peer = std::make_unique<Peer>(fd, max_frame_);
+        send(*peer, encode_frame(PeerOp::Hello, Varint{options_.node_id}));
+        peers_.emplace(fd, std::move(peer));
+    }
+}
+
+void ClusterNode::handle_peer(Peer& peer, const ReactorEvent& ev) {
+    int fd = peer.sock.get();
+    if (peer.connecting) {
+        int err = 0;
+        socklen_t len = sizeof err;
+        if (::getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+        if (err == EINPROGRESS || (!err && !ev.writable && !ev.hangup)) return;
+        if (err || ev.hangup) {
+            close_peer(fd);
+            return;
+        }
+        peer.connecting = false;
+        reactor_.set_interest(fd, true, false);
+        dirty_.push_back(fd);
+        return;
+    }
+
+    if (ev.writable && peer.want_write) dirty_.push_back(fd);
+    if (!ev.readable && !ev.hangup) return;
+    while (true) {
+        ssize_t n = peer.in.read_from(fd);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            close_peer(fd);
+            return;
+        }
+        if (n < 0) break;
+
+        Opcode op;
+        std::string_view body;
+        while (true) {
+            auto result = peer.framer.next(peer.in, op, body);
+            if (result == BinaryFramer::Result::NeedMore) break;
+            if (result == BinaryFramer::Result::TooLong) {
+                static LogRateLimit oversized;
+                log_warn(&oversized) << "Skipped an oversized frame from cluster node " << peer.node
+                                     << "; is its --max-line larger?";
+                continue;
+            }
+            if (result != BinaryFramer::Result::Frame ||
+                !handle_frame(peer, static_cast<PeerOp>(op), body)) {
+                log_warn() << "Malformed frame from cluster node " << peer.node << "; dropping the link.";
+                close_peer(fd);
+                return;
+            }
+        }
+    }
+    peer.in.release_if_empty();
+}
+
+void ClusterNode::drain_inbox() {
+    uint64_t count;
+    while (::read(wake_fd_.get(), &count, sizeof count) > 0) {}
+    wake_pending_.store(false, std::memory_order_release);
+    while (auto event = inbox_.pop()) handle_event(*event);
+}
+
+// --- Local Changes ---
+// Each is applied to this node's view and sent to every linked peer.
+
+void ClusterNode::handle_event(ClusterEvent& event) {
+    auto broadcast = [this](const MessageRef& frame) {
+        for (Peer* peer : links_) {
+            if (peer) send(*peer, frame);
+        }
+    };
+    std::visit([&](auto& e) {
+        using T = std::decay_t<decltype(e)>;
+        if constexpr (std::is_same_v<T, ClusterRoomCreated>) {
+            broadcast(encode_frame(PeerOp::Room, Rest{room_name(e.room)}));
+        } else if constexpr (std::is_same_v<T, ClusterMemberJoined>) {
+            const std::string& room = room_name(e.room);
+            local_members_[room].push_back(e.name);
+            broadcast(encode_frame(PeerOp::Join, Str{room}, Rest{e.name}));
+        } else if constexpr (std::is_same_v<T, ClusterMemberLeft>) {
+            const std::string& room = room_name(e.room);
+            auto it = local_members_.find(room);
+            if (it != local_members_.end()) {
+                auto& names = it->second;
+                if (auto pos = std::find(names.begin(), names.end(), e.name); pos != names.end()) {
+                    *pos = std::move(names.back());
+                    names.pop_back();
+                }
+                if (names.empty()) local_members_.erase(it);
+            }
+            broadcast(encode_frame(PeerOp::Leave, Str{room}, Rest{e.name}));
+        } else if constexpr (std::is_same_v<T, ClusterPublish>) {
+            // One frame, shared by the queue of every node with members.
+            uint64_t nodes = group_.directory().remote_nodes_of(e.room);
+            if (!nodes) return;
+            MessageRef frame =
+                encode_frame(PeerOp::Publish, Str{room_name(e.room)}, Str{e.color}, Str{e.sender}, Rest{e.text});
+            for (; nodes; nodes &= nodes - 1) {
+                if (Peer* peer = links_[std::countr_zero(nodes)]) send(*peer, frame);
+            }
+        }
+    }, event);
+}
+
+// --- Peer Frames ---
+
+bool ClusterNode::handle_frame(Peer& peer, PeerOp op, std::string_view body) {
+    if (op == PeerOp::Hello) return peer.node == 0 && handle_hello(peer, body);
+    if (peer.node == 0) return false;
+
+    RoomDirectory& directory = group_.directory();
+    std::string_view room, member;
+    switch (op) {
+    case PeerOp::Room:
+        local_room(body);
+        return true;
+    case PeerOp::Join:
+    case PeerOp::Member:
+    case PeerOp::Leave: {
+        if (!read_str(body, room)) return false;
+        member = body;
+        uint32_t id = local_room(room);
+        if (op != PeerOp::Leave) {
+            if (directory.add_remote(id, peer.node, member) && op == PeerOp::Join) {
+                notify(id, std::string(member) + " has joined the room.");
+            }
+        } else if (directory.remove_remote(id, peer.node, member)) {
+            notify(id, std::string(member) + " has left the room.");
+        }
+        return true;
+    }
+    case PeerOp::Publish: {
+        std::string_view color, sender;
+        if (!read_str(body, room) || !read_str(body, color) || !read_str(body, sender)) return false;
+        uint32_t id = local_room(room);
+        Payload payload = encode_both([&](Protocol p) { return encode_chat(p, id, color, sender, body); });
+        log_chat() << payload.text.view();
+        if (WriteAheadLog* wal = group_.wal()) wal->append_message(id, payload);
+        group_.shard(group_.owner_of(id)).post(ClusterDeliver{id, std::move(payload), true});
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+// Registers the link, replacing any older one to the same node (the node
+// restarted, or we have not noticed the old link die yet), then sends the
+// peer everything it needs to know about this node.
+bool ClusterNode::handle_hello(Peer& peer, std::string_view body) {
+    uint64_t node;
+    if (!read_varint(body, node) || node == 0 || node >= MAX_CLUSTER_NODES || node == options_.node_id) return false;
+    if (peer.dial >= 0 && options_.peers[peer.dial].node != node) {
+        log_warn() << "Cluster peer at " << options_.peers[peer.dial].host << ":" << options_.peers[peer.dial].port
+                   << " is node " << node << ", expected " << options_.peers[peer.dial].node << ".";
+        return false;
+    }
+    if (Peer* old = links_[node]) close_peer(old->sock.get());
+    peer.node = static_cast<uint32_t>(node);
+    links_[node] = &peer;
+    log_info() << "Linked to cluster node " << node << ".";
+    send_sync(peer);
+    return true;
+}
+
+// Every room this node knows, then its own members.
+void ClusterNode::send_sync(Peer& peer) {
+    for (const RoomSummary& room : group_.directory().summaries()) {
+        send(peer, encode_frame(PeerOp::Room, Rest{room.name}));
+    }
+    for (const auto& [room, names] : local_members_) {
+        for (const std::string& name : names) send(peer, encode_frame(PeerOp::Member, Str{room}, Rest{name}));
+    }
+}
+
+// --- Output ---
+
+void ClusterNode::send(Peer& peer, MessageRef frame) {
+    if (peer.out.empty()) dirty_.push_back(peer.sock.get());
+    peer.out.push(std::move(frame));
+}
+
+void ClusterNode::flush(Peer& peer) {
+    int fd = peer.sock.get();
+    if (peer.connecting) return;
+    switch (peer.out.flush(fd)) {
+    case OutboundQueue::FlushResult::Drained:
+        if (std::exchange(peer.want_write, false)) reactor_.set_interest(fd, true, false);
+        break;
+    case OutboundQueue::FlushResult::Blocked:
+        if (peer.out.bytes() > MAX_PEER_BACKLOG) {
+            log_warn() << "Cluster node " << peer.node << " is not keeping up; dropping the link.";
+            close_peer(fd);
+        } else if (!std::exchange(peer.want_write, true)) {
+            reactor_.set_interest(fd, true, true);
+        }
+        break;
+    case OutboundQueue::FlushResult::Error:
+        close_peer(fd);
+        break;
+    }
+}
+
+// Forgets the link and everything learned over it. Members of the lost
+// node leave their rooms as far as this node's clients can tell; each room
+// gets one line for all of them, not one per member.
+void ClusterNode::close_peer(int fd) {
+    auto it = peers_.find(fd);
+    if (it == peers_.end()) return;
+    std::unique_ptr<Peer> peer = std::move(it->second);
+    peers_.erase(it);
+    reactor_.remove(fd);
+    if (peer->dial >= 0) next_dial_[peer->dial] = monotonic_ms() + REDIAL_MS;
+    if (peer->node == 0 || links_[peer->node] != peer.get()) return;
+
+    links_[peer->node] = nullptr;
+    log_warn() << "Lost link to cluster node " << peer->node << ".";
+    for (auto [room, count] : group_.directory().remove_node(peer->node)) {
+        notify(room, std::to_string(count) + (count == 1 ? " member" : " members") + " on node " +
+                         std::to_string(peer->node) + " left.");
+    }
+}
+
+// --- Rooms ---
+
+const std::string& ClusterNode::room_name(uint32_t room) {
+    auto it = names_.find(room);
+    if (it == names_.end()) it = names_.emplace(room, group_.directory().name_of(room)).first;
+    return it->second;
+}
+
+// This node's id for a room named by a peer, creating the room if needed.
+uint32_t ClusterNode::local_room(std::string_view name) {
+    bool created = false;
+    uint32_t id = group_.directory().find_or_create(name, &created);
+    if (created) {
+        if (WriteAheadLog* wal = group_.wal()) wal->append_room(id, name);
+    }
+    return id;
+}
+
+// Tells this node's members of a room about a change on another node.
+void ClusterNode::notify(uint32_t room, std::string_view text) {
+    Payload payload = encode_both([&](Protocol p) { return encode_notice(p, room, text); });
+    group_.shard(group_.owner_of(room)).post(ClusterDeliver{room, std::move(payload), false});
+}
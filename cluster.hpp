@@ -0,0 +1,137 @@
+#pragma once
+
+#include "mpsc_queue.hpp"
+#include "network_utils.hpp"
+#include "outbound_queue.hpp"
+#include "protocol.hpp"
+#include "reactor.hpp"
+#include "recv_buffer.hpp"
+#include <array>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+// --- Cluster ---
+// Several server processes can act as one chat service. Nodes are numbered
+// 1 to 63 and keep a full mesh of TCP links: each node dials the peers with
+// higher ids and accepts links from lower ones. A room is identified
+// across the cluster by its name, and every node learns every room.
+//
+// Each node tells the others who joins and leaves its rooms. That replicated
+// membership answers $list_rooms and $list_members for the whole cluster.
+// It also gives every node a room -> nodes subscription table, so a chat
+// message goes once to each node with members in the room, never once per
+// member. The receiving node fans it out to its own members.
+//
+// When a link drops, that node's members are dropped with it, and each room
+// they were in hears one line saying how many left. The dialing side retries
+// every second, and a restored link starts with a full resync, which adds
+// the members back without announcing them one by one.
+//
+// Links carry the binary framing of the client protocol:
+//
+//     varint length | u8 PeerOp | body
+
+enum class PeerOp : uint8_t {
+    Hello = 0x01,   // varint node id; first frame in each direction
+    Room = 0x02,    // rest: room name
+    Join = 0x03,    // str room, rest: member name
+    Leave = 0x04,   // str room, rest: member name
+    Publish = 0x05, // str room, str color, str sender, rest: text
+    Member = 0x06,  // str room, rest: member name; a Join sent by the resync, not announced
+};
+
+struct ClusterPeer {
+    uint32_t node;
+    std::string host;
+    std::string port;
+};
+
+struct ClusterOptions {
+    uint32_t node_id = 0; // 1-63
+    std::string port;     // inter-node listener; empty = not clustered
+    std::vector<ClusterPeer> peers;
+};
+
+static constexpr uint32_t MAX_CLUSTER_NODES = 64; // node ids index a 64-bit mask
+
+// Parses "ID@HOST:PORT[,ID@HOST:PORT...]".
+bool parse_cluster_peers(std::string_view text, std::vector<ClusterPeer>& out);
+
+// What the shards tell the cluster thread. Rooms are named by their local
+// ids; the cluster thread translates.
+struct ClusterRoomCreated { uint32_t room; };
+struct ClusterMemberJoined { uint32_t room; std::string name; };
+struct ClusterMemberLeft { uint32_t room; std::string name; };
+struct ClusterPublish { uint32_t room; std::string_view color; std::string sender; std::string text; }; // color: one of COLORS
+
+using ClusterEvent =
+    std::variant<std::monostate, ClusterRoomCreated, ClusterMemberJoined, ClusterMemberLeft, ClusterPublish>;
+
+class ShardGroup;
+
+class ClusterNode {
+public:
+    // Binds the inter-node listener; throws std::runtime_error on failure.
+    // Frames are sized for names and text of up to `max_line` bytes.
+    ClusterNode(const ClusterOptions& options, size_t max_line, ShardGroup& group);
+
+    // Starts the link thread.
+    void start();
+
+    // Thread-safe: queue an event for the link thread.
+    void post(ClusterEvent event);
+
+private:
+    struct Peer {
+        Socket sock;
+        uint32_t node = 0;      // 0 until its Hello arrives
+        int dial = -1;          // index into options_.peers if we dialed it
+        bool connecting = false;
+        bool want_write = false;
+        RecvRing in;
+        BinaryFramer framer;
+        OutboundQueue out;
+
+        Peer(int fd, size_t max_frame) : sock(fd), in(max_frame + 16), framer(max_frame) {}
+    };
+
+    void run();
+    void dial_peers(uint64_t now);
+    void accept_peers();
+    void drain_inbox();
+    void handle_event(ClusterEvent& event);
+    void handle_peer(Peer& peer, const ReactorEvent& ev);
+    bool handle_frame(Peer& peer, PeerOp op, std::string_view body);
+    bool handle_hello(Peer& peer, std::string_view body);
+    void send_sync(Peer& peer);
+    void send(Peer& peer, MessageRef frame);
+    void flush(Peer& peer);
+    void close_peer(int fd);
+    const std::string& room_name(uint32_t room);
+    uint32_t local_room(std::string_view name);
+    void notify(uint32_t room, std::string_view text);
+
+    ClusterOptions options_;
+    size_t max_frame_;
+    ShardGroup& group_;
+    Socket listener_;
+    Socket wake_fd_;
+    MpscQueue<ClusterEvent> inbox_;
+    std::atomic<bool> wake_pending_{false};
+    PollReactor reactor_;
+
+    std::unordered_map<int, std::unique_ptr<Peer>> peers_; // fd -> peer
+    std::array<Peer*, MAX_CLUSTER_NODES> links_{};         // node -> established link
+    std::vector<uint64_t> next_dial_;                      // per options_.peers entry: ms, or NEVER while linked
+    std::vector<int> dirty_;                               // peers with output queued
+
+    // This node's own members by room name, to resync restored links.
+    std::map<std::string, std::vector<std::string>, std::less<>> local_members_;
+    std::unordered_map<uint32_t, std::string> names_; // local room id -> name
+};
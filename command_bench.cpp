@@ -0,0 +1,153 @@
+// Microbenchmark for text command parsing and dispatch.
+//
+// Runs a mix of command lines through the old stringstream parser and
+// through parse_command_line + CommandTable, reporting time and heap
+// allocations per command. Exits non-zero if the new path allocates.
+//
+//     ./command_bench [iterations]
+
+#include "command_table.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// --- Allocation Counting ---
+
+static std::atomic<size_t> g_allocations{0};
+
+void* operator new(size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+// --- Handlers ---
+// Stand-ins for the server's handlers: they only look at their arguments.
+
+static size_t g_sink = 0;
+
+using BenchHandler = void (*)(CommandArgs args);
+
+static void on_create(CommandArgs args) { g_sink += args.empty() ? 0 : args[0].size(); }
+static void on_join(CommandArgs args) { g_sink += args.empty() ? 0 : args[0].size() + 1; }
+static void on_leave(CommandArgs) { g_sink += 2; }
+static void on_list_rooms(CommandArgs) { g_sink += 3; }
+static void on_list_members(CommandArgs) { g_sink += 4; }
+static void on_unknown() { g_sink += 5; }
+
+static constexpr CommandTable<BenchHandler, 5> COMMANDS({{
+    {"create", on_create},
+    {"join", on_join},
+    {"leave", on_leave},
+    {"list_rooms", on_list_rooms},
+    {"list_members", on_list_members},
+}});
+
+// --- Legacy Path ---
+// The stringstream parser and if-chain the server used before.
+
+struct Command {
+    std::string name;
+    std::vector<std::string> args;
+};
+
+static std::optional<Command> legacy_parse(const std::string& line) {
+    if (line.empty() || line.rfind("$", 0) != 0) return std::nullopt;
+    std::stringstream ss(line);
+    std::string command_str;
+    ss >> command_str;
+    Command cmd;
+    cmd.name = command_str.substr(1);
+    std::string arg;
+    while (ss >> arg) cmd.args.push_back(arg);
+    return cmd;
+}
+
+static void legacy_dispatch(std::string_view line) {
+    auto command = legacy_parse(std::string(line));
+    if (!command) return;
+    std::vector<std::string_view> views(command->args.begin(), command->args.end());
+    if (command->name == "create") {
+        on_create(views);
+    } else if (command->name == "join") {
+        on_join(views);
+    } else if (command->name == "leave") {
+        on_leave(views);
+    } else if (command->name == "list_rooms") {
+        on_list_rooms(views);
+    } else if (command->name == "list_members") {
+        on_list_members(views);
+    } else {
+        on_unknown();
+    }
+}
+
+// --- Table Path ---
+
+static void table_dispatch(std::string_view line) {
+    CommandLine command;
+    if (!parse_command_line(line, command)) return;
+    if (const BenchHandler* handler = COMMANDS.find(command.name)) {
+        (*handler)(command.args());
+    } else {
+        on_unknown();
+    }
+}
+
+static constexpr std::array<std::string_view, 8> LINES = {
+    "$join general",
+    "$create a-rather-long-room-name-that-defeats-sso",
+    "$leave",
+    "$list_rooms",
+    "$list_members",
+    "$join   lobby   extra arguments are ignored",
+    "$nosuchcommand arg",
+    "$join",
+};
+
+struct Result {
+    double ns_per_op;
+    double allocs_per_op;
+};
+
+template <typename Dispatch>
+static Result run(Dispatch dispatch, size_t iterations) {
+    size_t allocs_before = g_allocations.load();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+        for (std::string_view line : LINES) dispatch(line);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    size_t ops = iterations * LINES.size();
+    size_t allocs = g_allocations.load() - allocs_before;
+    return {std::chrono::duration<double, std::nano>(elapsed).count() / ops, double(allocs) / ops};
+}
+
+int main(int argc, char* argv[]) {
+    size_t iterations = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 200000;
+    if (iterations == 0) iterations = 1;
+
+    run(table_dispatch, iterations / 10 + 1); // warm up
+    Result legacy = run(legacy_dispatch, iterations);
+    Result table = run(table_dispatch, iterations);
+
+    std::printf("%-12s %10s %12s\n", "path", "ns/cmd", "allocs/cmd");
+    std::printf("%-12s %10.1f %12.2f\n", "stringstream", legacy.ns_per_op, legacy.allocs_per_op);
+    std::printf("%-12s %10.1f %12.2f\n", "table", table.ns_per_op, table.allocs_per_op);
+    std::printf("(checksum %zu)\n", g_sink);
+
+    if (table.allocs_per_op != 0) {
+        std::fprintf(stderr, "table path allocated on the heap\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+
+// --- Command Parsing ---
+// "$name arg1 arg2 ..." lines are tokenized in place: the name and arguments
+// are views into the receive buffer, held in a fixed-size array, so parsing
+// a command never touches the heap.
+
+inline constexpr size_t MAX_COMMAND_ARGS = 8;
+
+using CommandArgs = std::span<const std::string_view>;
+
+struct CommandLine {
+    std::string_view line; // the whole line, for handlers that take free text
+    std::string_view name;
+    std::array<std::string_view, MAX_COMMAND_ARGS> arg_storage;
+    size_t arg_count = 0;
+
+    CommandArgs args() const { return {arg_storage.data(), arg_count}; }
+    // Argument `i` and everything after it (see rest_of_line).
+    std::string_view rest(size_t i) const;
+};
+
+inline constexpr bool is_command_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+// Splits a "$..." line on whitespace. Returns false for anything that is not
+// a command (i.e. a chat message). Arguments past MAX_COMMAND_ARGS are
+// ignored; handlers that want free text take everything after an argument
+// (see rest_of_line).
+inline bool parse_command_line(std::string_view line, CommandLine& out) {
+    if (line.empty() || line[0] != '$') return false;
+
+    out.line = line;
+    size_t pos = 1;
+    auto next_token = [&]() -> std::string_view {
+        while (pos < line.size() && is_command_space(line[pos])) ++pos;
+        size_t start = pos;
+        while (pos < line.size() && !is_command_space(line[pos])) ++pos;
+        return line.substr(start, pos - start);
+    };
+
+    // The name is glued to the '$', as with "$join".
+    size_t name_end = 1;
+    while (name_end < line.size() && !is_command_space(line[name_end])) ++name_end;
+    out.name = line.substr(1, name_end - 1);
+    pos = name_end;
+
+    out.arg_count = 0;
+    while (out.arg_count < MAX_COMMAND_ARGS) {
+        std::string_view token = next_token();
+        if (token.empty()) break;
+        out.arg_storage[out.arg_count++] = token;
+    }
+    return true;
+}
+
+// Everything on the line from the start of `arg` onwards, e.g. the message
+// text of "$msg bob hello there" given the view of "hello".
+inline std::string_view rest_of_line(std::string_view line, std::string_view arg) {
+    return line.substr(static_cast<size_t>(arg.data() - line.data()));
+}
+
+inline std::string_view CommandLine::rest(size_t i) const {
+    return rest_of_line(line, arg_storage[i]);
+}
+
+// --- Compile-time Dispatch Table ---
+// A perfect hash from command name to handler, computed by the compiler: the
+// constructor searches for a seed under which no two names collide, so a
+// lookup is one hash, one slot and one string comparison.
+template <typename Handler, size_t N>
+class CommandTable {
+public:
+    struct Entry {
+        std::string_view name;
+        Handler handler{};
+    };
+
+    static constexpr size_t SLOTS = std::bit_ceil(N * 2);
+
+    consteval explicit CommandTable(const std::array<Entry, N>& entries) {
+        for (uint32_t seed = 1; seed < 100000; ++seed) {
+            if (try_seed(entries, seed)) return;
+        }
+        throw std::logic_error("no perfect hash seed for command table");
+    }
+
+    constexpr const Handler* find(std::string_view name) const {
+        const Entry& slot = slots_[hash(name, seed_) & (SLOTS - 1)];
+        return !slot.name.empty() && slot.name == name ? &slot.handler : nullptr;
+    }
+
+private:
+    static constexpr uint32_t hash(std::string_view s, uint32_t seed) {
+        uint32_t h = 2166136261u ^ seed; // FNV-1a
+        for (char c : s) {
+            h ^= static_cast<uint8_t>(c);
+            h *= 16777619u;
+        }
+        return h ^ (h >> 15);
+    }
+
+    constexpr bool try_seed(const std::array<Entry, N>& entries, uint32_t seed) {
+        std::array<Entry, SLOTS> slots{};
+        for (const Entry& e : entries) {
+            Entry& slot = slots[hash(e.name, seed) & (SLOTS - 1)];
+            if (!slot.name.empty()) return false;
+            slot = e;
+        }
+        slots_ = slots;
+        seed_ = seed;
+        return true;
+    }
+
+    std::array<Entry, SLOTS> slots_{};
+    uint32_t seed_ = 0;
+};
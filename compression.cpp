@@ -0,0 +1,116 @@
+#include "compression.hpp"
+#include <zlib.h>
+#include <algorithm>
+#include <vector>
+
+// Phrases the server sends most, most frequent last (deflate prefers
+// nearer matches). Changing this breaks every client that has a copy.
+static constexpr std::string_view DEFLATE_DICTIONARY =
+    "[System]: Available rooms:\n  - members)\n[System]: Members in '':\n  - (This room is empty)\n"
+    "[Error]: You must join a room to chat. Use $join <room_name>\n[System]: You have left room ''.\n"
+    "[System]: You have joined room ''.\n\n[System]:  has left the room.\n\n[System]:  has joined the room.\n"
+    "\033[31m[\033[32m[\033[33m[\033[34m[\033[35m[\033[36m[]: \033[0m";
+
+namespace {
+
+// deflateInit allocates a few hundred KiB, so each thread keeps one stream
+// and resets it per message.
+struct Deflater {
+    z_stream zs{};
+    bool ok;
+    std::vector<unsigned char> out;
+
+    Deflater() { ok = deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK; }
+    ~Deflater() {
+        if (ok) deflateEnd(&zs);
+    }
+};
+
+struct Inflater {
+    z_stream zs{};
+    bool ok;
+
+    Inflater() { ok = inflateInit2(&zs, -15) == Z_OK; }
+    ~Inflater() {
+        if (ok) inflateEnd(&zs);
+    }
+};
+
+} // namespace
+
+std::string_view deflate_message(std::string_view message, Codec& codec) {
+    codec = Codec::Stored;
+    if (message.size() < MIN_DEFLATE_BYTES) return message;
+
+    thread_local Deflater d;
+    if (!d.ok || deflateReset(&d.zs) != Z_OK ||
+        deflateSetDictionary(&d.zs, reinterpret_cast<const Bytef*>(DEFLATE_DICTIONARY.data()),
+                             static_cast<uInt>(DEFLATE_DICTIONARY.size())) != Z_OK) {
+        return message;
+    }
+    d.out.resize(deflateBound(&d.zs, static_cast<uLong>(message.size())));
+    d.zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(message.data()));
+    d.zs.avail_in = static_cast<uInt>(message.size());
+    d.zs.next_out = d.out.data();
+    d.zs.avail_out = static_cast<uInt>(d.out.size());
+    if (deflate(&d.zs, Z_FINISH) != Z_STREAM_END || d.zs.total_out >= message.size()) return message;
+    codec = Codec::Deflate;
+    return {reinterpret_cast<const char*>(d.out.data()), d.zs.total_out};
+}
+
+static bool inflate_into(std::string_view data, std::string& out) {
+    thread_local Inflater inf;
+    if (!inf.ok || inflateReset(&inf.zs) != Z_OK ||
+        inflateSetDictionary(&inf.zs, reinterpret_cast<const Bytef*>(DEFLATE_DICTIONARY.data()),
+                             static_cast<uInt>(DEFLATE_DICTIONARY.size())) != Z_OK) {
+        return false;
+    }
+    inf.zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    inf.zs.avail_in = static_cast<uInt>(data.size());
+    while (true) {
+        size_t used = out.size();
+        out.resize(used + std::max<size_t>(4 * data.size(), 256));
+        inf.zs.next_out = reinterpret_cast<Bytef*>(out.data() + used);
+        inf.zs.avail_out = static_cast<uInt>(out.size() - used);
+        int rc = inflate(&inf.zs, Z_NO_FLUSH);
+        out.resize(out.size() - inf.zs.avail_out);
+        if (rc == Z_STREAM_END) return true;
+        if (rc != Z_OK) return false;
+    }
+}
+
+bool inflate_envelopes(std::string& in, std::string& out) {
+    size_t pos = 0;
+    while (pos < in.size()) {
+        // varint length
+        uint64_t len = 0;
+        size_t header = 0;
+        bool complete = false;
+        for (; pos + header < in.size() && header < 10; ++header) {
+            uint8_t byte = static_cast<uint8_t>(in[pos + header]);
+            len |= uint64_t(byte & 0x7f) << (7 * header);
+            if (!(byte & 0x80)) {
+                complete = true;
+                ++header;
+                break;
+            }
+        }
+        if (!complete) {
+            if (header == 10) return false;
+            break;
+        }
+        if (len == 0) return false;
+        if (in.size() - pos - header < len) break;
+
+        auto codec = static_cast<Codec>(in[pos + header]);
+        std::string_view data(in.data() + pos + header + 1, len - 1);
+        if (codec == Codec::Stored) {
+            out.append(data);
+        } else if (codec != Codec::Deflate || !inflate_into(data, out)) {
+            return false;
+        }
+        pos += header + len;
+    }
+    in.erase(0, pos);
+    return true;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// --- Compressed Envelopes ---
+// A client that sends "compress=deflate" in its $hello is first told, in a
+// plain "$hello compress=<codec>" line (a Compression frame in binary),
+// whether the server agreed; one started with --compression=off answers
+// compress=none. If it did, everything after that line comes in envelopes:
+//
+//     varint length | u8 codec | data (length - 1 bytes)
+//
+// Each envelope holds exactly the bytes the client would otherwise have been
+// sent: text lines or binary frames. Each one is compressed on its own, with
+// no state carried from one to the next. That costs some ratio against a
+// stream compressor, but one compressed broadcast can then be shared by
+// every recipient, like the plain encodings. A preset dictionary of the
+// server's usual strings keeps short messages from growing. Input from
+// clients is never compressed.
+
+enum class Codec : uint8_t {
+    Stored = 0x00,  // data is the message as is
+    Deflate = 0x01, // raw deflate (RFC 1951) with DEFLATE_DICTIONARY preset
+};
+
+// Messages shorter than this are stored: deflate rarely wins on them.
+inline constexpr size_t MIN_DEFLATE_BYTES = 32;
+
+// The data for `message`'s envelope: deflated unless that would not make it
+// smaller, in which case `codec` is Stored and `message` is returned. A
+// deflated result lives in a per-thread buffer until the next call.
+std::string_view deflate_message(std::string_view message, Codec& codec);
+
+// Splits complete envelopes off the front of `in` and appends their decoded
+// contents to `out`. Incomplete envelopes are left in `in`. False if an
+// envelope is corrupt.
+bool inflate_envelopes(std::string& in, std::string& out);
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// --- Epoch-Based Reclamation ---
+// Lets threads read shared objects without locks while another thread
+// replaces them. A reader brackets its accesses with a Guard; a writer that
+// unlinks an object retires it instead of freeing it, and the object is only
+// released once every thread has left the epoch in which it was retired.
+//
+// Participants are numbered 0..n-1 (the shards) and each one only ever
+// touches its own slot and retire list, so there is nothing to lock.
+class EpochDomain {
+public:
+    explicit EpochDomain(size_t participants)
+        : slots_(std::make_unique<Slot[]>(participants)), count_(participants) {}
+
+    class Guard {
+    public:
+        Guard(EpochDomain& domain, size_t participant) : epoch_(domain.slots_[participant].epoch) {
+            epoch_.store(domain.global_.load(std::memory_order_acquire), std::memory_order_relaxed);
+            // The announcement must be visible before any shared pointer is read.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+        ~Guard() { epoch_.store(IDLE, std::memory_order_release); }
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+
+    private:
+        std::atomic<uint64_t>& epoch_;
+    };
+
+    // Hands over an unlinked object; dropping the reference frees it (or
+    // just releases this owner's share of it).
+    void retire(size_t participant, std::shared_ptr<const void> object) {
+        if (!object) return;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        slots_[participant].retired.push_back({global_.load(std::memory_order_acquire), std::move(object)});
+        collect(participant);
+    }
+
+    // Frees whatever this participant retired that no reader can still see.
+    void collect(size_t participant) {
+        std::vector<Retired>& list = slots_[participant].retired;
+        if (list.empty()) return;
+        try_advance();
+        uint64_t now = global_.load(std::memory_order_acquire);
+        size_t keep = 0;
+        for (Retired& r : list) {
+            if (r.epoch + 2 > now) list[keep++] = std::move(r);
+        }
+        list.resize(keep);
+    }
+
+    bool has_garbage(size_t participant) const { return !slots_[participant].retired.empty(); }
+
+private:
+    static constexpr uint64_t IDLE = UINT64_MAX;
+
+    struct Retired {
+        uint64_t epoch;
+        std::shared_ptr<const void> object;
+    };
+
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> epoch{IDLE}; // announced epoch, IDLE outside a Guard
+        std::vector<Retired> retired;      // touched only by the owning participant
+    };
+
+    // The epoch moves on once every active reader has caught up with it.
+    void try_advance() {
+        uint64_t current = global_.load(std::memory_order_acquire);
+        for (size_t i = 0; i < count_; ++i) {
+            uint64_t e = slots_[i].epoch.load(std::memory_order_seq_cst);
+            if (e != IDLE && e != current) return;
+        }
+        global_.compare_exchange_strong(current, current + 1, std::memory_order_acq_rel);
+    }
+
+    alignas(64) std::atomic<uint64_t> global_{0};
+    std::unique_ptr<Slot[]> slots_;
+    size_t count_;
+};
@@ -0,0 +1,54 @@
+#include "fanout.hpp"
+#include <algorithm>
+
+FanoutPool::FanoutPool(unsigned workers) {
+    for (unsigned i = 1; i <= workers; ++i) threads_.emplace_back([this, i] { work(i); });
+}
+
+FanoutPool::~FanoutPool() {
+    {
+        std::lock_guard lock(mtx_);
+        stopping_ = true;
+    }
+    work_cv_.notify_all();
+    for (auto& t : threads_) t.join();
+}
+
+void FanoutPool::drain(Job& job, size_t participant) {
+    for (size_t chunk; (chunk = job.next.fetch_add(1, std::memory_order_relaxed)) < job.chunks;) {
+        (*job.task)(participant, chunk);
+    }
+}
+
+// Several shards may run jobs at once; workers help with the oldest, and
+// each caller works on its own, so every job finishes even if all the
+// workers are busy elsewhere.
+void FanoutPool::run(size_t chunks, const Task& task) {
+    Job job{&task, chunks};
+    {
+        std::lock_guard lock(mtx_);
+        jobs_.push_back(&job);
+    }
+    work_cv_.notify_all();
+    drain(job, 0);
+
+    // Every chunk is claimed; wait for the workers still running theirs.
+    std::unique_lock lock(mtx_);
+    std::erase(jobs_, &job);
+    done_cv_.wait(lock, [&] { return job.active == 0; });
+}
+
+void FanoutPool::work(size_t participant) {
+    std::unique_lock lock(mtx_);
+    while (true) {
+        work_cv_.wait(lock, [&] { return stopping_ || !jobs_.empty(); });
+        if (stopping_) return;
+        Job* job = jobs_.front();
+        ++job->active;
+        lock.unlock();
+        drain(*job, participant);
+        lock.lock();
+        if (!jobs_.empty() && jobs_.front() == job) jobs_.pop_front();
+        if (--job->active == 0) done_cv_.notify_all();
+    }
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// --- Parallel Fan-out ---
+// A room with tens of thousands of members on one shard turns every message
+// into a long loop of queue pushes followed by as many writes, and the shard
+// handles nothing else until both are done. Above --fanout-threshold the
+// shard cuts the member list (and later its list of connections to flush)
+// into chunks and runs them on a pool of worker threads shared by all
+// shards, taking chunks itself while it waits.
+//
+// The shard thread blocks until every chunk is done, so workers can touch
+// its connections without locks: nothing else does in the meantime, and
+// each connection is in exactly one chunk. Messages therefore still reach
+// every connection in the order the shard handled them. Workers do not
+// touch anything else of the shard's; each records what it did in its own
+// FanoutBatch, which the shard applies afterwards.
+
+struct FanoutOptions {
+    unsigned workers = 0;    // worker threads; 0 = every shard fans out alone
+    size_t threshold = 4096; // connections on one shard above which work is split
+};
+
+// What one participant did during a parallel fan-out or flush, for the shard
+// to account for once it is over.
+struct FanoutBatch {
+    size_t messages = 0;       // queued
+    size_t queued_bytes = 0;
+    size_t written_bytes = 0;
+    std::vector<int> dirty;    // newly holding output
+    std::vector<int> crowded;  // past the low watermark: flush early, maybe backpressure
+    std::vector<int> unshared; // want an envelope the payload lacks: send on the shard
+    std::vector<int> blocked;  // socket full: wait for it to be writable
+    std::vector<int> failed;   // write error: close
+
+    void clear() {
+        messages = queued_bytes = written_bytes = 0;
+        dirty.clear();
+        crowded.clear();
+        unshared.clear();
+        blocked.clear();
+        failed.clear();
+    }
+};
+
+class FanoutPool {
+public:
+    static constexpr size_t CHUNK = 1024; // connections per chunk
+
+    explicit FanoutPool(unsigned workers);
+    ~FanoutPool();
+
+    FanoutPool(const FanoutPool&) = delete;
+    FanoutPool& operator=(const FanoutPool&) = delete;
+
+    // The calling thread plus the workers.
+    size_t participants() const { return threads_.size() + 1; }
+
+    // Calls task(participant, chunk) for every chunk in [0, chunks) on the
+    // workers and the calling thread, and returns once all have run. The
+    // caller is participant 0 and workers are 1 and up, so a task can keep
+    // per-participant state without locking.
+    using Task = std::function<void(size_t participant, size_t chunk)>;
+    void run(size_t chunks, const Task& task);
+
+private:
+    struct Job {
+        const Task* task;
+        size_t chunks;
+        std::atomic<size_t> next{0}; // first unclaimed chunk
+        unsigned active = 0;         // workers on it; mtx_ held
+    };
+
+    void work(size_t participant);
+    static void drain(Job& job, size_t participant);
+
+    std::mutex mtx_;
+    std::condition_variable work_cv_; // a job was queued, or stopping
+    std::condition_variable done_cv_; // a worker left a job
+    std::deque<Job*> jobs_;           // with chunks left to claim, oldest first
+    bool stopping_ = false;
+    std::vector<std::thread> threads_;
+};
+
+inline size_t fanout_chunks(size_t count) {
+    return (count + FanoutPool::CHUNK - 1) / FanoutPool::CHUNK;
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include "protocol.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// --- Room History ---
+// The last few chat messages of a room, kept by the room's owning shard so
+// that late joiners can catch up. Messages are stored already encoded for
+// both protocols, so a replay is a straight copy into one outgoing buffer.
+
+struct HistoryLimits {
+    size_t messages = 100;                 // per room
+    size_t room_bytes = 64 * 1024;         // per room arena
+    size_t total_bytes = 64 * 1024 * 1024; // across all rooms
+    size_t replay_on_join = 0;             // messages sent to a client when it joins
+};
+
+// Charged for every room arena, so history memory stays bounded however
+// many rooms are created. Shared by all shards.
+class HistoryBudget {
+public:
+    explicit HistoryBudget(size_t limit) : limit_(limit) {}
+
+    bool reserve(size_t bytes) {
+        size_t used = used_.load(std::memory_order_relaxed);
+        do {
+            if (used + bytes > limit_) return false;
+        } while (!used_.compare_exchange_weak(used, used + bytes, std::memory_order_relaxed));
+        return true;
+    }
+
+    size_t used() const { return used_.load(std::memory_order_relaxed); }
+    size_t limit() const { return limit_; }
+
+private:
+    std::atomic<size_t> used_{0};
+    size_t limit_;
+};
+
+// Fixed-memory ring of messages: a byte arena for the encodings plus a ring
+// of record descriptors. Appending evicts the oldest messages until both the
+// message and byte limits hold. Nothing is allocated after the first append.
+class HistoryRing {
+public:
+    HistoryRing(size_t max_messages, size_t capacity) : records_(max_messages), capacity_(capacity) {}
+
+    size_t count() const { return count_; }
+    size_t bytes_used() const { return static_cast<size_t>(tail_ - head_); }
+    size_t capacity() const { return capacity_; }
+
+    void append(const Payload& payload) {
+        size_t text = payload.text.size(), binary = payload.binary.size();
+        if (records_.empty() || text + binary > capacity_) return;
+        if (!arena_) arena_ = std::make_unique<char[]>(capacity_);
+
+        while (count_ > 0 && (count_ == records_.size() || bytes_used() + text + binary > capacity_)) {
+            Record& oldest = records_[first_];
+            head_ = oldest.pos + oldest.text + oldest.binary;
+            first_ = (first_ + 1) % records_.size();
+            --count_;
+        }
+        if (count_ == 0) head_ = tail_;
+
+        Record& record = records_[(first_ + count_) % records_.size()];
+        record = {tail_, static_cast<uint32_t>(text), static_cast<uint32_t>(binary)};
+        ++count_;
+        put(payload.text.view());
+        put(payload.binary.view());
+    }
+
+    // Size of the last `n` messages in protocol `p`.
+    size_t encoded_size(size_t n, Protocol p) const {
+        size_t total = 0;
+        for (size_t i = count_ - std::min(n, count_); i < count_; ++i) total += field(record(i), p).second;
+        return total;
+    }
+
+    // Message `i` (0 = oldest) in protocol `p`.
+    std::string message(size_t i, Protocol p) const {
+        std::string out(field(record(i), p).second, '\0');
+        copy_one(record(i), p, out.data());
+        return out;
+    }
+
+    // Copies the last `n` messages in protocol `p`, oldest first.
+    char* copy_last(size_t n, Protocol p, char* out) const {
+        for (size_t i = count_ - std::min(n, count_); i < count_; ++i) out = copy_one(record(i), p, out);
+        return out;
+    }
+
+private:
+    struct Record {
+        uint64_t pos = 0; // arena offset of the text encoding, binary follows
+        uint32_t text = 0;
+        uint32_t binary = 0;
+    };
+
+    const Record& record(size_t i) const { return records_[(first_ + i) % records_.size()]; }
+
+    static std::pair<uint64_t, size_t> field(const Record& r, Protocol p) {
+        if (p == Protocol::Binary) return {r.pos + r.text, r.binary};
+        return {r.pos, r.text};
+    }
+
+    char* copy_one(const Record& r, Protocol p, char* out) const {
+        auto [pos, len] = field(r, p);
+        size_t start = static_cast<size_t>(pos % capacity_);
+        size_t first = std::min(len, capacity_ - start);
+        std::memcpy(out, arena_.get() + start, first);
+        std::memcpy(out + first, arena_.get(), len - first);
+        return out + len;
+    }
+
+    void put(std::string_view bytes) {
+        size_t start = static_cast<size_t>(tail_ % capacity_);
+        size_t first = std::min(bytes.size(), capacity_ - start);
+        std::memcpy(arena_.get() + start, bytes.data(), first);
+        std::memcpy(arena_.get(), bytes.data() + first, bytes.size() - first);
+        tail_ += bytes.size();
+    }
+
+    std::vector<Record> records_;  // ring of max_messages descriptors
+    size_t first_ = 0;             // index of the oldest record
+    size_t count_ = 0;
+    std::unique_ptr<char[]> arena_;
+    size_t capacity_;
+    uint64_t head_ = 0; // arena position of the oldest byte
+    uint64_t tail_ = 0; // arena position of the next byte
+};
+
+// The last `n` messages as a single buffer: a header followed by the stored
+// messages, so a replay is one queued write.
+inline MessageRef encode_history(Protocol p, uint32_t room_id, std::string_view room, const HistoryRing& history,
+                                 size_t n) {
+    n = std::min(n, history.count());
+    std::string header;
+    if (p == Protocol::Binary) {
+        append_varint(header, room_id);
+        append_varint(header, n);
+        append_varint(header, history.bytes_used());
+        append_varint(header, history.capacity());
+        header = std::string(encode_frame_body(Opcode::History, header).view());
+    } else if (n == 0) {
+        header = "[System]: No messages in '" + std::string(room) + "' yet.\n";
+    } else {
+        header = "[System]: Last " + std::to_string(n) + " messages in '" + std::string(room) + "' (" +
+                 std::to_string(history.bytes_used()) + " of " + std::to_string(history.capacity()) +
+                 " bytes used):\n";
+    }
+    return MessageRef::build(header.size() + history.encoded_size(n, p), [&](char* out) {
+        out = std::copy(header.begin(), header.end(), out);
+        history.copy_last(n, p, out);
+    });
+}
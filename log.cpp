@@ -0,0 +1,289 @@
+#include "log.hpp"
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+#include <ctime>
+#include <algorithm>
+#include <memory>
+#include <thread>
+
+namespace log_detail {
+std::atomic<uint8_t> min_level{static_cast<uint8_t>(LogLevel::Info)};
+std::atomic<bool> chat_enabled{true};
+} // namespace log_detail
+
+namespace {
+
+// --- Ring Layout ---
+// Records are 8-byte aligned and never wrap: a producer that would run past
+// the end first claims the rest of the ring as padding. A record's size is
+// stored last, with release ordering, so a non-zero size means the record is
+// complete. The flusher zeroes what it has consumed before handing the space
+// back, so stale bytes never look like a committed record.
+
+constexpr size_t RING_BYTES = 1 << 20;
+constexpr size_t MAX_TEXT = 16 * 1024; // longer lines are cut short
+constexpr size_t WRITE_BATCH = 64 * 1024;
+constexpr uint8_t PADDING = 0xff;
+
+struct RecordHeader {
+    uint32_t size; // whole record; 0 until committed
+    uint8_t level; // PADDING for the unused tail of the ring
+    uint8_t reserved[3];
+    uint32_t length; // of the text that follows
+    uint32_t reserved2;
+    uint64_t time_ns; // CLOCK_REALTIME
+};
+
+constexpr size_t align8(size_t n) { return (n + 7) & ~size_t{7}; }
+
+constexpr const char* LEVEL_NAMES[] = {"DEBUG", "INFO ", "WARN ", "ERROR"};
+
+class AsyncLog {
+public:
+    AsyncLog() : ring_(new char[RING_BYTES]()), wake_fd_(::eventfd(0, EFD_CLOEXEC)) {}
+
+    void push(LogLevel level, std::string_view text);
+    void start();
+    void stop();
+
+private:
+    void run();
+    bool drain(std::string& out);
+    void write_out(std::string& out);
+    void format(const RecordHeader& header, std::string_view text, std::string& out);
+
+    std::unique_ptr<char[]> ring_;
+    alignas(64) std::atomic<uint64_t> reserved_{0}; // producers claim space here
+    alignas(64) std::atomic<uint64_t> released_{0}; // the flusher has consumed up to here
+    std::atomic<uint64_t> dropped_{0};
+
+    int wake_fd_;
+    std::atomic<bool> wake_pending_{false};
+    std::atomic<bool> stopping_{false};
+    std::thread flusher_;
+
+    // Flusher only: the formatted prefix of the current second.
+    int64_t cached_second_ = -1;
+    char cached_time_[32] = {};
+};
+
+AsyncLog& async_log() {
+    static AsyncLog* log = new AsyncLog; // never destroyed; threads may log during exit
+    return *log;
+}
+
+thread_local std::string t_line;
+thread_local bool t_line_busy = false;
+
+} // namespace
+
+void AsyncLog::push(LogLevel level, std::string_view text) {
+    if (!text.empty() && text.back() == '\n') text.remove_suffix(1);
+    if (text.size() > MAX_TEXT) text = text.substr(0, MAX_TEXT);
+    size_t record = align8(sizeof(RecordHeader) + text.size());
+
+    uint64_t pos = reserved_.load(std::memory_order_relaxed);
+    size_t padding;
+    while (true) {
+        size_t offset = pos & (RING_BYTES - 1);
+        padding = offset + record > RING_BYTES ? RING_BYTES - offset : 0;
+        if (pos + padding + record - released_.load(std::memory_order_acquire) > RING_BYTES) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (reserved_.compare_exchange_weak(pos, pos + padding + record, std::memory_order_acq_rel)) break;
+    }
+
+    char* ring = ring_.get();
+    if (padding) {
+        auto* pad = reinterpret_cast<RecordHeader*>(ring + (pos & (RING_BYTES - 1)));
+        pad->level = PADDING;
+        std::atomic_ref<uint32_t>(pad->size).store(static_cast<uint32_t>(padding), std::memory_order_release);
+    }
+    auto* header = reinterpret_cast<RecordHeader*>(ring + ((pos + padding) & (RING_BYTES - 1)));
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header->level = static_cast<uint8_t>(level);
+    header->length = static_cast<uint32_t>(text.size());
+    header->time_ns = uint64_t(ts.tv_sec) * 1000000000u + uint64_t(ts.tv_nsec);
+    std::memcpy(header + 1, text.data(), text.size());
+    std::atomic_ref<uint32_t>(header->size).store(static_cast<uint32_t>(record), std::memory_order_release);
+
+    // Only the first line after a drain pays for the eventfd write.
+    if (!wake_pending_.exchange(true, std::memory_order_acq_rel)) {
+        uint64_t one = 1;
+        [[maybe_unused]] ssize_t n = ::write(wake_fd_, &one, sizeof one);
+    }
+}
+
+void AsyncLog::start() {
+    if (wake_fd_ == -1) {
+        perror("log eventfd");
+        return;
+    }
+    flusher_ = std::thread([this] { run(); });
+}
+
+void AsyncLog::stop() {
+    if (flusher_.joinable()) {
+        stopping_.store(true, std::memory_order_release);
+        uint64_t one = 1;
+        [[maybe_unused]] ssize_t n = ::write(wake_fd_, &one, sizeof one);
+        flusher_.join();
+    } else {
+        std::string out;
+        drain(out);
+        write_out(out);
+    }
+}
+
+void AsyncLog::run() {
+    std::string out;
+    out.reserve(2 * WRITE_BATCH);
+    while (true) {
+        uint64_t count;
+        if (::read(wake_fd_, &count, sizeof count) < 0 && errno != EINTR) {
+            perror("log eventfd read");
+            return;
+        }
+        // Clear the flag before draining so a line pushed during the drain
+        // signals again instead of waiting for the next one.
+        wake_pending_.store(false, std::memory_order_release);
+        bool stopping = stopping_.load(std::memory_order_acquire);
+        drain(out);
+        write_out(out);
+        if (stopping) return;
+    }
+}
+
+// Formats every committed record into `out`, writing whenever a batch is
+// full. Stops early at a record a producer has claimed but not finished;
+// that producer's wakeup brings the flusher back for it.
+bool AsyncLog::drain(std::string& out) {
+    char* ring = ring_.get();
+    uint64_t pos = released_.load(std::memory_order_relaxed);
+    uint64_t end = reserved_.load(std::memory_order_acquire);
+    bool any = false;
+    while (pos < end) {
+        auto* header = reinterpret_cast<RecordHeader*>(ring + (pos & (RING_BYTES - 1)));
+        uint32_t size = std::atomic_ref<uint32_t>(header->size).load(std::memory_order_acquire);
+        if (size == 0) break;
+        if (header->level != PADDING) {
+            format(*header, {reinterpret_cast<const char*>(header + 1), header->length}, out);
+            any = true;
+        }
+        std::memset(header, 0, size);
+        pos += size;
+        if (out.size() >= WRITE_BATCH) {
+            released_.store(pos, std::memory_order_release);
+            write_out(out);
+        }
+    }
+    released_.store(pos, std::memory_order_release);
+
+    if (uint64_t dropped = dropped_.exchange(0, std::memory_order_relaxed)) {
+        timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        RecordHeader header{};
+        header.level = static_cast<uint8_t>(LogLevel::Warn);
+        header.time_ns = uint64_t(ts.tv_sec) * 1000000000u + uint64_t(ts.tv_nsec);
+        std::string text = std::to_string(dropped) + " log lines dropped (log buffer full)";
+        format(header, text, out);
+    }
+    return any;
+}
+
+// "2026-01-31 12:34:56.789 INFO  text"
+void AsyncLog::format(const RecordHeader& header, std::string_view text, std::string& out) {
+    int64_t second = static_cast<int64_t>(header.time_ns / 1000000000u);
+    if (second != cached_second_) {
+        time_t t = static_cast<time_t>(second);
+        tm local;
+        localtime_r(&t, &local);
+        std::strftime(cached_time_, sizeof cached_time_, "%Y-%m-%d %H:%M:%S", &local);
+        cached_second_ = second;
+    }
+    char millis[8];
+    std::snprintf(millis, sizeof millis, ".%03u ", static_cast<unsigned>(header.time_ns / 1000000u % 1000u));
+    out.append(cached_time_).append(millis).append(LEVEL_NAMES[std::min<uint8_t>(header.level, 3)]);
+    out.push_back(' ');
+    out.append(text);
+    out.push_back('\n');
+}
+
+void AsyncLog::write_out(std::string& out) {
+    size_t done = 0;
+    while (done < out.size()) {
+        ssize_t n = ::write(STDOUT_FILENO, out.data() + done, out.size() - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break; // nowhere to report it; the lines are lost
+        }
+        done += static_cast<size_t>(n);
+    }
+    out.clear();
+}
+
+// --- Public Interface ---
+
+bool parse_log_level(std::string_view text, LogLevel& out) {
+    if (text == "debug") out = LogLevel::Debug;
+    else if (text == "info") out = LogLevel::Info;
+    else if (text == "warn") out = LogLevel::Warn;
+    else if (text == "error") out = LogLevel::Error;
+    else return false;
+    return true;
+}
+
+void log_start(const LogOptions& options) {
+    log_detail::min_level.store(static_cast<uint8_t>(options.level), std::memory_order_relaxed);
+    log_detail::chat_enabled.store(options.chat, std::memory_order_relaxed);
+    async_log().start();
+}
+
+void log_stop() { async_log().stop(); }
+
+bool LogRateLimit::allow(uint64_t& suppressed) {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    uint64_t now = static_cast<uint64_t>(ts.tv_sec);
+    uint64_t window = window_.load(std::memory_order_relaxed);
+    if (window != now && window_.compare_exchange_strong(window, now, std::memory_order_relaxed)) {
+        count_.store(0, std::memory_order_relaxed);
+    }
+    if (count_.fetch_add(1, std::memory_order_relaxed) >= per_second_) {
+        suppressed_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+    return true;
+}
+
+LogLine::LogLine(LogLevel level, bool enabled, LogRateLimit* limit) : level_(level) {
+    // A line logged while building another on the same thread is dropped
+    // rather than mixed into it.
+    if (!enabled || t_line_busy || (limit && !limit->allow(suppressed_))) return;
+    t_line_busy = true;
+    t_line.clear();
+    text_ = &t_line;
+}
+
+LogLine::~LogLine() {
+    if (!text_) return;
+    if (suppressed_) *this << " (" << suppressed_ << " similar lines suppressed)";
+    async_log().push(level_, *text_);
+    t_line_busy = false;
+}
+
+void LogLine::append_number(long long value) {
+    char buf[24];
+    text_->append(buf, std::to_chars(buf, buf + sizeof buf, value).ptr);
+}
+
+void LogLine::append_number(unsigned long long value) {
+    char buf[24];
+    text_->append(buf, std::to_chars(buf, buf + sizeof buf, value).ptr);
+}
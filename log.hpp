@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+// --- Asynchronous Log ---
+// Event loops never write to stdout themselves. A log line is formatted into
+// a thread-local buffer and copied into a lock-free ring. A background thread
+// drains the ring and writes it out in large batches, so a slow pipe or
+// journald stalls only that thread. When the ring is full, lines are dropped
+// and counted rather than waited for.
+//
+//     log_info() << name << " connected on fd " << fd;
+//
+// Lines below the configured level cost one comparison. Error paths that can
+// repeat (accept failures, a full descriptor table) pass a LogRateLimit, so
+// a storm of identical errors becomes a few lines a second plus a count of
+// what was suppressed.
+
+enum class LogLevel : uint8_t { Debug, Info, Warn, Error };
+
+struct LogOptions {
+    LogLevel level = LogLevel::Info;
+    bool chat = true; // log chat message contents
+};
+
+bool parse_log_level(std::string_view text, LogLevel& out);
+
+// Starts the flusher thread. Lines logged earlier wait in the ring.
+void log_start(const LogOptions& options);
+
+// Writes out everything logged so far and stops the flusher.
+void log_stop();
+
+// Lets up to `per_second` lines a second through from one call site.
+class LogRateLimit {
+public:
+    explicit constexpr LogRateLimit(uint32_t per_second = 10) : per_second_(per_second) {}
+
+    // False if the line should be suppressed. Otherwise `suppressed` is the
+    // number of lines held back since the last one let through.
+    bool allow(uint64_t& suppressed);
+
+private:
+    uint32_t per_second_;
+    std::atomic<uint64_t> window_{0}; // current second
+    std::atomic<uint32_t> count_{0};  // lines let through in it
+    std::atomic<uint64_t> suppressed_{0};
+};
+
+// One line under construction; it is queued when the LogLine is destroyed.
+class LogLine {
+public:
+    LogLine(LogLevel level, bool enabled, LogRateLimit* limit = nullptr);
+    ~LogLine();
+
+    LogLine(const LogLine&) = delete;
+    LogLine& operator=(const LogLine&) = delete;
+
+    LogLine& operator<<(std::string_view text) {
+        if (text_) text_->append(text);
+        return *this;
+    }
+    LogLine& operator<<(const char* text) { return *this << std::string_view(text); }
+    LogLine& operator<<(const std::string& text) { return *this << std::string_view(text); }
+    LogLine& operator<<(char c) {
+        if (text_) text_->push_back(c);
+        return *this;
+    }
+    template <typename T, typename = std::enable_if_t<std::is_integral_v<T>>>
+    LogLine& operator<<(T value) {
+        if (text_) append_number(static_cast<std::conditional_t<std::is_signed_v<T>, long long, unsigned long long>>(value));
+        return *this;
+    }
+
+private:
+    void append_number(long long value);
+    void append_number(unsigned long long value);
+
+    LogLevel level_;
+    std::string* text_ = nullptr; // null when the line is filtered out
+    uint64_t suppressed_ = 0;
+};
+
+// `errno` as text, for log lines that replace perror().
+inline std::string_view errno_text(int err) { return std::strerror(err); }
+
+namespace log_detail {
+extern std::atomic<uint8_t> min_level;
+extern std::atomic<bool> chat_enabled;
+inline bool enabled(LogLevel level) { return static_cast<uint8_t>(level) >= min_level.load(std::memory_order_relaxed); }
+} // namespace log_detail
+
+inline LogLine log_debug() { return LogLine(LogLevel::Debug, log_detail::enabled(LogLevel::Debug)); }
+inline LogLine log_info() { return LogLine(LogLevel::Info, log_detail::enabled(LogLevel::Info)); }
+inline LogLine log_warn(LogRateLimit* limit = nullptr) {
+    return LogLine(LogLevel::Warn, log_detail::enabled(LogLevel::Warn), limit);
+}
+inline LogLine log_error(LogRateLimit* limit = nullptr) {
+    return LogLine(LogLevel::Error, log_detail::enabled(LogLevel::Error), limit);
+}
+
+// Chat message contents, logged at Info unless disabled with --chat-log=off.
+inline LogLine log_chat() {
+    return LogLine(LogLevel::Info,
+                   log_detail::chat_enabled.load(std::memory_order_relaxed) && log_detail::enabled(LogLevel::Info));
+}
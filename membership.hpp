@@ -0,0 +1,98 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Identifies a client connection on a particular shard. The generation of
+// the connection's slot guards against the fd having been closed and reused
+// by the time a message arrives.
+struct ClientRef {
+    uint32_t shard = 0;
+    int fd = -1;
+    uint32_t generation = 0;
+
+    uint64_t key() const { return (uint64_t(shard) << 32) | uint32_t(fd); }
+};
+
+// --- Membership Snapshots ---
+// An immutable copy of a room's member list, grouped by the shard that owns
+// each connection. The room's owner builds a new one on every join or leave
+// and publishes it; any shard can then fan a message out from it without
+// locking or asking the owner. Readers pin a snapshot with an EpochDomain
+// guard, and take a reference (shared_from_this) to keep it past the guard,
+// e.g. while a Deliver for it sits in another shard's inbox.
+struct MemberList : std::enable_shared_from_this<MemberList> {
+    uint32_t room;
+    std::vector<std::vector<ClientRef>> by_shard; // shard -> its members
+    std::array<bool, 2> deflate{};                // by Protocol: some member takes compressed envelopes
+};
+
+// Room id -> T. Storage grows in segments that never move, so lookups need
+// no lock while creation (under the directory's mutex) adds capacity.
+template <typename T>
+class SegmentedTable {
+public:
+    SegmentedTable() = default;
+    SegmentedTable(const SegmentedTable&) = delete;
+    SegmentedTable& operator=(const SegmentedTable&) = delete;
+
+    ~SegmentedTable() {
+        for (auto& segment : segments_) delete[] segment.load(std::memory_order_relaxed);
+    }
+
+    // Makes room for `room_id`. Callers must serialise this.
+    void reserve(uint32_t room_id) {
+        auto [seg, off] = locate(room_id);
+        if (!segments_[seg].load(std::memory_order_relaxed)) {
+            segments_[seg].store(new T[segment_size(seg)](), std::memory_order_release);
+        }
+    }
+
+    // Null if `room_id` was never reserved.
+    T* find(uint32_t room_id) const {
+        auto [seg, off] = locate(room_id);
+        T* segment = segments_[seg].load(std::memory_order_acquire);
+        return segment ? &segment[off] : nullptr;
+    }
+
+private:
+    static constexpr size_t FIRST_SEGMENT = 64;
+    static constexpr size_t SEGMENTS = 26; // 64 * (2^26 - 1) rooms
+
+    static size_t segment_size(size_t seg) { return FIRST_SEGMENT << seg; }
+
+    // Segment k holds ids [64 * (2^k - 1), 64 * (2^(k+1) - 1)).
+    static std::pair<size_t, size_t> locate(uint32_t room_id) {
+        size_t bucket = room_id / FIRST_SEGMENT + 1;
+        size_t seg = std::bit_width(bucket) - 1;
+        return {seg, room_id - FIRST_SEGMENT * ((size_t{1} << seg) - 1)};
+    }
+
+    std::array<std::atomic<T*>, SEGMENTS> segments_{};
+};
+
+// Room id -> currently published MemberList.
+class MembershipTable {
+public:
+    void reserve(uint32_t room_id) { lists_.reserve(room_id); }
+
+    // Null if the room has no published members (or was never reserved).
+    const MemberList* load(uint32_t room_id) const {
+        auto* list = lists_.find(room_id);
+        return list ? list->load(std::memory_order_acquire) : nullptr;
+    }
+
+    // Only the room's owner publishes. The previous list must be retired
+    // through the EpochDomain, not freed.
+    void publish(uint32_t room_id, const MemberList* list) {
+        lists_.find(room_id)->store(list, std::memory_order_release);
+    }
+
+private:
+    SegmentedTable<std::atomic<const MemberList*>> lists_;
+};
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "pool.hpp"
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <new>
+#include <string_view>
+#include <utility>
+
+// --- Shared Message Buffers ---
+// An immutable, reference-counted byte buffer. A broadcast is formatted once
+// into a MessageBuffer and every recipient's outbound queue holds a
+// MessageRef to it, so fan-out costs a pointer per member instead of a copy.
+// Header and bytes share one allocation from the size-class pools. The
+// count is atomic because shards hand the same buffer to each other.
+
+class MessageRef;
+
+class MessageBuffer {
+public:
+    const char* data() const { return reinterpret_cast<const char*>(this + 1); }
+    size_t size() const { return size_; }
+    std::string_view view() const { return {data(), size_}; }
+
+private:
+    friend class MessageRef;
+
+    explicit MessageBuffer(size_t size) : size_(size) {}
+    char* mutable_data() { return reinterpret_cast<char*>(this + 1); }
+
+    std::atomic<uint32_t> refs_{1};
+    size_t size_;
+};
+
+class MessageRef {
+public:
+    MessageRef() = default;
+    MessageRef(const MessageRef& other) : buf_(other.buf_) { retain(); }
+    MessageRef(MessageRef&& other) noexcept : buf_(std::exchange(other.buf_, nullptr)) {}
+    MessageRef& operator=(MessageRef other) noexcept {
+        std::swap(buf_, other.buf_);
+        return *this;
+    }
+    ~MessageRef() { release(); }
+
+    // Copies `text` into a new buffer.
+    static MessageRef make(std::string_view text) { return concat({text}); }
+
+    // Formats a message from pieces with a single allocation.
+    static MessageRef concat(std::initializer_list<std::string_view> parts) {
+        size_t size = 0;
+        for (std::string_view part : parts) size += part.size();
+        MessageRef ref(allocate(size));
+        char* out = ref.buf_->mutable_data();
+        for (std::string_view part : parts) {
+            std::memcpy(out, part.data(), part.size());
+            out += part.size();
+        }
+        return ref;
+    }
+
+    // Allocates `size` bytes and lets `fill(char*)` write them in place.
+    template <typename F>
+    static MessageRef build(size_t size, F&& fill) {
+        MessageRef ref(allocate(size));
+        fill(ref.buf_->mutable_data());
+        return ref;
+    }
+
+    const char* data() const { return buf_->data(); }
+    size_t size() const { return buf_ ? buf_->size() : 0; }
+    std::string_view view() const { return buf_ ? buf_->view() : std::string_view{}; }
+    explicit operator bool() const { return buf_ != nullptr; }
+
+private:
+    explicit MessageRef(MessageBuffer* buf) : buf_(buf) {}
+
+    static MessageBuffer* allocate(size_t size) {
+        void* mem = pool_allocate(sizeof(MessageBuffer) + size);
+        return new (mem) MessageBuffer(size);
+    }
+
+    void retain() {
+        if (buf_) buf_->refs_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void release() {
+        if (buf_ && buf_->refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            size_t bytes = sizeof(MessageBuffer) + buf_->size_;
+            buf_->~MessageBuffer();
+            pool_deallocate(buf_, bytes);
+        }
+    }
+
+    MessageBuffer* buf_ = nullptr;
+};
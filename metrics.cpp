@@ -0,0 +1,158 @@
+#include "metrics.hpp"
+#include "network_utils.hpp"
+#include "log.hpp"
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdio>
+#include <iterator>
+
+// --- Histograms ---
+
+size_t LatencyHistogram::bucket(uint64_t ns) {
+    if (ns < SUB) return static_cast<size_t>(ns);
+    unsigned magnitude = static_cast<unsigned>(std::bit_width(ns)) - 1; // >= SUB_BITS
+    if (magnitude > MAX_MAGNITUDE) return BUCKETS - 1;
+    unsigned shift = magnitude - SUB_BITS;
+    return (shift + 1) * SUB + static_cast<size_t>((ns >> shift) - SUB);
+}
+
+uint64_t LatencyHistogram::bucket_upper(size_t index) {
+    if (index < SUB) return index;
+    unsigned shift = static_cast<unsigned>(index / SUB - 1);
+    return ((uint64_t(index % SUB) + SUB + 1) << shift) - 1;
+}
+
+void LatencyHistogram::merge_into(Snapshot& out) const {
+    for (size_t i = 0; i < BUCKETS; ++i) out.counts[i] += counts_[i].load(std::memory_order_relaxed);
+    out.count += count_.load(std::memory_order_relaxed);
+    out.sum += sum_.load(std::memory_order_relaxed);
+    out.max = std::max(out.max, max_.load(std::memory_order_relaxed));
+}
+
+// The upper bound of the bucket holding the q-th quantile, capped at the
+// largest value recorded.
+uint64_t LatencyHistogram::Snapshot::percentile(double q) const {
+    if (count == 0) return 0;
+    uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * count)));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; ++i) {
+        seen += counts[i];
+        if (seen >= rank) return std::min(bucket_upper(i), max);
+    }
+    return max;
+}
+
+// --- Exposition ---
+
+static constexpr const char* COUNTER_NAMES[] = {
+    "chat_connections_accepted_total",
+    "chat_connections_closed_total",
+    "chat_messages_in_total",
+    "chat_messages_out_total",
+    "chat_bytes_in_total",
+    "chat_bytes_out_total",
+    "chat_broadcasts_total",
+    "chat_parallel_fanouts_total",
+    "chat_parallel_flushes_total",
+    "chat_direct_messages_total",
+    "chat_messages_dropped_total",
+    "chat_slow_consumers_closed_total",
+    "chat_flood_dropped_total",
+    "chat_flood_room_dropped_total",
+    "chat_flood_paused_total",
+    "chat_deflate_input_bytes_total",
+    "chat_deflate_output_bytes_total",
+    "chat_shard_messages_sent_total",
+    "chat_shard_messages_handled_total",
+    "chat_wal_dropped_total",
+};
+static_assert(std::size(COUNTER_NAMES) == static_cast<size_t>(Counter::COUNT));
+
+static constexpr const char* TIMER_NAMES[] = {
+    "handshake", "chat", "create", "join", "leave", "list_rooms", "list_members",
+    "history", "auth", "stats", "pong", "msg", "who", "unknown", "fanout", "deliver",
+};
+static_assert(std::size(TIMER_NAMES) == static_cast<size_t>(Timer::COUNT));
+
+Metrics::Metrics(size_t shards) {
+    for (size_t i = 0; i < shards; ++i) shards_.push_back(std::make_unique<ShardMetrics>());
+}
+
+std::string Metrics::render() const {
+    std::string out;
+    char line[256];
+    auto emit = [&](const char* fmt, auto... args) {
+        std::snprintf(line, sizeof line, fmt, args...);
+        out += line;
+    };
+
+    uint64_t counters[static_cast<size_t>(Counter::COUNT)] = {};
+    int64_t outbound = 0;
+    for (const auto& shard : shards_) {
+        for (size_t i = 0; i < std::size(counters); ++i) counters[i] += shard->get(static_cast<Counter>(i));
+        outbound += shard->get(Gauge::OutboundBytes);
+    }
+    for (size_t i = 0; i < std::size(counters); ++i) counters[i] += wal_.get(static_cast<Counter>(i));
+    auto total = [&](Counter c) { return counters[static_cast<size_t>(c)]; };
+
+    for (size_t i = 0; i < std::size(counters); ++i) {
+        emit("# TYPE %s counter\n%s %llu\n", COUNTER_NAMES[i], COUNTER_NAMES[i], (unsigned long long)counters[i]);
+    }
+    // Derived gauges. Counters are read one at a time, so a difference can
+    // briefly dip below zero.
+    auto difference = [](uint64_t a, uint64_t b) { return a > b ? (long long)(a - b) : 0LL; };
+    emit("# TYPE chat_connections_open gauge\nchat_connections_open %lld\n",
+         difference(total(Counter::ConnectionsAccepted), total(Counter::ConnectionsClosed)));
+    emit("# TYPE chat_shard_inbox_depth gauge\nchat_shard_inbox_depth %lld\n",
+         difference(total(Counter::ShardMessagesSent), total(Counter::ShardMessagesHandled)));
+    emit("# TYPE chat_outbound_bytes gauge\nchat_outbound_bytes %lld\n", (long long)std::max<int64_t>(outbound, 0));
+    emit("# TYPE chat_shards gauge\nchat_shards %zu\n", shards_.size());
+
+    out += "# TYPE chat_latency_seconds summary\n";
+    for (size_t t = 0; t < static_cast<size_t>(Timer::COUNT); ++t) {
+        LatencyHistogram::Snapshot snap;
+        for (const auto& shard : shards_) shard->timer(static_cast<Timer>(t)).merge_into(snap);
+        const char* op = TIMER_NAMES[t];
+        for (double q : {0.5, 0.9, 0.99, 0.999}) {
+            emit("chat_latency_seconds{op=\"%s\",quantile=\"%g\"} %.9f\n", op, q, snap.percentile(q) / 1e9);
+        }
+        emit("chat_latency_seconds_sum{op=\"%s\"} %.9f\n", op, snap.sum / 1e9);
+        emit("chat_latency_seconds_count{op=\"%s\"} %llu\n", op, (unsigned long long)snap.count);
+        emit("chat_latency_seconds_max{op=\"%s\"} %.9f\n", op, snap.max / 1e9);
+    }
+    return out;
+}
+
+// --- Scrape Endpoint ---
+
+void serve_metrics(int listen_fd, const Metrics& metrics) {
+    while (true) {
+        Socket client{::accept(listen_fd, nullptr, nullptr)};
+        if (!client) {
+            static LogRateLimit failures;
+            if (errno != EINTR && errno != ECONNABORTED) log_error(&failures) << "metrics accept: " << errno_text(errno);
+            continue;
+        }
+
+        // Read the request up to its blank line (or give up after a second)
+        // so closing does not reset the connection under the response.
+        timeval timeout{1, 0};
+        setsockopt(client.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+        std::string request;
+        char buf[1024];
+        while (request.size() < 8192 && request.find("\r\n\r\n") == std::string::npos) {
+            ssize_t n = ::recv(client.get(), buf, sizeof buf, 0);
+            if (n <= 0) break;
+            request.append(buf, static_cast<size_t>(n));
+        }
+
+        std::string body = metrics.render();
+        std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                               std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        send_all(client.get(), response);
+        ::shutdown(client.get(), SHUT_WR);
+    }
+}
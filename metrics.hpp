@@ -0,0 +1,174 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <vector>
+
+// --- Metrics ---
+// Every shard records into its own ShardMetrics, and only that shard's thread
+// writes to it. Recording is a relaxed load and store to a cache line no
+// other thread writes, so it costs a few nanoseconds and never contends.
+// Readers ($stats and the scrape endpoint) sum the shards with relaxed loads;
+// the totals may be a moment stale, but a value is never torn.
+
+enum class Counter : uint8_t {
+    ConnectionsAccepted,
+    ConnectionsClosed,
+    MessagesIn,       // lines and frames from clients
+    MessagesOut,      // messages queued to clients
+    BytesIn,
+    BytesOut,         // written to sockets
+    Broadcasts,
+    ParallelFanouts,  // member lists queued by the fan-out pool
+    ParallelFlushes,  // dirty lists written by the fan-out pool
+    DirectMessages,   // $msg sent to an online user
+    MessagesDropped,  // shed by the drop-oldest policy
+    SlowConsumersClosed,
+    FloodDropped,     // input over a client's rate limit
+    FloodRoomDropped, // chat over a room's rate limit
+    FloodPaused,      // reads paused for going over a rate limit
+    DeflateBytesIn,   // messages compressed, counted once however many share them
+    DeflateBytesOut,  // the envelopes they became
+    ShardMessagesSent,
+    ShardMessagesHandled,
+    WalDropped,       // messages the write-ahead log could not record
+    COUNT
+};
+
+enum class Gauge : uint8_t {
+    OutboundBytes, // queued for clients, not yet handed to the kernel
+    COUNT
+};
+
+// Timed operations: one per command, then the broadcast stages.
+enum class Timer : uint8_t {
+    Handshake,
+    Chat,
+    Create,
+    Join,
+    Leave,
+    ListRooms,
+    ListMembers,
+    History,
+    Auth,
+    Stats,
+    Pong,
+    DirectMessage,
+    Who,
+    Unknown,
+    Fanout,  // broadcast_to_room on the sender's shard
+    Deliver, // a Deliver from another shard
+    COUNT
+};
+
+inline uint64_t monotonic_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000u + uint64_t(ts.tv_nsec);
+}
+
+// HDR-style histogram of nanosecond durations: 16 linear sub-buckets per
+// power of two, so any reported value is within about 6% of the truth. Holds
+// values up to about 18 minutes; longer ones land in the last bucket.
+class LatencyHistogram {
+public:
+    static constexpr unsigned SUB_BITS = 4;
+    static constexpr unsigned MAX_MAGNITUDE = 40;
+    static constexpr size_t SUB = size_t{1} << SUB_BITS;
+    static constexpr size_t BUCKETS = (MAX_MAGNITUDE - SUB_BITS + 2) * SUB;
+
+    struct Snapshot {
+        std::array<uint64_t, BUCKETS> counts{};
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        uint64_t max = 0;
+
+        uint64_t percentile(double q) const;
+    };
+
+    // Single writer.
+    void record(uint64_t ns) {
+        bump(counts_[bucket(ns)], 1);
+        bump(count_, 1);
+        bump(sum_, ns);
+        if (ns > max_.load(std::memory_order_relaxed)) max_.store(ns, std::memory_order_relaxed);
+    }
+
+    // Adds this histogram's counts to `out`; safe from any thread.
+    void merge_into(Snapshot& out) const;
+
+    static size_t bucket(uint64_t ns);
+    static uint64_t bucket_upper(size_t index);
+
+private:
+    static void bump(std::atomic<uint64_t>& v, uint64_t n) {
+        v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    std::array<std::atomic<uint64_t>, BUCKETS> counts_{};
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> sum_{0};
+    std::atomic<uint64_t> max_{0};
+};
+
+// One shard's metrics. Aligned so no two shards share a cache line.
+class alignas(64) ShardMetrics {
+public:
+    void add(Counter c, uint64_t n = 1) {
+        auto& v = counters_[static_cast<size_t>(c)];
+        v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    void add(Gauge g, int64_t delta) {
+        auto& v = gauges_[static_cast<size_t>(g)];
+        v.store(v.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+    void record(Timer t, uint64_t ns) { timers_[static_cast<size_t>(t)].record(ns); }
+
+    uint64_t get(Counter c) const { return counters_[static_cast<size_t>(c)].load(std::memory_order_relaxed); }
+    int64_t get(Gauge g) const { return gauges_[static_cast<size_t>(g)].load(std::memory_order_relaxed); }
+    const LatencyHistogram& timer(Timer t) const { return timers_[static_cast<size_t>(t)]; }
+
+private:
+    std::array<std::atomic<uint64_t>, static_cast<size_t>(Counter::COUNT)> counters_{};
+    std::array<std::atomic<int64_t>, static_cast<size_t>(Gauge::COUNT)> gauges_{};
+    std::array<LatencyHistogram, static_cast<size_t>(Timer::COUNT)> timers_;
+};
+
+// Times a scope into a shard's histogram.
+class ScopedTimer {
+public:
+    ScopedTimer(ShardMetrics& metrics, Timer timer) : metrics_(metrics), timer_(timer), start_(monotonic_ns()) {}
+    ~ScopedTimer() { metrics_.record(timer_, monotonic_ns() - start_); }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    ShardMetrics& metrics_;
+    Timer timer_;
+    uint64_t start_;
+};
+
+// Every shard's metrics.
+class Metrics {
+public:
+    explicit Metrics(size_t shards);
+
+    ShardMetrics& shard(uint32_t id) { return *shards_[id]; }
+    ShardMetrics& wal() { return wal_; } // the log's writer thread records here
+
+    // Totals across the shards in the Prometheus text format.
+    std::string render() const;
+
+private:
+    std::vector<std::unique_ptr<ShardMetrics>> shards_;
+    ShardMetrics wal_;
+};
+
+// Answers every connection on `listen_fd` with a plain-text HTTP response
+// holding metrics.render(). Blocks forever; run it on its own thread.
+void serve_metrics(int listen_fd, const Metrics& metrics);
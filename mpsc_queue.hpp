@@ -0,0 +1,64 @@
+#pragma once
+
+#include "pool.hpp"
+#include <atomic>
+#include <optional>
+#include <utility>
+
+// --- Lock-free MPSC Queue ---
+// Intrusive multi-producer / single-consumer queue (Vyukov). push() is
+// wait-free and may be called from any thread; pop() must only be called by
+// the owning consumer thread. Items from a single producer are popped in the
+// order they were pushed.
+//
+// A producer that has swapped the head but not yet linked its node makes the
+// queue look empty for a moment; callers pair the queue with a wakeup that is
+// signalled after push() returns, so nothing is ever stranded.
+template <typename T>
+class MpscQueue {
+public:
+    MpscQueue() : head_(&stub_), tail_(&stub_) {}
+
+    ~MpscQueue() {
+        while (pop()) {}
+        if (tail_ != &stub_) delete tail_;
+    }
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    void push(T value) {
+        Node* node = new Node{std::move(value)};
+        Node* prev = head_.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    std::optional<T> pop() {
+        Node* tail = tail_;
+        Node* next = tail->next.load(std::memory_order_acquire);
+        if (next == nullptr) return std::nullopt;
+
+        // `next` becomes the new stub; its value is handed to the caller.
+        std::optional<T> value(std::move(*next->value));
+        next->value.reset();
+        tail_ = next;
+        if (tail != &stub_) delete tail;
+        return value;
+    }
+
+private:
+    struct Node {
+        Node() = default;
+        explicit Node(T&& v) : value(std::move(v)) {}
+        std::optional<T> value;
+        std::atomic<Node*> next{nullptr};
+
+        // One node per cross-shard message: these come from the pools.
+        static void* operator new(size_t size) { return pool_allocate(size); }
+        static void operator delete(void* p, size_t size) { pool_deallocate(p, size); }
+    };
+
+    alignas(64) std::atomic<Node*> head_; // producers
+    alignas(64) Node* tail_;              // consumer
+    Node stub_;
+};
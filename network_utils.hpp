@@ -3,6 +3,7 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <cerrno>
@@ -50,11 +51,12 @@ inline void* get_in_addr(sockaddr* sa) {
     return &(((sockaddr_in6*)sa)->sin6_addr);
 }
 
-// Send all data in a buffer, handling partial sends.
+// Send all data in a buffer, handling partial sends. Only for blocking
+// sockets; the server queues output per connection instead.
 inline bool send_all(int fd, std::string_view sv) {
     size_t sent = 0;
     while (sent < sv.size()) {
-        ssize_t n = ::send(fd, sv.data() + sent, sv.size() - sent, 0);
+        ssize_t n = ::send(fd, sv.data() + sent, sv.size() - sent, MSG_NOSIGNAL);
         if (n < 0) {
             if (errno == EINTR) continue; // retry
             perror("send");
@@ -66,8 +68,56 @@ inline bool send_all(int fd, std::string_view sv) {
     return true;
 }
 
-// Creates and binds a listening socket on the given port.
-inline Socket get_listener_socket(const char* port) {
+// --- TCP Options ---
+// The server coalesces output itself and writes each connection's queue
+// with one gathered send per tick, so Nagle's algorithm only adds delay:
+// it is off by default. TCP_CORK additionally holds back partial segments
+// until a flush has handed over the whole queue. Buffer sizes of 0 keep the
+// kernel's defaults (and its auto-tuning).
+struct SocketOptions {
+    bool nodelay = true;
+    bool cork = false;
+    int send_buffer = 0; // SO_SNDBUF
+    int recv_buffer = 0; // SO_RCVBUF
+};
+
+// Buffer sizes go on the listener, before listen(), so that accepted
+// sockets inherit them and the window scale is negotiated to match.
+inline bool set_buffer_sizes(int fd, const SocketOptions& options) {
+    if (options.send_buffer > 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &options.send_buffer, sizeof options.send_buffer) == -1) {
+        perror("setsockopt SO_SNDBUF");
+        return false;
+    }
+    if (options.recv_buffer > 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &options.recv_buffer, sizeof options.recv_buffer) == -1) {
+        perror("setsockopt SO_RCVBUF");
+        return false;
+    }
+    return true;
+}
+
+// Per-connection options, set on every accepted socket.
+inline bool set_tcp_options(int fd, const SocketOptions& options) {
+    int nodelay = options.nodelay ? 1 : 0;
+    int cork = options.cork ? 1 : 0;
+    return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof nodelay) == 0 &&
+           (!cork || setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof cork) == 0);
+}
+
+// Sends whatever a corked socket is holding back, and corks it again.
+inline void push_corked(int fd) {
+    int off = 0, on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &off, sizeof off);
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof on);
+}
+
+// Creates and binds a listening socket on the given port, on every interface
+// unless `host` names one. With reuse_port, several sockets (one per
+// event-loop thread) can bind the same port and the kernel load-balances
+// incoming connections between them.
+inline Socket get_listener_socket(const char* port, bool reuse_port = false, const char* host = nullptr,
+                                  const SocketOptions* options = nullptr) {
     addrinfo hints{}, *servinfo, *p;
     int rv;
     int yes = 1;
@@ -77,7 +127,7 @@ inline Socket get_listener_socket(const char* port) {
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE;
 
-    if ((rv = getaddrinfo(nullptr, port, &hints, &servinfo)) != 0) {
+    if ((rv = getaddrinfo(host, port, &hints, &servinfo)) != 0) {
         std::cerr << "getaddrinfo: " << gai_strerror(rv) << "\n";
         return Socket{-1};
     }
@@ -88,6 +138,15 @@ inline Socket get_listener_socket(const char* port) {
         if (listener_fd < 0) continue;
         
         setsockopt(listener_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+        if (reuse_port && setsockopt(listener_fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+            perror("setsockopt SO_REUSEPORT");
+            close(listener_fd);
+            continue;
+        }
+        if (options && !set_buffer_sizes(listener_fd, *options)) {
+            close(listener_fd);
+            continue;
+        }
 
         if (bind(listener_fd, p->ai_addr, p->ai_addrlen) < 0) {
             close(listener_fd);
@@ -142,7 +201,7 @@ inline Socket connect_to_server(const char* host, const char* port) {
     
     char s[INET6_ADDRSTRLEN];
     inet_ntop(p->ai_family, get_in_addr((struct sockaddr *)p->ai_addr), s, sizeof s);
-    std::cout << "Connected to " << s << "\n";
+    std::cerr << "Connected to " << s << "\n"; // stdout may be a headless client's output
     freeaddrinfo(servinfo);
 
     return Socket{sockfd};
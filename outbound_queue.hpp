@@ -0,0 +1,162 @@
+#pragma once
+
+#include "message_buffer.hpp"
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <deque>
+#include <climits>
+#include <string>
+#include <vector>
+#include <string_view>
+
+// --- Outbound Queue ---
+// Messages waiting to be written to one non-blocking client socket. Entries
+// are shared MessageRefs, so queueing a broadcast never copies its bytes.
+// The server flushes each queue once per event-loop tick, handing every
+// pending message to the kernel in a single gathered write.
+
+// What to do with a client whose queue grows past the high watermark.
+enum class SlowConsumerPolicy {
+    DropOldest, // discard the oldest unsent messages
+    Disconnect, // close the connection
+    PauseReads, // stop reading from the client until it drains to the low watermark
+};
+
+struct OutboundLimits {
+    size_t high_watermark = 256 * 1024;
+    size_t low_watermark = 64 * 1024;
+    SlowConsumerPolicy policy = SlowConsumerPolicy::DropOldest;
+};
+
+inline bool parse_slow_consumer_policy(std::string_view text, SlowConsumerPolicy& out) {
+    if (text == "drop-oldest") {
+        out = SlowConsumerPolicy::DropOldest;
+    } else if (text == "disconnect") {
+        out = SlowConsumerPolicy::Disconnect;
+    } else if (text == "pause-reads") {
+        out = SlowConsumerPolicy::PauseReads;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+class OutboundQueue {
+public:
+    enum class FlushResult { Drained, Blocked, Error };
+
+    // Messages handed to the kernel per call.
+    static constexpr int MAX_IOV = 64;
+
+    bool empty() const { return messages_.empty(); }
+    size_t bytes() const { return bytes_ - in_flight_; } // not yet handed to the kernel
+
+    void push(MessageRef msg) {
+        if (msg.size() == 0) return;
+        bytes_ += msg.size();
+        messages_.push_back(std::move(msg));
+    }
+
+    // Writes as much as the socket accepts without blocking.
+    FlushResult flush(int fd) {
+        while (!messages_.empty()) {
+            iovec iov[MAX_IOV];
+            int count = fill(iov, MAX_IOV);
+
+            msghdr msg{};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+            // writev without SIGPIPE; MSG_MORE while another batch follows, so
+            // the boundary between batches does not become a short segment.
+            int flags = MSG_NOSIGNAL | (messages_.size() > static_cast<size_t>(count) ? MSG_MORE : 0);
+            ssize_t n = ::sendmsg(fd, &msg, flags);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return FlushResult::Blocked;
+                return FlushResult::Error;
+            }
+            consume(static_cast<size_t>(n));
+        }
+        return FlushResult::Drained;
+    }
+
+    // For backends that write asynchronously: hands the front of the queue,
+    // up to IOV_MAX messages, to one send. Those bytes are the kernel's now,
+    // as they would be after a flush(), so bytes() stops counting them; the
+    // messages themselves stay queued, and safe from drop_oldest(), until
+    // complete() reports how much was written.
+    int prepare(std::vector<iovec>& iov) {
+        iov.resize(std::min(messages_.size(), size_t{IOV_MAX}));
+        int count = fill(iov.data(), static_cast<int>(iov.size()));
+        pinned_ = static_cast<size_t>(count);
+        for (int i = 0; i < count; ++i) in_flight_ += iov[i].iov_len;
+        return count;
+    }
+
+    void complete(size_t written) {
+        pinned_ = 0;
+        in_flight_ = 0;
+        consume(written);
+    }
+
+    // Drops whole messages from the front until at most `target` bytes are
+    // queued. A partially written message is kept so the stream stays intact,
+    // as is the newest message and any being sent. Returns the number of
+    // messages dropped.
+    size_t drop_oldest(size_t target) {
+        size_t dropped = 0;
+        size_t first = std::max(pinned_, size_t{head_offset_ > 0 ? 1u : 0u});
+        while (bytes() > target && messages_.size() > first + 1) {
+            auto victim = messages_.begin() + first;
+            bytes_ -= victim->size();
+            messages_.erase(victim);
+            ++dropped;
+        }
+        return dropped;
+    }
+
+    // A copy of everything not yet handed to the kernel, for a hot upgrade.
+    std::string unsent() const {
+        std::string out;
+        out.reserve(bytes());
+        for (auto it = messages_.begin() + pinned_; it != messages_.end(); ++it) {
+            size_t skip = it == messages_.begin() ? head_offset_ : 0;
+            out.append(it->data() + skip, it->size() - skip);
+        }
+        return out;
+    }
+
+private:
+    int fill(iovec* iov, int max) const {
+        int count = 0;
+        for (auto it = messages_.begin(); it != messages_.end() && count < max; ++it, ++count) {
+            size_t skip = count == 0 ? head_offset_ : 0;
+            iov[count].iov_base = const_cast<char*>(it->data() + skip);
+            iov[count].iov_len = it->size() - skip;
+        }
+        return count;
+    }
+
+    void consume(size_t n) {
+        bytes_ -= n;
+        while (n > 0) {
+            size_t left = messages_.front().size() - head_offset_;
+            if (n < left) {
+                head_offset_ += n;
+                return;
+            }
+            n -= left;
+            messages_.pop_front();
+            head_offset_ = 0;
+        }
+    }
+
+    std::deque<MessageRef, PoolAllocator<MessageRef>> messages_; // pooled, as connections churn
+    size_t head_offset_ = 0; // bytes of messages_.front() already written
+    size_t bytes_ = 0;       // unsent bytes across all messages
+    size_t pinned_ = 0;      // front messages handed to an asynchronous send
+    size_t in_flight_ = 0;   // their bytes
+};
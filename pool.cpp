@@ -0,0 +1,181 @@
+#include "pool.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <iomanip>
+#include <ostream>
+#include <stdexcept>
+
+namespace {
+
+constexpr unsigned MAX_POOLS = 32;
+constexpr size_t ALIGNMENT = 16;
+
+// A batch is about this many bytes (at most 64 blocks, at least one), and a
+// thread caches up to two batches per pool before returning one.
+constexpr size_t BATCH_BYTES = 16 * 1024;
+constexpr size_t MAX_BATCH = 64;
+
+// Slabs are at least this large, and always hold at least one batch.
+constexpr size_t SLAB_BYTES = 64 * 1024;
+
+// Size classes: 32, 64, ..., 64 KiB.
+constexpr unsigned MIN_CLASS_SHIFT = 5;
+constexpr unsigned MAX_CLASS_SHIFT = 16;
+constexpr unsigned SIZE_CLASSES = MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1;
+
+std::array<std::atomic<FixedPool*>, MAX_POOLS> g_pools{};
+std::atomic<unsigned> g_pool_count{0};
+std::atomic<size_t> g_oversize{0};
+
+} // namespace
+
+// Per-thread free lists, one per pool. When the thread exits they go back
+// to the depots; anything the thread frees after that goes straight there.
+struct PoolThreadCache {
+    std::array<FixedPool::Batch, MAX_POOLS> lists{};
+
+    ~PoolThreadCache();
+};
+
+static thread_local PoolThreadCache t_cache;
+static thread_local bool t_cache_gone = false;
+
+PoolThreadCache::~PoolThreadCache() {
+    t_cache_gone = true;
+    unsigned count = std::min(g_pool_count.load(std::memory_order_acquire), MAX_POOLS);
+    for (unsigned id = 0; id < count; ++id) {
+        if (lists[id].count > 0) g_pools[id].load(std::memory_order_acquire)->spill(lists[id]);
+    }
+}
+
+FixedPool::FixedPool(const char* name, size_t block_size)
+    : name_(name),
+      block_size_((std::max(block_size, sizeof(Block)) + ALIGNMENT - 1) & ~(ALIGNMENT - 1)),
+      batch_size_(std::clamp(BATCH_BYTES / block_size_, size_t{1}, MAX_BATCH)),
+      id_(g_pool_count.fetch_add(1, std::memory_order_acq_rel)) {
+    if (id_ >= MAX_POOLS) throw std::runtime_error("Too many allocator pools.");
+    g_pools[id_].store(this, std::memory_order_release);
+}
+
+void* FixedPool::allocate() {
+    if (t_cache_gone) {
+        Batch batch = refill();
+        Block* block = batch.head;
+        if (--batch.count > 0) spill({block->next, batch.count});
+        return block;
+    }
+    Batch& list = t_cache.lists[id_];
+    if (!list.head) list = refill();
+    Block* block = list.head;
+    list.head = block->next;
+    --list.count;
+    return block;
+}
+
+void FixedPool::deallocate(void* p) {
+    Block* block = static_cast<Block*>(p);
+    if (t_cache_gone) {
+        block->next = nullptr;
+        spill({block, 1});
+        return;
+    }
+    Batch& list = t_cache.lists[id_];
+    block->next = list.head;
+    list.head = block;
+    if (++list.count <= 2 * batch_size_) return;
+
+    // Keep the most recently freed (cache-warm) blocks; return the rest.
+    Block* last = list.head;
+    for (size_t i = 1; i < batch_size_; ++i) last = last->next;
+    Batch rest{last->next, list.count - batch_size_};
+    last->next = nullptr;
+    list.count = batch_size_;
+    spill(rest);
+}
+
+// Takes a batch from the depot, carving a new slab if it is empty.
+FixedPool::Batch FixedPool::refill() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (depot_.empty()) {
+        size_t count = std::max(SLAB_BYTES / block_size_, batch_size_);
+        slabs_.push_back(std::make_unique<char[]>(count * block_size_));
+        char* base = slabs_.back().get();
+        blocks_ += count;
+        for (size_t first = 0; first < count; first += batch_size_) {
+            size_t n = std::min(batch_size_, count - first);
+            for (size_t i = 0; i < n; ++i) {
+                Block* block = reinterpret_cast<Block*>(base + (first + i) * block_size_);
+                block->next = i + 1 < n ? reinterpret_cast<Block*>(base + (first + i + 1) * block_size_) : nullptr;
+            }
+            depot_.push_back({reinterpret_cast<Block*>(base + first * block_size_), n});
+        }
+    }
+    Batch batch = depot_.back();
+    depot_.pop_back();
+    held_ += batch.count;
+    ++refills_;
+    return batch;
+}
+
+void FixedPool::spill(Batch batch) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    held_ -= batch.count;
+    depot_.push_back(batch);
+}
+
+PoolStats FixedPool::stats() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return {name_, block_size_, slabs_.size(), blocks_, held_, refills_};
+}
+
+// --- Size classes ---
+
+static FixedPool& size_class(unsigned index) {
+    static const std::array<FixedPool*, SIZE_CLASSES> classes = [] {
+        std::array<FixedPool*, SIZE_CLASSES> pools;
+        for (unsigned i = 0; i < SIZE_CLASSES; ++i) pools[i] = new FixedPool("bytes", size_t{1} << (MIN_CLASS_SHIFT + i));
+        return pools;
+    }();
+    return *classes[index];
+}
+
+static unsigned class_of(size_t size) {
+    if (size <= (size_t{1} << MIN_CLASS_SHIFT)) return 0;
+    return static_cast<unsigned>(std::bit_width(size - 1)) - MIN_CLASS_SHIFT;
+}
+
+void* pool_allocate(size_t size) {
+    if (size > (size_t{1} << MAX_CLASS_SHIFT)) {
+        g_oversize.fetch_add(1, std::memory_order_relaxed);
+        return ::operator new(size);
+    }
+    return size_class(class_of(size)).allocate();
+}
+
+void pool_deallocate(void* p, size_t size) {
+    if (size > (size_t{1} << MAX_CLASS_SHIFT)) {
+        ::operator delete(p);
+        return;
+    }
+    size_class(class_of(size)).deallocate(p);
+}
+
+void write_pool_stats(std::ostream& out) {
+    out << std::left << std::setw(12) << "pool" << std::right << std::setw(8) << "block" << std::setw(8) << "slabs"
+        << std::setw(10) << "blocks" << std::setw(10) << "held" << std::setw(10) << "refills" << '\n';
+    size_t reserved = 0;
+    unsigned count = std::min(g_pool_count.load(std::memory_order_acquire), MAX_POOLS);
+    for (unsigned id = 0; id < count; ++id) {
+        FixedPool* pool = g_pools[id].load(std::memory_order_acquire);
+        if (!pool) continue; // still being constructed
+        PoolStats s = pool->stats();
+        if (s.slabs == 0) continue;
+        reserved += s.blocks * s.block_size;
+        out << std::left << std::setw(12) << s.name << std::right << std::setw(8) << s.block_size << std::setw(8)
+            << s.slabs << std::setw(10) << s.blocks << std::setw(10) << s.held << std::setw(10) << s.refills << '\n';
+    }
+    out << "reserved " << reserved << " bytes, " << g_oversize.load(std::memory_order_relaxed)
+        << " allocations too large for a pool" << std::endl;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstddef>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// --- Pool Allocators ---
+// Connections, message buffers and queue nodes are created and destroyed at
+// the rate clients connect and talk, so they come from pools instead of the
+// general-purpose heap.
+//
+// A FixedPool hands out blocks of one size, carved from slabs. Every thread
+// keeps a short free list per pool, so allocating and freeing are a pointer
+// pop and push with no locking. Blocks move between a thread's cache and
+// the pool's shared depot a batch at a time. A block freed on another thread
+// than the one that allocated it (a broadcast released by the last shard
+// holding it) simply joins that thread's cache. Slabs are never handed back:
+// a pool grows to its high-water mark and is reused from then on, which
+// keeps RSS flat under connection churn and message bursts.
+//
+// pool_allocate() picks a size class, power-of-two FixedPools from 32 bytes
+// to 64 KiB. Anything larger goes to operator new. Blocks are 16-byte aligned.
+
+struct PoolStats {
+    const char* name;
+    size_t block_size;
+    size_t slabs;
+    size_t blocks;       // carved from the slabs
+    size_t held;         // in use, or cached by a thread
+    size_t refills;      // batches handed from the depot to a thread
+};
+
+class FixedPool {
+public:
+    // Pools live for the whole process; create them once and never destroy
+    // them (threads may still return blocks while the process exits).
+    FixedPool(const char* name, size_t block_size);
+
+    FixedPool(const FixedPool&) = delete;
+    FixedPool& operator=(const FixedPool&) = delete;
+
+    void* allocate();
+    void deallocate(void* p);
+
+    size_t block_size() const { return block_size_; }
+    PoolStats stats();
+
+private:
+    friend struct PoolThreadCache;
+
+    struct Block {
+        Block* next;
+    };
+    struct Batch {
+        Block* head;
+        size_t count;
+    };
+
+    Batch refill();
+    void spill(Batch batch);
+
+    const char* name_;
+    size_t block_size_;
+    size_t batch_size_; // blocks moved between a thread cache and the depot at once
+    unsigned id_;       // index of this pool's list in every thread cache
+
+    std::mutex mtx_;
+    std::vector<Batch> depot_;
+    std::vector<std::unique_ptr<char[]>> slabs_;
+    size_t blocks_ = 0;
+    size_t held_ = 0;
+    size_t refills_ = 0;
+};
+
+void* pool_allocate(size_t size);
+void pool_deallocate(void* p, size_t size); // `size` as passed to pool_allocate
+
+// Writes a table of every pool's statistics.
+void write_pool_stats(std::ostream& out);
+
+// Owning pointer to a pooled byte buffer.
+struct PoolDelete {
+    size_t size;
+    void operator()(char* p) const { pool_deallocate(p, size); }
+};
+using PoolBytes = std::unique_ptr<char[], PoolDelete>;
+
+inline PoolBytes make_pool_bytes(size_t size) {
+    return PoolBytes(static_cast<char*>(pool_allocate(size)), PoolDelete{size});
+}
+
+// Standard allocator over the size classes, for containers.
+template <typename T>
+struct PoolAllocator {
+    using value_type = T;
+
+    PoolAllocator() = default;
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>&) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(pool_allocate(n * sizeof(T))); }
+    void deallocate(T* p, size_t n) { pool_deallocate(p, n * sizeof(T)); }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U>&) const { return true; }
+};
@@ -0,0 +1,355 @@
+#pragma once
+
+#include "message_buffer.hpp"
+#include "recv_buffer.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// --- Wire Protocols ---
+// Clients speak the line-based text protocol unless they opt into binary
+// framing during the handshake:
+//
+//     $hello name=<name> proto=binary\n
+//
+// After that line every frame in both directions is
+//
+//     varint length | u8 opcode | body (length - 1 bytes)
+//
+// Varints are unsigned LEB128. "str" below is a varint length followed by
+// that many bytes; "rest" is the remainder of the frame.
+//
+// Either protocol can be combined with compress=deflate; see compression.hpp.
+
+enum class Protocol : uint8_t { Text, Binary };
+
+enum class Opcode : uint8_t {
+    // Client -> server
+    Create = 0x01,      // rest: room name
+    Join = 0x02,        // rest: room name
+    Leave = 0x03,       // empty
+    ListRooms = 0x04,   // empty
+    ListMembers = 0x05, // empty
+    Message = 0x06,     // rest: text for the current room
+    GetHistory = 0x07,  // optional varint count (default: everything kept)
+    Auth = 0x08,        // rest: admin token
+    GetStats = 0x09,    // empty; admin only, answered with a System frame
+    Pong = 0x0A,        // empty; answers Ping
+    DirectMessage = 0x0B, // str recipient, rest: text
+    Who = 0x0C,           // rest: name prefix (may be empty)
+
+    // Server -> client
+    System = 0x80,     // rest: text
+    Error = 0x81,      // rest: text
+    Chat = 0x82,       // varint room id, str sender, rest: text
+    Joined = 0x83,     // varint room id, rest: room name
+    Left = 0x84,       // varint room id, rest: room name
+    RoomList = 0x85,   // varint count, count x (varint room id, varint members, str name)
+    MemberList = 0x86, // varint room id, varint count, count x str name
+    Notice = 0x87,     // varint room id, rest: text (joins and leaves)
+    Session = 0x88,    // rest: 16-byte session id, sent once after the handshake
+    History = 0x89,    // varint room id, varint count, varint bytes used, varint capacity;
+                       // followed by `count` Chat frames, oldest first
+    Ping = 0x8A,       // empty; sent after a quiet spell (--ping-interval)
+    Direct = 0x8B,     // str sender, rest: text
+    UserList = 0x8C,   // u8 truncated, varint count, count x str name (sorted)
+    Compression = 0x8D, // rest: "compress=none" or "compress=deflate"; see encode_codec
+};
+
+// --- Varints ---
+
+inline size_t varint_size(uint64_t v) {
+    size_t n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        ++n;
+    }
+    return n;
+}
+
+inline char* put_varint(char* out, uint64_t v) {
+    while (v >= 0x80) {
+        *out++ = static_cast<char>((v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    *out++ = static_cast<char>(v);
+    return out;
+}
+
+inline void append_varint(std::string& out, uint64_t v) {
+    char buf[10];
+    out.append(buf, put_varint(buf, v));
+}
+
+// Decodes a varint from the front of `in`, advancing it. False if truncated
+// or longer than 64 bits.
+inline bool read_varint(std::string_view& in, uint64_t& v) {
+    v = 0;
+    for (size_t i = 0; i < in.size() && i < 10; ++i) {
+        uint8_t byte = static_cast<uint8_t>(in[i]);
+        v |= uint64_t(byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80)) {
+            in.remove_prefix(i + 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Decodes a "str" field from the front of `in`, advancing it.
+inline bool read_str(std::string_view& in, std::string_view& s) {
+    uint64_t len;
+    if (!read_varint(in, len) || len > in.size()) return false;
+    s = in.substr(0, len);
+    in.remove_prefix(len);
+    return true;
+}
+
+// --- Frame Encoding ---
+// encode_frame(op, fields...) sizes the frame first so it is built with a
+// single allocation.
+
+struct Varint { uint64_t value; };
+struct Str { std::string_view bytes; };  // length-prefixed
+struct Rest { std::string_view bytes; }; // runs to the end of the frame
+
+inline size_t field_size(Varint f) { return varint_size(f.value); }
+inline size_t field_size(Str f) { return varint_size(f.bytes.size()) + f.bytes.size(); }
+inline size_t field_size(Rest f) { return f.bytes.size(); }
+
+inline char* put_field(char* out, Varint f) { return put_varint(out, f.value); }
+inline char* put_field(char* out, Str f) {
+    out = put_varint(out, f.bytes.size());
+    return std::copy(f.bytes.begin(), f.bytes.end(), out);
+}
+inline char* put_field(char* out, Rest f) { return std::copy(f.bytes.begin(), f.bytes.end(), out); }
+
+// `op` is an Opcode, a PeerOp on links between cluster nodes, or the Codec
+// of a compressed envelope, which has the same layout.
+template <typename Op, typename... Fields>
+MessageRef encode_frame(Op op, Fields... fields) {
+    size_t len = 1 + (size_t{0} + ... + field_size(fields));
+    return MessageRef::build(varint_size(len) + len, [&](char* out) {
+        out = put_varint(out, len);
+        *out++ = static_cast<char>(op);
+        ((out = put_field(out, fields)), ...);
+    });
+}
+
+// Frames a body that was assembled separately (used for list replies).
+inline MessageRef encode_frame_body(Opcode op, std::string_view body) {
+    return encode_frame(op, Rest{body});
+}
+
+// --- Binary Framer ---
+// Pulls length-prefixed frames out of the receive ring. Bodies are views
+// into the ring (copied only if a frame wraps) and stay valid until the next
+// read. Oversized frames are skipped using their length prefix.
+class BinaryFramer {
+public:
+    enum class Result { Frame, NeedMore, TooLong, Malformed };
+
+    // Longest length prefix: a ring holding max_frame + MAX_HEADER bytes
+    // always fits the largest frame accepted.
+    static constexpr size_t MAX_HEADER = 10;
+
+    explicit BinaryFramer(size_t max_frame) : max_frame_(max_frame) {}
+
+    Result next(RecvRing& ring, Opcode& op, std::string_view& body) {
+        if (skip_ > 0) {
+            size_t n = std::min<uint64_t>(skip_, ring.size());
+            ring.consume(n);
+            skip_ -= n;
+            if (skip_ > 0) return Result::NeedMore;
+        }
+
+        uint64_t len = 0;
+        size_t header = 0;
+        for (;; ++header) {
+            if (header == ring.size()) return Result::NeedMore;
+            if (header == MAX_HEADER) return Result::Malformed;
+            uint8_t byte = ring.at(header);
+            len |= uint64_t(byte & 0x7f) << (7 * header);
+            if (!(byte & 0x80)) break;
+        }
+        ++header;
+
+        if (len == 0) return Result::Malformed;
+        if (len > max_frame_) {
+            ring.consume(header);
+            skip_ = len;
+            return Result::TooLong;
+        }
+        if (ring.size() < header + len) return Result::NeedMore;
+
+        op = static_cast<Opcode>(ring.at(header));
+        body = ring.view(header + 1, len - 1, scratch_);
+        ring.consume(header + len);
+        return Result::Frame;
+    }
+
+private:
+    size_t max_frame_;
+    uint64_t skip_ = 0;   // bytes of an oversized frame still to discard
+    std::string scratch_; // reassembly space for frames that wrap
+};
+
+// --- Server Messages ---
+// Encoders for everything the server sends, in either protocol. Text
+// encodings are the exact strings the readline client has always received.
+
+inline constexpr std::string_view RESET = "\033[0m";
+
+struct RoomSummary {
+    std::string name;
+    uint32_t id;
+    size_t members;
+};
+
+// A message headed for clients that may speak either protocol. Fan-out
+// formats both encodings once and shares them among all recipients, and
+// does the same with their compressed envelopes when a room has members
+// that negotiated compression.
+struct Payload {
+    MessageRef text;
+    MessageRef binary;
+    MessageRef text_deflated;   // envelope of `text`, if made
+    MessageRef binary_deflated; // envelope of `binary`, if made
+
+    const MessageRef& encoded(Protocol p) const { return p == Protocol::Binary ? binary : text; }
+    const MessageRef& deflated(Protocol p) const { return p == Protocol::Binary ? binary_deflated : text_deflated; }
+};
+
+template <typename Encode>
+Payload encode_both(Encode&& encode) {
+    return {encode(Protocol::Text), encode(Protocol::Binary)};
+}
+
+inline MessageRef encode_system(Protocol p, std::string_view text) {
+    if (p == Protocol::Binary) return encode_frame(Opcode::System, Rest{text});
+    return MessageRef::concat({"[System]: ", text, "\n"});
+}
+
+inline MessageRef encode_error(Protocol p, std::string_view text) {
+    if (p == Protocol::Binary) return encode_frame(Opcode::Error, Rest{text});
+    return MessageRef::concat({"[Error]: ", text, "\n"});
+}
+
+inline MessageRef encode_notice(Protocol p, uint32_t room_id, std::string_view text) {
+    if (p == Protocol::Binary) return encode_frame(Opcode::Notice, Varint{room_id}, Rest{text});
+    return MessageRef::concat({"\n[System]: ", text, "\n"});
+}
+
+inline MessageRef encode_chat(Protocol p, uint32_t room_id, std::string_view color, std::string_view sender,
+                              std::string_view text) {
+    if (p == Protocol::Binary) return encode_frame(Opcode::Chat, Varint{room_id}, Str{sender}, Rest{text});
+    return MessageRef::concat({color, "[", sender, "]: ", RESET, text, "\n"});
+}
+
+inline MessageRef encode_direct(Protocol p, std::string_view color, std::string_view sender, std::string_view text) {
+    if (p == Protocol::Binary) return encode_frame(Opcode::Direct, Str{sender}, Rest{text});
+    return MessageRef::concat({color, "[", sender, " -> you]: ", RESET, text, "\n"});
+}
+
+inline MessageRef encode_joined(Protocol p, uint32_t room_id, std::string_view room) {
+    if (p == Protocol::Binary) return encode_frame(Opcode::Joined, Varint{room_id}, Rest{room});
+    return MessageRef::concat({"[System]: You have joined room '", room, "'.\n"});
+}
+
+inline MessageRef encode_left(Protocol p, uint32_t room_id, std::string_view room) {
+    if (p == Protocol::Binary) return encode_frame(Opcode::Left, Varint{room_id}, Rest{room});
+    return MessageRef::concat({"[System]: You have left room '", room, "'.\n"});
+}
+
+// Text clients get "$ping" and answer "$pong".
+inline MessageRef encode_ping(Protocol p) {
+    if (p == Protocol::Binary) return encode_frame(Opcode::Ping);
+    return MessageRef::make("$ping\n");
+}
+
+// The first reply to a $hello that names compress=, never itself compressed:
+// the codec everything after it is in. A server with compression off answers
+// compress=deflate with compress=none.
+inline MessageRef encode_codec(Protocol p, bool deflate) {
+    std::string_view codec = deflate ? "compress=deflate" : "compress=none";
+    if (p == Protocol::Binary) return encode_frame(Opcode::Compression, Rest{codec});
+    return MessageRef::concat({"$hello ", codec, "\n"});
+}
+
+inline MessageRef encode_session(const unsigned char (&session)[16]) {
+    return encode_frame(Opcode::Session, Rest{{reinterpret_cast<const char*>(session), sizeof session}});
+}
+
+inline MessageRef encode_room_list(Protocol p, const std::vector<RoomSummary>& rooms) {
+    std::string out;
+    if (p == Protocol::Binary) {
+        append_varint(out, rooms.size());
+        for (const RoomSummary& room : rooms) {
+            append_varint(out, room.id);
+            append_varint(out, room.members);
+            append_varint(out, room.name.size());
+            out += room.name;
+        }
+        return encode_frame_body(Opcode::RoomList, out);
+    }
+    out = "[System]: Available rooms:\n";
+    if (rooms.empty()) {
+        out += "  (No rooms available)\n";
+    } else {
+        for (const RoomSummary& room : rooms) {
+            out += "  - " + room.name + " (" + std::to_string(room.members) + " members)\n";
+        }
+    }
+    return MessageRef::make(out);
+}
+
+inline MessageRef encode_member_list(Protocol p, uint32_t room_id, std::string_view room,
+                                     const std::vector<std::string_view>& names) {
+    std::string out;
+    if (p == Protocol::Binary) {
+        append_varint(out, room_id);
+        append_varint(out, names.size());
+        for (std::string_view name : names) {
+            append_varint(out, name.size());
+            out += name;
+        }
+        return encode_frame_body(Opcode::MemberList, out);
+    }
+    out = "[System]: Members in '";
+    out += room;
+    out += "':\n";
+    if (names.empty()) {
+        out += "  (This room is empty)\n";
+    } else {
+        for (std::string_view name : names) {
+            out += "  - ";
+            out += name;
+            out += "\n";
+        }
+    }
+    return MessageRef::make(out);
+}
+
+// `truncated` says there were more matches than `names` holds.
+inline MessageRef encode_user_list(Protocol p, std::string_view prefix, const std::vector<std::string>& names,
+                                   bool truncated) {
+    std::string out;
+    if (p == Protocol::Binary) {
+        out += static_cast<char>(truncated);
+        append_varint(out, names.size());
+        for (const std::string& name : names) {
+            append_varint(out, name.size());
+            out += name;
+        }
+        return encode_frame_body(Opcode::UserList, out);
+    }
+    out = "[System]: Users matching '";
+    out += prefix;
+    out += "':\n";
+    if (names.empty()) out += "  (No users found)\n";
+    for (const std::string& name : names) out += "  - " + name + "\n";
+    if (truncated) out += "  (More not shown; use a longer prefix)\n";
+    return MessageRef::make(out);
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <cstdint>
+#include <string_view>
+
+// --- Token Buckets ---
+// Kept in virtual-scheduling form (GCRA): instead of a token count and a
+// refill time, a bucket stores the time at which it would be full again.
+// Taking a token pushes that time one interval later. The bucket is empty
+// when it is more than a burst ahead of the clock. That is one word of
+// state and O(1) per check, and the shared variant is a single CAS.
+
+struct RateLimit {
+    uint64_t interval_ns = 0;  // one token per interval; 0 = unlimited
+    uint64_t tolerance_ns = 0; // (burst - 1) intervals
+
+    static RateLimit per_second(uint64_t rate, uint64_t burst) {
+        if (rate == 0) return {};
+        uint64_t interval = std::max<uint64_t>(1000000000u / rate, 1);
+        return {interval, interval * (std::max<uint64_t>(burst, 1) - 1)};
+    }
+
+    explicit operator bool() const { return interval_ns != 0; }
+};
+
+class TokenBucket {
+public:
+    // Takes a token if one is available.
+    bool take(const RateLimit& limit, uint64_t now_ns) {
+        uint64_t full_at = std::max(full_at_, now_ns);
+        if (full_at - now_ns > limit.tolerance_ns) return false;
+        full_at_ = full_at + limit.interval_ns;
+        return true;
+    }
+
+    // Takes a token even if that runs the bucket into debt.
+    void force(const RateLimit& limit, uint64_t now_ns) { full_at_ = std::max(full_at_, now_ns) + limit.interval_ns; }
+
+    // When take() can next succeed.
+    uint64_t ready_at(const RateLimit& limit) const {
+        return full_at_ > limit.tolerance_ns ? full_at_ - limit.tolerance_ns : 0;
+    }
+
+private:
+    uint64_t full_at_ = 0;
+};
+
+// A bucket shared by threads, e.g. one room's across every shard.
+class SharedTokenBucket {
+public:
+    bool take(const RateLimit& limit, uint64_t now_ns) {
+        uint64_t seen = full_at_.load(std::memory_order_relaxed);
+        while (true) {
+            uint64_t full_at = std::max(seen, now_ns);
+            if (full_at - now_ns > limit.tolerance_ns) return false;
+            if (full_at_.compare_exchange_weak(seen, full_at + limit.interval_ns, std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+    }
+
+    void force(const RateLimit& limit, uint64_t now_ns) {
+        uint64_t seen = full_at_.load(std::memory_order_relaxed);
+        while (!full_at_.compare_exchange_weak(seen, std::max(seen, now_ns) + limit.interval_ns,
+                                               std::memory_order_relaxed)) {
+        }
+    }
+
+    uint64_t ready_at(const RateLimit& limit) const {
+        uint64_t full_at = full_at_.load(std::memory_order_relaxed);
+        return full_at > limit.tolerance_ns ? full_at - limit.tolerance_ns : 0;
+    }
+
+private:
+    std::atomic<uint64_t> full_at_{0};
+};
+
+// --- Flood Control ---
+// Limits apply to whole lines and frames, after framing and before anything
+// is formatted or fanned out.
+
+enum class RateClass : uint8_t {
+    Chat,       // messages to the current room
+    Membership, // create, join and leave, which notify whole rooms
+    Query,      // lists, history and everything else
+    COUNT
+};
+
+enum class FloodPolicy {
+    Drop,  // discard excess input, with at most one notice a second
+    Pause, // stop reading from the client until its bucket refills
+};
+
+struct FloodLimits {
+    std::array<RateLimit, static_cast<size_t>(RateClass::COUNT)> client; // per connection
+    RateLimit room; // chat messages into one room, from all senders together
+    FloodPolicy policy = FloodPolicy::Drop;
+
+    const RateLimit& operator[](RateClass c) const { return client[static_cast<size_t>(c)]; }
+};
+
+inline bool parse_flood_policy(std::string_view text, FloodPolicy& out) {
+    if (text == "drop") {
+        out = FloodPolicy::Drop;
+    } else if (text == "pause") {
+        out = FloodPolicy::Pause;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// "RATE" or "RATE:BURST", in messages per second; the burst defaults to one
+// second's worth. "0" turns the limit off.
+inline bool parse_rate_limit(std::string_view text, RateLimit& out) {
+    auto parse = [](std::string_view s, uint64_t& v) {
+        auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), v);
+        return !s.empty() && ec == std::errc() && end == s.data() + s.size();
+    };
+    size_t colon = text.find(':');
+    uint64_t rate, burst;
+    if (!parse(text.substr(0, colon), rate)) return false;
+    if (colon == std::string_view::npos) {
+        burst = rate;
+    } else if (!parse(text.substr(colon + 1), burst)) {
+        return false;
+    }
+    out = RateLimit::per_second(rate, burst);
+    return true;
+}
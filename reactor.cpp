@@ -0,0 +1,128 @@
+#include "reactor.hpp"
+#include "uring_reactor.hpp"
+#include "log.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <iostream>
+#include <unistd.h>
+
+inline constexpr int MAX_EPOLL_EVENTS = 256;
+
+std::unique_ptr<Reactor> make_reactor(ReactorBackend backend) {
+    if (backend == ReactorBackend::IoUring) {
+        auto uring = std::make_unique<UringReactor>();
+        if (uring->valid()) return uring;
+        std::cerr << "io_uring unavailable, falling back to epoll\n";
+        backend = ReactorBackend::Epoll;
+    }
+    if (backend == ReactorBackend::Epoll) {
+        auto epoll = std::make_unique<EpollReactor>();
+        if (epoll->valid()) return epoll;
+        std::cerr << "epoll unavailable, falling back to poll\n";
+    }
+    return std::make_unique<PollReactor>();
+}
+
+bool parse_reactor_backend(std::string_view text, ReactorBackend& out) {
+    if (text == "poll") {
+        out = ReactorBackend::Poll;
+    } else if (text == "epoll") {
+        out = ReactorBackend::Epoll;
+    } else if (text == "io_uring") {
+        out = ReactorBackend::IoUring;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// --- PollReactor ---
+
+bool PollReactor::add(int fd) {
+    if (fd < 0) return false;
+    if (static_cast<size_t>(fd) >= slot_of_fd_.size()) slot_of_fd_.resize(fd + 1, -1);
+    if (slot_of_fd_[fd] != -1) return false;
+    slot_of_fd_[fd] = static_cast<int>(fds_.size());
+    fds_.push_back({fd, POLLIN, 0});
+    return true;
+}
+
+void PollReactor::remove(int fd) {
+    if (fd < 0 || static_cast<size_t>(fd) >= slot_of_fd_.size()) return;
+    int slot = slot_of_fd_[fd];
+    if (slot == -1) return;
+
+    // Swap-remove: move the last entry into the freed slot.
+    fds_[slot] = fds_.back();
+    slot_of_fd_[fds_[slot].fd] = slot;
+    fds_.pop_back();
+    slot_of_fd_[fd] = -1;
+}
+
+void PollReactor::set_interest(int fd, bool read, bool write) {
+    if (fd < 0 || static_cast<size_t>(fd) >= slot_of_fd_.size() || slot_of_fd_[fd] == -1) return;
+    fds_[slot_of_fd_[fd]].events = static_cast<short>((read ? POLLIN : 0) | (write ? POLLOUT : 0));
+}
+
+int PollReactor::wait(std::vector<ReactorEvent>& events, int timeout_ms) {
+    events.clear();
+    int n = ::poll(fds_.data(), fds_.size(), timeout_ms);
+    if (n < 0) return errno == EINTR ? 0 : -1;
+
+    // Collect first so callers can add and remove fds while dispatching.
+    for (const pollfd& p : fds_) {
+        if (p.revents == 0) continue;
+        events.push_back({p.fd, (p.revents & POLLIN) != 0, (p.revents & POLLOUT) != 0,
+                          (p.revents & (POLLERR | POLLHUP | POLLNVAL)) != 0});
+        if (static_cast<int>(events.size()) == n) break;
+    }
+    return static_cast<int>(events.size());
+}
+
+// --- EpollReactor ---
+
+EpollReactor::EpollReactor() : epfd_(::epoll_create1(EPOLL_CLOEXEC)), ready_(MAX_EPOLL_EVENTS) {
+    if (epfd_ == -1) perror("epoll_create1");
+}
+
+EpollReactor::~EpollReactor() {
+    if (epfd_ != -1) ::close(epfd_);
+}
+
+bool EpollReactor::add(int fd) {
+    epoll_event ev{};
+    // Edge-triggered for both directions: EPOLLOUT only fires when a full
+    // send buffer drains, so leaving it armed costs nothing while idle.
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = fd;
+    if (::epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        static LogRateLimit failures;
+        log_error(&failures) << "epoll_ctl: " << errno_text(errno);
+        return false;
+    }
+    return true;
+}
+
+void EpollReactor::remove(int fd) {
+    // Closing the fd would drop it from the set too, but only once every
+    // duplicate of the descriptor is gone; be explicit.
+    ::epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+void EpollReactor::set_interest(int, bool, bool) {
+    // Nothing to do: both directions stay armed edge-triggered. A paused
+    // reader simply isn't read, and without a new edge it isn't reported.
+}
+
+int EpollReactor::wait(std::vector<ReactorEvent>& events, int timeout_ms) {
+    events.clear();
+    int n = ::epoll_wait(epfd_, ready_.data(), static_cast<int>(ready_.size()), timeout_ms);
+    if (n < 0) return errno == EINTR ? 0 : -1;
+
+    for (int i = 0; i < n; ++i) {
+        uint32_t e = ready_[i].events;
+        events.push_back({ready_[i].data.fd, (e & (EPOLLIN | EPOLLRDHUP)) != 0, (e & EPOLLOUT) != 0,
+                          (e & (EPOLLERR | EPOLLHUP)) != 0});
+    }
+    return n;
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+// --- Event Reactor ---
+// Event sources for the server's event loop. The readiness backends are
+// driven the same way: callers drain every ready fd until EAGAIN, so the
+// edge-triggered epoll backend and the level-triggered poll fallback are
+// interchangeable. The io_uring backend (uring_reactor.hpp) instead performs
+// accepts, receives and sends itself and reports their completions.
+
+enum class ReactorBackend { Poll, Epoll, IoUring };
+
+struct ReactorEvent {
+    enum class Kind : uint8_t {
+        Ready,    // fd is readable/writable
+        Accepted, // a listener accepted `result` (a new fd, or -errno)
+        Received, // `result` bytes of input for fd are at `data`
+        Sent,     // a send() for fd wrote `result` bytes (or failed with -errno)
+    };
+
+    int fd;
+    bool readable;
+    bool writable;
+    bool hangup; // error or peer hang-up; a read will report the details
+    Kind kind = Kind::Ready;
+    int result = 0;
+    const char* data = nullptr; // Received: lent until release_buffer(buffer)
+    uint16_t buffer = 0;
+};
+
+class Reactor {
+public:
+    virtual ~Reactor() = default;
+
+    // Starts watching fd for input. Registration and removal are O(1).
+    virtual bool add(int fd) = 0;
+    virtual void remove(int fd) = 0;
+
+    // Chooses which readiness events fd reports. Callers only ask for write
+    // readiness while they have output queued, and stop asking for reads to
+    // apply backpressure.
+    virtual void set_interest(int fd, bool read, bool write) = 0;
+
+    // Blocks for up to timeout_ms (-1 = forever) and fills events with the
+    // ready fds. Returns the number of events, or -1 on error.
+    virtual int wait(std::vector<ReactorEvent>& events, int timeout_ms) = 0;
+
+    virtual const char* name() const = 0;
+
+    // --- Completion-based I/O ---
+    // Backends that do the socket I/O themselves return true here. The server
+    // then arms listeners with accept() and clients with receive() instead of
+    // add(), and hands writes to send() instead of writing on readiness.
+    virtual bool completes_io() const { return false; }
+
+    // Keeps accepting on listen_fd; every connection arrives as Accepted.
+    virtual bool accept(int) { return false; }
+
+    // Keeps receiving on fd; input arrives as Received events, and a
+    // Received event with hangup set on EOF or error. set_interest(fd,
+    // false, ...) stops receiving and set_interest(fd, true, ...) resumes.
+    virtual bool receive(int) { return false; }
+
+    // Starts one sendmsg on fd, completed by a Sent event. `msg` and the
+    // memory it points to must stay valid until then, even if fd is
+    // removed in the meantime (removal cancels it).
+    virtual bool send(int, const msghdr*) { return false; }
+
+    // Returns the buffer of a Received event once its bytes are consumed.
+    virtual void release_buffer(uint16_t) {}
+};
+
+// Creates the requested backend, falling back to epoll if io_uring is
+// unavailable and to poll if epoll is.
+std::unique_ptr<Reactor> make_reactor(ReactorBackend backend);
+
+// Parses "poll", "epoll" or "io_uring"; returns false for anything else.
+bool parse_reactor_backend(std::string_view text, ReactorBackend& out);
+
+// --- poll(2) fallback ---
+// Keeps an fd -> slot index table so removal is a swap-remove instead of an
+// erase from the middle of the pollfd array.
+class PollReactor : public Reactor {
+public:
+    bool add(int fd) override;
+    void remove(int fd) override;
+    void set_interest(int fd, bool read, bool write) override;
+    int wait(std::vector<ReactorEvent>& events, int timeout_ms) override;
+    const char* name() const override { return "poll"; }
+
+private:
+    std::vector<pollfd> fds_;
+    std::vector<int> slot_of_fd_; // fd -> index into fds_, or -1
+};
+
+// --- epoll(7), edge-triggered ---
+class EpollReactor : public Reactor {
+public:
+    EpollReactor();
+    ~EpollReactor() override;
+
+    bool valid() const { return epfd_ != -1; }
+    bool add(int fd) override;
+    void remove(int fd) override;
+    void set_interest(int fd, bool read, bool write) override;
+    int wait(std::vector<ReactorEvent>& events, int timeout_ms) override;
+    const char* name() const override { return "epoll"; }
+
+private:
+    int epfd_;
+    std::vector<epoll_event> ready_;
+};
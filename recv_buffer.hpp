@@ -0,0 +1,157 @@
+#pragma once
+
+#include "pool.hpp"
+#include <sys/uio.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+
+// --- Receive Ring Buffer ---
+// Per-connection input buffer. One read fills all free space (both halves
+// of the ring via readv), and framers pull complete messages out of it
+// without copying unless a message happens to wrap around the end. Storage
+// is allocated on first use and can be released again while empty, so idle
+// connections hold no buffer at all; it comes from the size-class pools, so
+// taking and releasing it on every read stays cheap.
+class RecvRing {
+public:
+    static constexpr size_t npos = std::string_view::npos;
+
+    // Capacity is rounded up to a power of two.
+    explicit RecvRing(size_t capacity) {
+        capacity_ = 64;
+        while (capacity_ < capacity) capacity_ <<= 1;
+    }
+
+    size_t size() const { return static_cast<size_t>(tail_ - head_); }
+    bool empty() const { return head_ == tail_; }
+    bool full() const { return size() == capacity_; }
+    size_t capacity() const { return capacity_; }
+
+    // Reads once from fd into the free space. Returns the byte count, 0 on
+    // EOF or -1 with errno set (EAGAIN when nothing is available).
+    ssize_t read_from(int fd) {
+        if (!data_) data_ = make_pool_bytes(capacity_);
+        if (full()) {
+            errno = ENOBUFS;
+            return -1;
+        }
+        size_t start = index(tail_);
+        size_t free_bytes = capacity_ - size();
+        size_t first = std::min(free_bytes, capacity_ - start);
+
+        iovec iov[2] = {{data_.get() + start, first}, {data_.get(), free_bytes - first}};
+        ssize_t n = ::readv(fd, iov, iov[1].iov_len ? 2 : 1);
+        if (n > 0) tail_ += static_cast<uint64_t>(n);
+        return n;
+    }
+
+    // Copies as much of `bytes` as fits into the free space, for backends
+    // that have already read the data. Returns the number of bytes taken.
+    size_t write(std::string_view bytes) {
+        if (!data_) data_ = make_pool_bytes(capacity_);
+        size_t n = std::min(bytes.size(), capacity_ - size());
+        size_t start = index(tail_);
+        size_t first = std::min(n, capacity_ - start);
+        std::memcpy(data_.get() + start, bytes.data(), first);
+        std::memcpy(data_.get(), bytes.data() + first, n - first);
+        tail_ += n;
+        return n;
+    }
+
+    // Offset of the first `c` within the first `limit` buffered bytes.
+    size_t find(char c, size_t limit) const {
+        limit = std::min(limit, size());
+        size_t start = index(head_);
+        size_t first = std::min(limit, capacity_ - start);
+        if (const void* p = std::memchr(data_.get() + start, c, first)) {
+            return static_cast<const char*>(p) - (data_.get() + start);
+        }
+        if (const void* p = std::memchr(data_.get(), c, limit - first)) {
+            return first + (static_cast<const char*>(p) - data_.get());
+        }
+        return npos;
+    }
+
+    uint8_t at(size_t offset) const { return static_cast<uint8_t>(data_[index(head_ + offset)]); }
+
+    // Views `n` bytes starting at `offset`. Only copies (into scratch) when
+    // the range wraps around the end of the ring. Valid until the next read.
+    std::string_view view(size_t offset, size_t n, std::string& scratch) const {
+        size_t start = index(head_ + offset);
+        if (start + n <= capacity_) return {data_.get() + start, n};
+        size_t first = capacity_ - start;
+        scratch.assign(data_.get() + start, first);
+        scratch.append(data_.get(), n - first);
+        return scratch;
+    }
+
+    void consume(size_t n) {
+        head_ += n;
+        // Rewind when empty so the next message starts at the front and is
+        // very unlikely to wrap.
+        if (head_ == tail_) head_ = tail_ = 0;
+    }
+
+    // Frees the storage if nothing is buffered.
+    void release_if_empty() {
+        if (empty()) data_.reset();
+    }
+
+private:
+    size_t index(uint64_t pos) const { return static_cast<size_t>(pos & (capacity_ - 1)); }
+
+    PoolBytes data_;
+    size_t capacity_;
+    uint64_t head_ = 0; // next byte to consume
+    uint64_t tail_ = 0; // next byte to fill
+};
+
+// --- Line Framer ---
+// Splits the buffered stream into '\n'-terminated lines. Every complete line
+// of a read is returned, partial lines wait in the ring for the rest, and a
+// line longer than the limit is discarded up to its newline and reported
+// once as TooLong.
+class LineFramer {
+public:
+    enum class Result { Line, NeedMore, TooLong };
+
+    explicit LineFramer(size_t max_line) : max_line_(max_line) {}
+
+    // On Line, `line` excludes the newline and stays valid until the next read.
+    Result next(RecvRing& ring, std::string_view& line) {
+        while (true) {
+            if (ring.empty()) return Result::NeedMore;
+            if (discarding_) {
+                size_t pos = ring.find('\n', ring.size());
+                if (pos == RecvRing::npos) {
+                    ring.consume(ring.size());
+                    return Result::NeedMore;
+                }
+                ring.consume(pos + 1);
+                discarding_ = false;
+                continue;
+            }
+
+            size_t pos = ring.find('\n', max_line_ + 1);
+            if (pos == RecvRing::npos) {
+                if (ring.size() <= max_line_) return Result::NeedMore;
+                discarding_ = true;
+                return Result::TooLong;
+            }
+            line = ring.view(0, pos, scratch_);
+            ring.consume(pos + 1);
+            return Result::Line;
+        }
+    }
+
+private:
+    size_t max_line_;
+    bool discarding_ = false; // skipping the rest of an over-long line
+    std::string scratch_;     // reassembly space for lines that wrap
+};
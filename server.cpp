@@ -1,312 +1,2026 @@
 #include "server.hpp"
 #include <iostream>
+#include <sstream>
 #include <stdexcept>
 #include <string_view>
-#include <sstream>
+#include <charconv>
+#include <climits>
+#include <chrono>
+#include <sys/eventfd.h>
+#include <csignal>
+#include <pthread.h>
+
+static bool parse_number(std::string_view text, unsigned long& out) {
+    auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), out);
+    return ec == std::errc() && end == text.data() + text.size();
+}
+
+static uint64_t monotonic_ms() { return monotonic_ns() / 1000000; }
+
+static constexpr size_t WHO_LIMIT = 100; // names per $who reply
+
+static FixedPool& connection_pool() {
+    static FixedPool* pool = new FixedPool("connection", sizeof(Connection)); // never destroyed
+    return *pool;
+}
 
-ChatServer::ChatServer(const std::string& port) : listener_(get_listener_socket(port.c_str())) {
+void* Connection::operator new(size_t) {
+    static_assert(alignof(Connection) <= 16, "pool blocks are 16-byte aligned");
+    return connection_pool().allocate();
+}
+
+void Connection::operator delete(void* p) { connection_pool().deallocate(p); }
+
+ChatServer::ChatServer(const ServerConfig& config, ShardGroup& group, uint32_t shard_id, Socket listener)
+    : config_(config), group_(group), shard_id_(shard_id), metrics_(group.metrics().shard(shard_id)),
+      listener_(listener ? std::move(listener)
+                         : get_listener_socket(config.port.c_str(), config.threads > 1, nullptr, &config.socket)),
+      wake_fd_(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      reactor_(make_reactor(config.backend)), now_ms_(monotonic_ms()), timers_(now_ms_) {
     if (!listener_) throw std::runtime_error("Failed to initialize listener socket.");
-    fds_.push_back({listener_.get(), POLLIN, 0});
+    if (!wake_fd_) throw std::runtime_error("Failed to create shard wakeup eventfd.");
+    bool listening = reactor_->completes_io() ? reactor_->accept(listener_.get()) : reactor_->add(listener_.get());
+    if (!set_non_blocking(listener_.get()) || !listening || !reactor_->add(wake_fd_.get())) {
+        throw std::runtime_error("Failed to register listener socket.");
+    }
 }
 
+static LogRateLimit accept_errors;
+
 void ChatServer::run() {
-    std::cout << "Server listening on port " << PORT << "...\n";
-    while (true) {
-        if (::poll(fds_.data(), fds_.size(), -1) < 0) {
-            perror("poll");
+    if (shard_id_ == 0) {
+        log_info() << "Server listening on port " << config_.port << " (" << reactor_->name() << ", "
+                   << group_.size() << (group_.size() == 1 ? " thread" : " threads") << ")...";
+    }
+    // Input and output carried over by a hot upgrade go before the first wait.
+    stopping_ = false;
+    finish_tick();
+    std::vector<ReactorEvent> events;
+    while (!stopping_) {
+        if (reactor_->wait(events, wait_timeout()) < 0) {
+            log_error() << "wait: " << errno_text(errno);
             break;
         }
-        for (size_t i = 0; i < fds_.size(); ++i) {
-            if (fds_[i].revents & POLLIN) {
-                if (fds_[i].fd == listener_.get()) {
-                    handle_new_connection();
+        now_ms_ = monotonic_ms();
+        for (const ReactorEvent& ev : events) {
+            if (ev.kind == ReactorEvent::Kind::Accepted) {
+                if (ev.result >= 0) {
+                    add_connection(ev.result);
                 } else {
-                    handle_client_data(i);
+                    log_error(&accept_errors) << "accept: " << errno_text(-ev.result);
                 }
+            } else if (ev.kind == ReactorEvent::Kind::Received) {
+                handle_received(ev);
+            } else if (ev.kind == ReactorEvent::Kind::Sent) {
+                handle_sent(ev);
+            } else if (ev.fd == listener_.get()) {
+                if (ev.readable) handle_new_connection();
+            } else if (ev.fd == wake_fd_.get()) {
+                if (ev.readable) drain_inbox();
+            } else if (find_connection(ev.fd)) {
+                if (ev.writable) handle_writable(ev.fd);
+                if (ev.readable || ev.hangup) handle_client_data(ev.fd);
             }
         }
+        timers_.advance(now_ms_, [this](TimerNode& timer) { handle_timeout(static_cast<int>(timer.key)); });
+        finish_tick();
     }
 }
 
+// Until the next timer, or the held output's deadline.
+int ChatServer::wait_timeout() {
+    uint64_t now = monotonic_ms();
+    int timeout = timers_.timeout(now);
+    if (config_.flush_delay == 0 || dirty_fds_.empty()) return timeout;
+    int flush = flush_at_ > now ? static_cast<int>(flush_at_ - now) : 0;
+    return timeout < 0 ? flush : std::min(timeout, flush);
+}
+
+Connection* ChatServer::find_connection(int fd) {
+    return fd < 0 ? nullptr : connections_.get(fd);
+}
+
+Connection* ChatServer::find_connection(const ClientRef& ref) {
+    return ref.fd < 0 ? nullptr : connections_.get(ref.fd, ref.generation);
+}
+
+ClientRef ChatServer::client_ref(int client_fd) {
+    return {shard_id_, client_fd, connections_.generation(client_fd)};
+}
+
 void ChatServer::handle_new_connection() {
-    int client_fd = ::accept(listener_.get(), nullptr, nullptr);
-    if (client_fd < 0) {
-        perror("accept");
+    // The listener is non-blocking; accept everything queued so an
+    // edge-triggered wakeup is never lost.
+    while (true) {
+        int client_fd = ::accept4(listener_.get(), nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) log_error(&accept_errors) << "accept: " << errno_text(errno);
+            return;
+        }
+        add_connection(client_fd);
+    }
+}
+
+void ChatServer::add_connection(int client_fd) {
+    if (!set_tcp_options(client_fd, config_.socket)) {
+        static LogRateLimit failures;
+        log_warn(&failures) << "setsockopt on fd " << client_fd << ": " << errno_text(errno);
+    }
+    // The connection starts out pending, awaiting the name handshake
+    Connection& conn = connections_.emplace(client_fd, client_fd, config_.max_line);
+    conn.accepted_at = conn.last_active = now_ms_;
+    bool registered = reactor_->completes_io() ? reactor_->receive(client_fd) : reactor_->add(client_fd);
+    if (!registered) {
+        connections_.erase(client_fd);
         return;
     }
+    metrics_.add(Counter::ConnectionsAccepted);
+    arm_timer(conn);
+    log_debug() << "New pending connection on fd " << client_fd;
+}
 
-    // Make the new socket non-blocking
-    if (!set_non_blocking(client_fd)) {
-        ::close(client_fd);
+void ChatServer::remove_client(int client_fd) {
+    Connection* conn = find_connection(client_fd);
+    leave_current_room(client_fd);
+
+    if (!conn->pending) {
+        group_.users().release(conn->info.name, client_ref(client_fd));
+        log_info() << conn->info.name << " disconnected.";
+    }
+
+    reactor_->remove(client_fd);
+    metrics_.add(Counter::ConnectionsClosed);
+    metrics_.add(Gauge::OutboundBytes, -static_cast<int64_t>(conn->out.bytes()));
+    for (const Connection::ReceivedChunk& chunk : conn->received) reactor_->release_buffer(chunk.buffer);
+    conn->received.clear();
+
+    // The backend may still be reading this connection's output; removal
+    // cancelled the send, and its completion erases the connection. Until
+    // then the fd stays open, so its number cannot be reused.
+    if (conn->send_in_flight) {
+        conn->reap_after_send = true;
         return;
     }
+    connections_.erase(client_fd); // closes the socket
+}
 
-    fds_.push_back({client_fd, POLLIN, 0});
+// --- Deadlines ---
+// Each connection has one timer, set for whichever of its deadlines comes
+// first. Input only records the time; the timer checks it when it fires
+// and re-arms if the client was active since, so busy clients cost no
+// timer operations per message.
 
-    // Add client to pending set to await name handshake
-    {
-        std::lock_guard<std::mutex> lk(state_.mtx);
-        state_.pending_clients.insert(client_fd);
+void ChatServer::arm_timer(Connection& conn) {
+    const TimeoutOptions& timeouts = config_.timeouts;
+    uint64_t due = TimerWheel::NONE;
+    if (conn.pending) {
+        if (timeouts.handshake) due = conn.accepted_at + timeouts.handshake;
+    } else {
+        if (timeouts.idle) due = conn.last_active + timeouts.idle;
+        if (timeouts.ping) due = std::min(due, std::max(conn.last_active, conn.last_ping) + timeouts.ping);
+    }
+    if (conn.throttled) due = std::min(due, conn.throttled_until);
+    if (due == TimerWheel::NONE) {
+        conn.timer.cancel();
+    } else {
+        timers_.schedule(conn.timer, due);
     }
-    std::cout << "New pending connection on fd " << client_fd << std::endl;
 }
 
-void ChatServer::remove_client(size_t client_index) {
-    int client_fd = fds_[client_index].fd;
-    std::string name;
-    
-    handle_leave_command(client_fd);
+void ChatServer::handle_timeout(int client_fd) {
+    Connection* conn = find_connection(client_fd);
+    if (!conn || conn->closing) return;
+    const TimeoutOptions& timeouts = config_.timeouts;
+    uint64_t now = timers_.now();
 
-    {
-        std::lock_guard<std::mutex> lk(state_.mtx);
-        if (state_.clients.count(client_fd)) {
-            name = state_.clients.at(client_fd).name;
-            state_.clients.erase(client_fd);
+    if (conn->throttled && now >= conn->throttled_until) {
+        conn->throttled = false;
+        resumed_fds_.push_back(client_fd);
+    }
+    if (conn->pending) {
+        if (now - conn->accepted_at >= timeouts.handshake) {
+            log_info() << "Handshake timed out on fd " << client_fd << ".";
+            close_later(*conn);
+            return;
+        }
+    } else {
+        uint64_t quiet = now - conn->last_active;
+        if (timeouts.idle && quiet >= timeouts.idle) {
+            log_info() << conn->info.name << " idle for " << quiet / 1000 << " s; disconnecting.";
+            close_later(*conn);
+            return;
+        }
+        if (timeouts.ping && now - std::max(conn->last_active, conn->last_ping) >= timeouts.ping) {
+            send_to_client(client_fd, encode_ping(conn->protocol));
+            conn->last_ping = now;
         }
     }
+    arm_timer(*conn);
+}
 
-    if (!name.empty()) {
-        std::cout << name << " disconnected.\n";
+// --- Flood Control ---
+// Every line or frame costs a token from the client's bucket for its class,
+// and a chat message one more from its room's. Buckets are checked before
+// anything is formatted, so shed input costs almost nothing. Under the pause
+// policy the input over the limit is still handled, and the client is not
+// read again until its bucket has refilled; TCP then slows the sender.
+
+bool ChatServer::admit(int client_fd, RateClass rate_class) {
+    const RateLimit& limit = config_.flood[rate_class];
+    if (!limit) return true;
+    Connection& conn = *find_connection(client_fd);
+    TokenBucket& bucket = conn.buckets[static_cast<size_t>(rate_class)];
+    uint64_t now = now_ms_ * 1000000;
+    if (bucket.take(limit, now)) return true;
+    if (config_.flood.policy == FloodPolicy::Pause) {
+        bucket.force(limit, now);
+        throttle(conn, bucket.ready_at(limit));
+        return true;
     }
+    metrics_.add(Counter::FloodDropped);
+    shed(conn, "Rate limit exceeded; message dropped.");
+    return false;
+}
 
-    ::close(client_fd);
-    fds_.erase(fds_.begin() + client_index);
+// The room's bucket is shared by every shard with members sending to it.
+bool ChatServer::admit_to_room(Connection& conn) {
+    const RateLimit& limit = config_.flood.room;
+    if (!limit) return true;
+    SharedTokenBucket* bucket = group_.directory().flood.find(conn.room);
+    uint64_t now = now_ms_ * 1000000;
+    if (!bucket || bucket->take(limit, now)) return true;
+    if (config_.flood.policy == FloodPolicy::Pause) {
+        bucket->force(limit, now);
+        throttle(conn, bucket->ready_at(limit));
+        return true;
+    }
+    metrics_.add(Counter::FloodRoomDropped);
+    shed(conn, "The room is too busy; message dropped.");
+    return false;
 }
 
-void ChatServer::handle_client_data(size_t client_index) {
-    int client_fd = fds_[client_index].fd;
-    bool is_pending;
-    {
-        std::lock_guard<std::mutex> lk(state_.mtx);
-        is_pending = state_.pending_clients.count(client_fd);
+void ChatServer::throttle(Connection& conn, uint64_t until_ns) {
+    uint64_t until = (until_ns + 999999) / 1000000;
+    if (conn.throttled) {
+        conn.throttled_until = std::max(conn.throttled_until, until);
+    } else {
+        conn.throttled = true;
+        conn.throttled_until = until;
+        metrics_.add(Counter::FloodPaused);
+        reactor_->set_interest(conn.sock.get(), false, conn.want_write);
     }
+    arm_timer(conn);
+}
 
-    if (is_pending) {
-        // --- HANDSHAKE LOGIC ---
-        char buf[128];
-        ssize_t n = ::recv(client_fd, buf, sizeof(buf) - 1, 0);
+// At most one notice a second, so shedding a flood does not become one.
+void ChatServer::shed(Connection& conn, std::string_view notice) {
+    if (now_ms_ < conn.last_flood_notice + 1000) return;
+    conn.last_flood_notice = now_ms_;
+    send_error(conn.sock.get(), notice);
+}
 
-        if (n <= 0) { // Disconnected during handshake
-            remove_client(client_index);
-            return;
+// Connections are only removed between ticks, so a disconnect discovered
+// mid-fan-out (e.g. a slow consumer) never edits a member list that is being
+// iterated.
+void ChatServer::close_later(Connection& conn) {
+    if (conn.closing) return;
+    conn.closing = true;
+    closing_fds_.push_back(conn.sock.get());
+}
+
+// Runs after every batch of reactor events: re-reads clients whose reads were
+// resumed, removes closed connections (which may broadcast leave notices)
+// and flushes everything queued during the tick, or under --flush-delay
+// once the oldest held output is due. Last, it frees retired member
+// snapshots that no shard can still be reading.
+void ChatServer::finish_tick() {
+    do {
+        resume_reads();
+        close_pending();
+        if (config_.flush_delay == 0 || now_ms_ >= flush_at_) flush_dirty();
+    } while (!resumed_fds_.empty() || !closing_fds_.empty());
+    group_.epochs().collect(shard_id_);
+}
+
+void ChatServer::resume_reads() {
+    // Clients whose reads were paused and have now drained may already have
+    // input waiting; with edge-triggered epoll no new event would report it.
+    while (!resumed_fds_.empty()) {
+        std::vector<int> resumed;
+        resumed.swap(resumed_fds_);
+        for (int fd : resumed) {
+            Connection* conn = find_connection(fd);
+            if (!conn || !conn->can_read()) continue;
+            if (reactor_->completes_io()) {
+                process_received(*conn);
+                if (conn->can_read()) reactor_->set_interest(fd, true, false);
+            } else {
+                reactor_->set_interest(fd, true, conn->want_write);
+                handle_client_data(fd);
+            }
         }
+    }
+}
+
+void ChatServer::close_pending() {
+    for (size_t i = 0; i < closing_fds_.size(); ++i) {
+        if (find_connection(closing_fds_[i])) remove_client(closing_fds_[i]);
+    }
+    closing_fds_.clear();
+}
+
+// --- Output Path ---
+
+Protocol ChatServer::protocol_of(int client_fd) {
+    Connection* conn = find_connection(client_fd);
+    return conn ? conn->protocol : Protocol::Text;
+}
+
+// Clients that negotiated compression get the payload's shared envelope if
+// fan-out made one, and their own otherwise.
+void ChatServer::send_to_client(int client_fd, const Payload& payload) {
+    Connection* conn = find_connection(client_fd);
+    if (!conn || conn->closing) return;
+    const MessageRef& msg = payload.encoded(conn->protocol);
+    if (!conn->deflate) {
+        enqueue(*conn, client_fd, msg);
+    } else if (const MessageRef& deflated = payload.deflated(conn->protocol)) {
+        enqueue(*conn, client_fd, deflated);
+    } else {
+        enqueue(*conn, client_fd, deflate(msg));
+    }
+}
+
+// Single-recipient replies only encode for the protocol the client speaks.
+void ChatServer::send_system(int client_fd, std::string_view text) {
+    send_to_client(client_fd, encode_system(protocol_of(client_fd), text));
+}
+
+void ChatServer::send_error(int client_fd, std::string_view text) {
+    send_to_client(client_fd, encode_error(protocol_of(client_fd), text));
+}
+
+void ChatServer::send_to_client(int client_fd, MessageRef msg) {
+    Connection* conn = find_connection(client_fd);
+    if (!conn || conn->closing) return;
+    enqueue(*conn, client_fd, conn->deflate ? deflate(msg) : std::move(msg));
+}
+
+// Wraps a message in a compressed envelope.
+MessageRef ChatServer::deflate(const MessageRef& msg) {
+    Codec codec;
+    std::string_view data = deflate_message(msg.view(), codec);
+    MessageRef envelope = encode_frame(codec, Rest{data});
+    metrics_.add(Counter::DeflateBytesIn, msg.size());
+    metrics_.add(Counter::DeflateBytesOut, envelope.size());
+    return envelope;
+}
+
+// Compresses the encodings some recipients want, once, before fan-out
+// hands the payload to every shard.
+void ChatServer::deflate_payload(Payload& payload, const std::array<bool, 2>& wanted) {
+    if (wanted[static_cast<size_t>(Protocol::Text)] && !payload.text_deflated) {
+        payload.text_deflated = deflate(payload.text);
+    }
+    if (wanted[static_cast<size_t>(Protocol::Binary)] && !payload.binary_deflated) {
+        payload.binary_deflated = deflate(payload.binary);
+    }
+}
+
+void ChatServer::enqueue(Connection& conn, int client_fd, MessageRef msg) {
+    metrics_.add(Counter::MessagesOut);
+    metrics_.add(Gauge::OutboundBytes, static_cast<int64_t>(msg.size()));
+    conn.out.push(std::move(msg));
+    if (!conn.dirty) {
+        if (dirty_fds_.empty()) flush_at_ = now_ms_ + config_.flush_delay;
+        conn.dirty = true;
+        dirty_fds_.push_back(client_fd);
+    }
+
+    // A burst can queue a lot within one tick; flush early once the low
+    // watermark is passed so only genuinely slow sockets reach the high one.
+    if (conn.out.bytes() > config_.outbound.low_watermark) flush_connection(conn);
+    if (conn.out.bytes() > config_.outbound.high_watermark) apply_backpressure(conn);
+}
+
+void ChatServer::flush_dirty() {
+    FanoutPool* pool = group_.fanout();
+    if (pool && !reactor_->completes_io() && dirty_fds_.size() > config_.fanout.threshold) {
+        flush_parallel(*pool);
+    } else {
+        for (size_t i = 0; i < dirty_fds_.size(); ++i) {
+            Connection* conn = find_connection(dirty_fds_[i]);
+            if (!conn) continue;
+            conn->dirty = false;
+            if (!conn->closing) flush_connection(*conn);
+        }
+    }
+    dirty_fds_.clear();
+}
+
+// The writes for a long dirty list, on the fan-out pool. Only for readiness
+// backends: a completion backend's submission ring is the shard's alone.
+void ChatServer::flush_parallel(FanoutPool& pool) {
+    metrics_.add(Counter::ParallelFlushes);
+    fanout_batches_.resize(pool.participants());
+    pool.run(fanout_chunks(dirty_fds_.size()), [&](size_t participant, size_t chunk) {
+        FanoutBatch& batch = fanout_batches_[participant];
+        size_t end = std::min(dirty_fds_.size(), (chunk + 1) * FanoutPool::CHUNK);
+        for (size_t i = chunk * FanoutPool::CHUNK; i < end; ++i) {
+            int fd = dirty_fds_[i];
+            Connection* conn = find_connection(fd);
+            if (!conn) continue;
+            conn->dirty = false;
+            if (conn->closing || conn->out.empty()) continue;
+            size_t queued = conn->out.bytes();
+            OutboundQueue::FlushResult result = conn->out.flush(fd);
+            batch.written_bytes += queued - conn->out.bytes();
+            switch (result) {
+            case OutboundQueue::FlushResult::Error:
+                batch.failed.push_back(fd);
+                break;
+            case OutboundQueue::FlushResult::Blocked:
+                if (!conn->want_write) batch.blocked.push_back(fd);
+                break;
+            case OutboundQueue::FlushResult::Drained:
+                flushed(*conn);
+                break;
+            }
+        }
+    });
+
+    for (FanoutBatch& batch : fanout_batches_) {
+        metrics_.add(Counter::BytesOut, batch.written_bytes);
+        metrics_.add(Gauge::OutboundBytes, -static_cast<int64_t>(batch.written_bytes));
+        for (int fd : batch.failed) close_later(*find_connection(fd));
+        for (int fd : batch.blocked) {
+            Connection& conn = *find_connection(fd);
+            conn.want_write = true;
+            reactor_->set_interest(fd, conn.can_read(), true);
+        }
+        batch.clear();
+    }
+}
+
+void ChatServer::flush_connection(Connection& conn) {
+    if (conn.out.empty()) return;
+    int fd = conn.sock.get();
+    size_t queued = conn.out.bytes();
+
+    // Completion-based backends: one send in flight per connection. The rest
+    // of the queue follows when it completes.
+    if (reactor_->completes_io()) {
+        if (conn.send_in_flight) return;
+        if (!conn.send) conn.send = std::make_unique<Connection::PendingSend>();
+        conn.send->msg.msg_iovlen = conn.out.prepare(conn.send->iov);
+        conn.send->msg.msg_iov = conn.send->iov.data();
+        if (reactor_->send(fd, &conn.send->msg)) {
+            conn.send_in_flight = true;
+        } else {
+            conn.out.complete(0);
+            close_later(conn);
+        }
+        metrics_.add(Gauge::OutboundBytes, -static_cast<int64_t>(queued - conn.out.bytes()));
+        return;
+    }
+
+    OutboundQueue::FlushResult result = conn.out.flush(fd);
+    metrics_.add(Counter::BytesOut, queued - conn.out.bytes());
+    metrics_.add(Gauge::OutboundBytes, -static_cast<int64_t>(queued - conn.out.bytes()));
+    switch (result) {
+    case OutboundQueue::FlushResult::Error:
+        close_later(conn);
+        return;
+    case OutboundQueue::FlushResult::Blocked:
+        if (!conn.want_write) {
+            conn.want_write = true;
+            reactor_->set_interest(fd, conn.can_read(), true);
+        }
+        return;
+    case OutboundQueue::FlushResult::Drained:
+        flushed(conn);
+        return;
+    }
+}
 
-        buf[n] = '\0';
-        std::string name(buf);
-        if (!name.empty() && name.back() == '\n') name.pop_back();
+// The queue has all been handed to the kernel.
+void ChatServer::flushed(Connection& conn) {
+    if (config_.socket.cork) push_corked(conn.sock.get());
+}
 
-        std::string color = COLORS[client_fd % COLORS.size()];
-        std::string join_msg = "\n[System]: " + name + " has joined the chat.\n";
-        
-        {
-            std::lock_guard<std::mutex> lk(state_.mtx);
-            // Handshake successful: move from pending to active clients
-            state_.pending_clients.erase(client_fd);
-            state_.clients[client_fd] = {name, color};
+void ChatServer::apply_backpressure(Connection& conn) {
+    static LogRateLimit slow_consumers;
+    const OutboundLimits& limits = config_.outbound;
+    switch (limits.policy) {
+    case SlowConsumerPolicy::DropOldest: {
+        size_t queued = conn.out.bytes();
+        size_t dropped = conn.out.drop_oldest(limits.high_watermark);
+        conn.dropped += dropped;
+        metrics_.add(Counter::MessagesDropped, dropped);
+        metrics_.add(Gauge::OutboundBytes, -static_cast<int64_t>(queued - conn.out.bytes()));
+        break;
+    }
+    case SlowConsumerPolicy::Disconnect:
+        log_warn(&slow_consumers) << "Disconnecting slow consumer on fd " << conn.sock.get() << ".";
+        metrics_.add(Counter::SlowConsumersClosed);
+        close_later(conn);
+        break;
+    case SlowConsumerPolicy::PauseReads:
+        // The client can't add load until it catches up; if the room keeps
+        // outpacing it anyway, cut it loose rather than grow without bound.
+        if (conn.out.bytes() > 2 * limits.high_watermark) {
+            log_warn(&slow_consumers) << "Disconnecting slow consumer on fd " << conn.sock.get() << ".";
+            metrics_.add(Counter::SlowConsumersClosed);
+            close_later(conn);
+        } else if (!conn.reads_paused) {
+            conn.reads_paused = true;
+            reactor_->set_interest(conn.sock.get(), false, conn.want_write);
         }
+        break;
+    }
+}
+
+void ChatServer::handle_writable(int client_fd) {
+    Connection* conn = find_connection(client_fd);
+    if (!conn || conn->closing) return;
 
-        std::cout << name << " connected on fd " << client_fd << ".\n";
-        send_all(client_fd, "[System]: Welcome! Join a room with $join <room_name>\n");
+    flush_connection(*conn);
+    if (conn->closing) return;
+    if (conn->reads_paused && conn->out.bytes() <= config_.outbound.low_watermark) {
+        conn->reads_paused = false;
+        resumed_fds_.push_back(client_fd);
+    }
+    if (conn->out.empty()) conn->want_write = false;
+    reactor_->set_interest(client_fd, conn->can_read(), conn->want_write);
+}
 
+void ChatServer::handle_sent(const ReactorEvent& ev) {
+    Connection* conn = find_connection(ev.fd);
+    if (!conn || !conn->send_in_flight) return;
+    conn->send_in_flight = false;
+    size_t written = ev.result > 0 ? static_cast<size_t>(ev.result) : 0;
+    size_t queued = conn->out.bytes();
+    conn->out.complete(written);
+    metrics_.add(Counter::BytesOut, written);
+    if (conn->reap_after_send) {
+        connections_.erase(ev.fd);
+        return;
+    }
+    // Whatever the kernel did not take is queued again.
+    metrics_.add(Gauge::OutboundBytes, static_cast<int64_t>(conn->out.bytes() - queued));
+    if (conn->closing) return;
+    if (ev.result < 0 && ev.result != -EAGAIN && ev.result != -EINTR) {
+        close_later(*conn);
+        return;
+    }
+
+    if (conn->reads_paused && conn->out.bytes() <= config_.outbound.low_watermark) {
+        conn->reads_paused = false;
+        resumed_fds_.push_back(ev.fd);
+    }
+    if (conn->out.empty()) {
+        flushed(*conn);
     } else {
-        // --- REGULAR MESSAGE LOGIC ---
-        char buf[MAXDATASIZE];
-        ssize_t n = ::recv(client_fd, buf, sizeof(buf) - 1, 0);
-        if (n <= 0) {
-            remove_client(client_index);
+        flush_connection(*conn);
+    }
+}
+
+void ChatServer::handle_client_data(int client_fd) {
+    Connection* conn = find_connection(client_fd);
+
+    // Lines left over from a paused read come first.
+    process_input(*conn);
+
+    // Drain the socket until EAGAIN; the epoll backend is edge-triggered and
+    // will not report this fd again until new data arrives.
+    while (conn->can_read()) {
+        ssize_t n = conn->in.read_from(client_fd);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        }
+        if (n <= 0) { // Disconnected or hard error
+            close_later(*conn);
+            return;
+        }
+        metrics_.add(Counter::BytesIn, static_cast<uint64_t>(n));
+        conn->last_active = now_ms_;
+        process_input(*conn);
+    }
+    conn->in.release_if_empty();
+}
+
+// Input from a completion-based backend arrives already read, in a buffer
+// the backend lends until release_buffer().
+void ChatServer::handle_received(const ReactorEvent& ev) {
+    Connection* conn = find_connection(ev.fd);
+    if (!conn || conn->closing) {
+        if (ev.data) reactor_->release_buffer(ev.buffer);
+        return;
+    }
+    if (ev.hangup) { // Disconnected or hard error
+        close_later(*conn);
+        return;
+    }
+    metrics_.add(Counter::BytesIn, static_cast<uint64_t>(ev.result));
+    conn->last_active = now_ms_;
+    conn->received.push_back({ev.buffer, {ev.data, static_cast<size_t>(ev.result)}});
+    process_received(*conn);
+}
+
+// Moves received bytes into the connection's ring as it drains, so framing
+// is the same as for data read on readiness. Chunks stay lent while reads
+// are paused.
+void ChatServer::process_received(Connection& conn) {
+    process_input(conn);
+    while (!conn.received.empty() && conn.can_read()) {
+        Connection::ReceivedChunk& chunk = conn.received.front();
+        size_t n = conn.in.write(chunk.bytes);
+        if (n == 0) { // full of input the framer cannot use
+            close_later(conn);
+            return;
+        }
+        chunk.bytes.remove_prefix(n);
+        if (chunk.bytes.empty()) {
+            reactor_->release_buffer(chunk.buffer);
+            conn.received.erase(conn.received.begin());
+        }
+        process_input(conn);
+    }
+    conn.in.release_if_empty();
+}
+
+// Handles every complete line in the receive buffer; a partial line stays
+// buffered until the rest arrives.
+void ChatServer::process_input(Connection& conn) {
+    int client_fd = conn.sock.get();
+    std::string_view line;
+    while (conn.can_read()) {
+        // The handshake may switch the rest of the stream to binary frames.
+        if (conn.protocol == Protocol::Binary && !conn.pending) return process_frames(conn);
+
+        LineFramer::Result result = conn.framer.next(conn.in, line);
+        if (result == LineFramer::Result::NeedMore) return;
+        if (result == LineFramer::Result::TooLong) {
+            send_error(client_fd, "Line too long (max " + std::to_string(config_.max_line) + " bytes).");
+            continue;
+        }
+
+        if (conn.pending) {
+            handle_handshake(client_fd, line);
         } else {
-            buf[n] = '\0';
-            std::string line(buf);
-            if (!line.empty() && line.back() == '\n') line.pop_back();
+            handle_line(client_fd, line);
+        }
+    }
+}
 
-            if (auto command = parse_command(line)) {
-                handle_command(client_fd, *command);
-            } else {
-                handle_chat_message(client_fd, line);
+void ChatServer::process_frames(Connection& conn) {
+    int client_fd = conn.sock.get();
+    Opcode op;
+    std::string_view body;
+    while (conn.can_read()) {
+        switch (conn.binary_framer.next(conn.in, op, body)) {
+        case BinaryFramer::Result::NeedMore:
+            return;
+        case BinaryFramer::Result::TooLong:
+            send_error(client_fd, "Frame too long (max " + std::to_string(config_.max_line) + " bytes).");
+            continue;
+        case BinaryFramer::Result::Malformed:
+            close_later(conn);
+            return;
+        case BinaryFramer::Result::Frame:
+            handle_frame(client_fd, op, body);
+            continue;
+        }
+    }
+}
+
+// The first line is either a bare name (the readline client) or
+// "$hello name=<name> [proto=text|binary] [compress=none|deflate]".
+void ChatServer::handle_handshake(int client_fd, std::string_view line) {
+    ScopedTimer timer(metrics_, Timer::Handshake);
+    metrics_.add(Counter::MessagesIn);
+    std::string name(line);
+    Protocol protocol = Protocol::Text;
+    bool deflate = false;
+    bool codec_asked = false;
+
+    if (line.rfind("$hello ", 0) == 0) {
+        name.clear();
+        std::string_view rest = line.substr(7);
+        while (!rest.empty()) {
+            size_t end = rest.find(' ');
+            std::string_view token = rest.substr(0, end);
+            rest = end == std::string_view::npos ? std::string_view{} : rest.substr(end + 1);
+            if (token.rfind("name=", 0) == 0) {
+                name = token.substr(5);
+            } else if (token == "proto=binary") {
+                protocol = Protocol::Binary;
+            } else if (token == "compress=deflate" || token == "compress=none") {
+                deflate = token == "compress=deflate" && config_.compression;
+                codec_asked = true;
+            } else if (!token.empty() && token != "proto=text") {
+                send_error(client_fd, "Unsupported handshake option '" + std::string(token) + "'.");
+                close_later(*find_connection(client_fd));
+                return;
             }
         }
     }
+
+    // Errors from here on are in the format the client asked for. It stays
+    // pending, and may send another handshake line, until its name is free.
+    Connection* conn = find_connection(client_fd);
+    conn->protocol = protocol;
+    conn->deflate = deflate;
+    if (codec_asked) enqueue(*conn, client_fd, encode_codec(protocol, deflate));
+    if (name.empty()) {
+        send_error(client_fd, "Your name must not be empty. Send another name.");
+        return;
+    }
+    if (!group_.users().claim(name, client_ref(client_fd))) {
+        send_error(client_fd, "The name '" + name + "' is taken. Send another name.");
+        return;
+    }
+
+    // Handshake successful: the client becomes active
+    conn->pending = false;
+    conn->info.name = std::move(name);
+    conn->info.color = COLORS[client_fd % COLORS.size()];
+    uuid_generate_random(conn->info.session);
+
+    char session[37];
+    uuid_unparse_lower(conn->info.session, session);
+    log_info() << conn->info.name << " connected on fd " << client_fd << " (session " << session << ").";
+    arm_timer(*conn);
+    send_system(client_fd, "Welcome! Join a room with $join <room_name>");
+    if (protocol == Protocol::Binary) send_to_client(client_fd, encode_session(conn->info.session));
+}
+
+void ChatServer::handle_line(int client_fd, std::string_view line) {
+    metrics_.add(Counter::MessagesIn);
+    CommandLine command;
+    if (parse_command_line(line, command)) {
+        handle_command(client_fd, command);
+    } else if (admit(client_fd, RateClass::Chat)) {
+        ScopedTimer timer(metrics_, Timer::Chat);
+        handle_chat_message(client_fd, line);
+    }
 }
 
-std::optional<Command> ChatServer::parse_command(const std::string& line) {
-    if (line.empty() || line.rfind("$", 0) != 0) return std::nullopt;
-    std::stringstream ss(line);
-    std::string command_str;
-    ss >> command_str;
-    Command cmd;
-    cmd.name = command_str.substr(1);
-    std::string arg;
-    while (ss >> arg) cmd.args.push_back(arg);
-    return cmd;
+static Timer timer_for(Opcode op) {
+    switch (op) {
+    case Opcode::Create: return Timer::Create;
+    case Opcode::Join: return Timer::Join;
+    case Opcode::Leave: return Timer::Leave;
+    case Opcode::ListRooms: return Timer::ListRooms;
+    case Opcode::ListMembers: return Timer::ListMembers;
+    case Opcode::Message: return Timer::Chat;
+    case Opcode::GetHistory: return Timer::History;
+    case Opcode::Auth: return Timer::Auth;
+    case Opcode::GetStats: return Timer::Stats;
+    case Opcode::Pong: return Timer::Pong;
+    case Opcode::DirectMessage: return Timer::DirectMessage;
+    case Opcode::Who: return Timer::Who;
+    default: return Timer::Unknown;
+    }
 }
 
-void ChatServer::handle_command(int client_fd, const Command& command) {
-    if (command.name == "create") {
-        if (handle_create_command(client_fd, command.args)) {
-            handle_join_command(client_fd, command.args);
-        }
-    } else if (command.name == "join") {
-        handle_join_command(client_fd, command.args);
-    } else if (command.name == "leave") {
+static RateClass rate_class_for(Opcode op) {
+    switch (op) {
+    case Opcode::Message:
+    case Opcode::DirectMessage: return RateClass::Chat;
+    case Opcode::Create:
+    case Opcode::Join:
+    case Opcode::Leave: return RateClass::Membership;
+    default: return RateClass::Query;
+    }
+}
+
+void ChatServer::handle_frame(int client_fd, Opcode op, std::string_view body) {
+    metrics_.add(Counter::MessagesIn);
+    if (!admit(client_fd, rate_class_for(op))) return;
+    ScopedTimer timer(metrics_, timer_for(op));
+    switch (op) {
+    case Opcode::Create:
+        if (handle_create_command(client_fd, body)) handle_join_command(client_fd, body);
+        break;
+    case Opcode::Join:
+        handle_join_command(client_fd, body);
+        break;
+    case Opcode::Leave:
         handle_leave_command(client_fd);
-    } else if (command.name == "list_rooms") {
+        break;
+    case Opcode::ListRooms:
         handle_list_rooms_command(client_fd);
-    } else if (command.name == "list_members") {
+        break;
+    case Opcode::ListMembers:
         handle_list_members_command(client_fd);
+        break;
+    case Opcode::Message:
+        handle_chat_message(client_fd, body);
+        break;
+    case Opcode::GetHistory: {
+        uint64_t count = config_.history.messages;
+        if (!body.empty() && !read_varint(body, count)) {
+            send_error(client_fd, "Malformed history request.");
+        } else {
+            handle_history_command(client_fd, count);
+        }
+        break;
     }
-    else {
-        send_all(client_fd, "[Error]: Unknown command '" + command.name + "'.\n");
+    case Opcode::Auth:
+        handle_auth_command(client_fd, body);
+        break;
+    case Opcode::GetStats:
+        handle_stats_command(client_fd);
+        break;
+    case Opcode::Pong:
+        break; // receiving it was the point
+    case Opcode::DirectMessage: {
+        std::string_view recipient;
+        if (!read_str(body, recipient)) {
+            send_error(client_fd, "Malformed direct message.");
+        } else {
+            handle_direct_message(client_fd, recipient, body);
+        }
+        break;
+    }
+    case Opcode::Who:
+        handle_who_command(client_fd, body);
+        break;
+    default:
+        send_error(client_fd, "Unknown opcode " + std::to_string(static_cast<int>(op)) + ".");
+        break;
     }
 }
 
-void ChatServer::handle_chat_message(int client_fd, const std::string& msg) {
-    // Use std::unique_lock to allow for manual unlocking
-    std::unique_lock<std::mutex> lk(state_.mtx);
+const CommandTable<ChatServer::Command, 11> ChatServer::COMMANDS({{
+    {"create", {&ChatServer::command_create, Timer::Create, RateClass::Membership}},
+    {"join", {&ChatServer::command_join, Timer::Join, RateClass::Membership}},
+    {"leave", {&ChatServer::command_leave, Timer::Leave, RateClass::Membership}},
+    {"list_rooms", {&ChatServer::command_list_rooms, Timer::ListRooms}},
+    {"list_members", {&ChatServer::command_list_members, Timer::ListMembers}},
+    {"history", {&ChatServer::command_history, Timer::History}},
+    {"auth", {&ChatServer::command_auth, Timer::Auth}},
+    {"stats", {&ChatServer::command_stats, Timer::Stats}},
+    {"pong", {&ChatServer::command_pong, Timer::Pong}},
+    {"msg", {&ChatServer::command_msg, Timer::DirectMessage, RateClass::Chat}},
+    {"who", {&ChatServer::command_who, Timer::Who}},
+}});
 
-    if (state_.client_to_room_name.count(client_fd)) {
-        std::string room_name = state_.client_to_room_name.at(client_fd);
-        const auto& info = state_.clients.at(client_fd);
-        std::string formatted_msg = info.color + "[" + info.name + "]: " + RESET + msg + "\n";
-        lk.unlock(); 
-        
-        broadcast_to_room(room_name, formatted_msg, client_fd);
-        std::cout << formatted_msg;
+void ChatServer::handle_command(int client_fd, const CommandLine& command) {
+    const Command* entry = COMMANDS.find(command.name);
+    if (!admit(client_fd, entry ? entry->rate_class : RateClass::Query)) return;
+    if (entry) {
+        ScopedTimer timer(metrics_, entry->timer);
+        (this->*entry->handler)(client_fd, command);
     } else {
-        lk.unlock();
-        send_all(client_fd, "[Error]: You must join a room to chat. Use $join <room_name>\n");
+        ScopedTimer timer(metrics_, Timer::Unknown);
+        send_error(client_fd, "Unknown command '" + std::string(command.name) + "'.");
     }
 }
 
-// --- Specific Command Handlers ---
+void ChatServer::command_create(int client_fd, const CommandLine& command) {
+    CommandArgs args = command.args();
+    if (args.empty()) {
+        send_error(client_fd, "Usage: $create <room_name>");
+    } else if (handle_create_command(client_fd, args[0])) {
+        handle_join_command(client_fd, args[0]);
+    }
+}
 
-bool ChatServer::handle_create_command(int client_fd, const std::vector<std::string>& args) {
+void ChatServer::command_join(int client_fd, const CommandLine& command) {
+    CommandArgs args = command.args();
     if (args.empty()) {
-        send_all(client_fd, "[Error]: Usage: $create <room_name>\n");
+        send_error(client_fd, "Usage: $join <room_name>");
+    } else {
+        handle_join_command(client_fd, args[0]);
+    }
+}
+
+void ChatServer::command_leave(int client_fd, const CommandLine&) {
+    handle_leave_command(client_fd);
+}
+
+void ChatServer::command_list_rooms(int client_fd, const CommandLine&) {
+    handle_list_rooms_command(client_fd);
+}
+
+void ChatServer::command_list_members(int client_fd, const CommandLine&) {
+    handle_list_members_command(client_fd);
+}
+
+void ChatServer::command_history(int client_fd, const CommandLine& command) {
+    CommandArgs args = command.args();
+    unsigned long count = config_.history.messages;
+    if (!args.empty() && !parse_number(args[0], count)) {
+        send_error(client_fd, "Usage: $history [count]");
+    } else {
+        handle_history_command(client_fd, count);
+    }
+}
+
+void ChatServer::command_auth(int client_fd, const CommandLine& command) {
+    CommandArgs args = command.args();
+    if (args.empty()) {
+        send_error(client_fd, "Usage: $auth <token>");
+    } else {
+        handle_auth_command(client_fd, args[0]);
+    }
+}
+
+void ChatServer::command_stats(int client_fd, const CommandLine&) {
+    handle_stats_command(client_fd);
+}
+
+// The answer to a $ping; reading it already counted as activity.
+void ChatServer::command_pong(int, const CommandLine&) {}
+
+void ChatServer::command_msg(int client_fd, const CommandLine& command) {
+    if (command.arg_count < 2) {
+        send_error(client_fd, "Usage: $msg <user> <text>");
+    } else {
+        handle_direct_message(client_fd, command.arg_storage[0], command.rest(1));
+    }
+}
+
+void ChatServer::command_who(int client_fd, const CommandLine& command) {
+    handle_who_command(client_fd, command.arg_count ? command.arg_storage[0] : std::string_view{});
+}
+
+void ChatServer::handle_chat_message(int client_fd, std::string_view msg) {
+    Connection& conn = *find_connection(client_fd);
+    if (conn.room != 0) {
+        if (!admit_to_room(conn)) return;
+        Payload formatted_msg = encode_both([&](Protocol p) {
+            return encode_chat(p, conn.room, conn.info.color, conn.info.name, msg);
+        });
+        log_chat() << formatted_msg.text.view();
+
+        if (WriteAheadLog* wal = group_.wal()) wal->append_message(conn.room, formatted_msg);
+        if (config_.history.messages > 0) {
+            send_to_shard(group_.owner_of(conn.room), AppendHistory{conn.room, formatted_msg});
+        }
+        if (ClusterNode* cluster = group_.cluster(); cluster && group_.directory().remote_nodes_of(conn.room)) {
+            cluster->post(ClusterPublish{conn.room, conn.info.color, conn.info.name, std::string(msg)});
+        }
+        broadcast_to_room(conn.room, std::move(formatted_msg), client_fd);
+    } else {
+        send_error(client_fd, "You must join a room to chat. Use $join <room_name>");
+    }
+}
+
+// --- Specific Command Handlers ---
+// These run on the client's shard. Anything that touches a room's member
+// list is forwarded to the room's owning shard.
+
+bool ChatServer::handle_create_command(int client_fd, std::string_view room_name) {
+    if (room_name.empty()) {
+        send_error(client_fd, "Usage: $create <room_name>");
         return false;
     }
-    const std::string& room_name = args[0];
-    std::lock_guard<std::mutex> lk(state_.mtx);
-    if (state_.rooms.count(room_name)) {
-        send_all(client_fd, "[Error]: Room '" + room_name + "' already exists.\n");
+    std::string name(room_name);
+    auto room_id = group_.directory().try_create(room_name);
+    if (!room_id) {
+        send_error(client_fd, "Room '" + name + "' already exists.");
         return false;
     } else {
-        state_.rooms.emplace(room_name, Room(room_name));
-        send_all(client_fd, "[System]: Room '" + room_name + "' created.\n");
+        if (WriteAheadLog* wal = group_.wal()) wal->append_room(*room_id, name);
+        if (ClusterNode* cluster = group_.cluster()) cluster->post(ClusterRoomCreated{*room_id});
+        send_system(client_fd, "Room '" + name + "' created.");
         return true;
     }
 }
 
-void ChatServer::handle_join_command(int client_fd, const std::vector<std::string>& args) {
-    if (args.empty()) {
-        send_all(client_fd, "[Error]: Usage: $join <room_name>\n");
+void ChatServer::handle_join_command(int client_fd, std::string_view room_name) {
+    if (room_name.empty()) {
+        send_error(client_fd, "Usage: $join <room_name>");
         return;
     }
-    const std::string& room_name = args[0];
-    std::string user_name;
-
-    std::unique_lock<std::mutex> lk(state_.mtx);
-    if (!state_.rooms.count(room_name)) {
-        send_all(client_fd, "[Error]: Room '" + room_name + "' does not exist.\n");
+    auto room_id = group_.directory().find(room_name);
+    if (!room_id) {
+        send_error(client_fd, "Room '" + std::string(room_name) + "' does not exist.");
         return;
     }
-    user_name = state_.clients.at(client_fd).name;
-    
+
     // Leave current room if in one
-    if (state_.client_to_room_name.count(client_fd)) {
-        std::string old_room_name = state_.client_to_room_name.at(client_fd);
-        if (old_room_name == room_name) {
-            send_all(client_fd, "[Error]: You are already in that room.\n");
-            return;
-        }
-        state_.rooms.at(old_room_name).removeMember(client_fd);
-        std::string leave_msg = "\n[System]: " + user_name + " has left the room.\n";
-        lk.unlock();
-        broadcast_to_room(old_room_name, leave_msg, -1);
-        lk.lock();
+    Connection& conn = *find_connection(client_fd);
+    if (conn.room == *room_id) {
+        send_error(client_fd, "You are already in that room.");
+        return;
     }
+    leave_current_room(client_fd);
+
+    // The owner announces the join and confirms it to the client.
+    conn.room = *room_id;
+    send_to_shard(group_.owner_of(conn.room),
+                  JoinRoom{conn.room, client_ref(client_fd), {conn.protocol, conn.deflate}, conn.info.name});
+}
+
+// Removes the client from its room; the owning shard tells the remaining
+// members and, if `confirm`, the client.
+void ChatServer::leave_current_room(int client_fd, bool confirm) {
+    Connection& conn = *find_connection(client_fd);
+    if (conn.room == 0) return;
 
-    // Add user to new room
-    state_.rooms.at(room_name).addMember(client_fd);
-    state_.client_to_room_name[client_fd] = room_name;
-    std::string join_msg = "\n[System]: " + user_name + " has joined the room.\n";
-    
-    lk.unlock();
-    broadcast_to_room(room_name, join_msg, client_fd);
-    send_all(client_fd, "[System]: You have joined room '" + room_name + "'.\n");
+    uint32_t room_id = std::exchange(conn.room, 0);
+    send_to_shard(group_.owner_of(room_id), LeaveRoom{room_id, client_ref(client_fd), conn.info.name, confirm});
 }
 
 void ChatServer::handle_leave_command(int client_fd) {
-    std::unique_lock<std::mutex> lk(state_.mtx);
-    if (state_.client_to_room_name.count(client_fd)) {
-        std::string room_name = state_.client_to_room_name.at(client_fd);
-        std::string user_name = state_.clients.at(client_fd).name;
-
-        state_.rooms.at(room_name).removeMember(client_fd);
-        state_.client_to_room_name.erase(client_fd);
-        
-        std::string leave_msg = "\n[System]: " + user_name + " has left the room.\n";
-        lk.unlock();
-        broadcast_to_room(room_name, leave_msg, -1);
-        send_all(client_fd, "[System]: You have left room '" + room_name + "'.\n");
+    if (find_connection(client_fd)->room != 0) {
+        leave_current_room(client_fd, true);
     } else {
-        send_all(client_fd, "[Error]: You are not in a room.\n");
+        send_error(client_fd, "You are not in a room.");
     }
 }
 
 void ChatServer::handle_list_rooms_command(int client_fd) {
-    std::string room_list = "[System]: Available rooms:\n";
-    {
-        std::lock_guard<std::mutex> lk(state_.mtx);
-        if (state_.rooms.empty()) {
-            room_list += "  (No rooms available)\n";
+    send_to_client(client_fd, encode_room_list(protocol_of(client_fd), group_.directory().summaries()));
+}
+
+void ChatServer::handle_list_members_command(int client_fd) {
+    uint32_t room_id = find_connection(client_fd)->room;
+    if (room_id != 0) {
+        send_to_shard(group_.owner_of(room_id), ListMembers{room_id, client_ref(client_fd)});
+    } else {
+        send_error(client_fd, "You are not in a room.");
+    }
+}
+
+void ChatServer::handle_history_command(int client_fd, size_t count) {
+    const Connection& conn = *find_connection(client_fd);
+    if (conn.room != 0) {
+        send_to_shard(group_.owner_of(conn.room), HistoryRequest{conn.room, client_ref(client_fd), conn.protocol, count});
+    } else {
+        send_error(client_fd, "You are not in a room.");
+    }
+}
+
+// Compares in time independent of where the first difference is, so the
+// token cannot be guessed byte by byte.
+static bool token_matches(std::string_view given, std::string_view expected) {
+    unsigned char diff = given.size() == expected.size() ? 0 : 1;
+    for (size_t i = 0; i < expected.size(); ++i) {
+        diff |= static_cast<unsigned char>(expected[i] ^ (i < given.size() ? given[i] : 0));
+    }
+    return diff == 0;
+}
+
+void ChatServer::handle_auth_command(int client_fd, std::string_view token) {
+    Connection& conn = *find_connection(client_fd);
+    if (config_.admin_token.empty()) {
+        send_error(client_fd, "Admin commands are disabled.");
+    } else if (token_matches(token, config_.admin_token)) {
+        conn.admin = true;
+        send_system(client_fd, "Authenticated as admin.");
+    } else {
+        static LogRateLimit failures;
+        log_warn(&failures) << "Failed $auth on fd " << client_fd << ".";
+        send_error(client_fd, "Authentication failed.");
+    }
+}
+
+// Counters and latencies summed over every shard, read without locking.
+void ChatServer::handle_stats_command(int client_fd) {
+    if (!find_connection(client_fd)->admin) {
+        send_error(client_fd, "Permission denied: $stats requires $auth.");
+        return;
+    }
+    std::string text = group_.metrics().render();
+    if (!text.empty() && text.back() == '\n') text.pop_back();
+    send_system(client_fd, "Server statistics:\n" + text);
+}
+
+// Delivered straight to the recipient's connection, on whichever shard it
+// lives; nothing is logged, kept in history or written to the WAL.
+void ChatServer::handle_direct_message(int client_fd, std::string_view recipient, std::string_view text) {
+    const Connection& conn = *find_connection(client_fd);
+    std::optional<ClientRef> target = group_.users().find(recipient);
+    if (!target) {
+        send_error(client_fd, "No user named '" + std::string(recipient) + "' is online.");
+        return;
+    }
+    metrics_.add(Counter::DirectMessages);
+    reply(*target, encode_both([&](Protocol p) { return encode_direct(p, conn.info.color, conn.info.name, text); }));
+}
+
+void ChatServer::handle_who_command(int client_fd, std::string_view prefix) {
+    bool truncated = false;
+    std::vector<std::string> names = group_.users().with_prefix(prefix, WHO_LIMIT, truncated);
+    send_to_client(client_fd, encode_user_list(protocol_of(client_fd), prefix, names, truncated));
+}
+
+// Fans a message out from the room's published member snapshot, on the
+// sender's own shard: local members are written to directly and every other
+// shard with members gets one Deliver. The sender gets its copy first and
+// unconditionally, since its join may not be in the snapshot yet.
+void ChatServer::broadcast_to_room(uint32_t room_id, Payload msg, int sender_fd_to_skip) {
+    ScopedTimer timer(metrics_, Timer::Fanout);
+    metrics_.add(Counter::Broadcasts);
+    EpochDomain::Guard guard(group_.epochs(), shard_id_);
+    const MemberList* members = group_.directory().members.load(room_id);
+    if (members) deflate_payload(msg, members->deflate);
+    if (sender_fd_to_skip >= 0) send_to_client(sender_fd_to_skip, msg);
+    if (!members) return;
+    for (uint32_t shard = 0; shard < members->by_shard.size(); ++shard) {
+        const std::vector<ClientRef>& targets = members->by_shard[shard];
+        if (targets.empty()) continue;
+        if (shard == shard_id_) {
+            deliver(targets, msg, sender_fd_to_skip);
         } else {
-            for (const auto& [name, room] : state_.rooms) {
-                room_list += "  - " + name + " (" + std::to_string(room.members.size()) + " members)\n";
-            }
+            metrics_.add(Counter::ShardMessagesSent);
+            group_.shard(shard).post(Deliver{{}, members->shared_from_this(), msg});
         }
     }
-    send_all(client_fd, room_list);
 }
 
-void ChatServer::handle_list_members_command(int client_fd) {
-    std::string member_list;
-    {
-        std::lock_guard<std::mutex> lk(state_.mtx);
-        if (state_.client_to_room_name.count(client_fd)) {
-            std::string room_name = state_.client_to_room_name.at(client_fd);
-            member_list = "[System]: Members in '" + room_name + "':\n";
-            const auto& room = state_.rooms.at(room_name);
-            if (room.members.empty()) {
-                member_list += "  (This room is empty)\n";
-            } else {
-                for (int member_fd : room.members) {
-                    member_list += "  - " + state_.clients.at(member_fd).name + "\n";
-                }
+// Queues a message for this shard's connections among `targets`.
+void ChatServer::deliver(const std::vector<ClientRef>& targets, const Payload& msg, int sender_fd_to_skip) {
+    FanoutPool* pool = group_.fanout();
+    if (pool && targets.size() > config_.fanout.threshold) {
+        deliver_parallel(*pool, targets, msg, sender_fd_to_skip);
+        return;
+    }
+    for (const ClientRef& target : targets) {
+        if (target.fd != sender_fd_to_skip && find_connection(target)) send_to_client(target.fd, msg);
+    }
+}
+
+// The pool queues the message in chunks; afterwards the shard does the rest
+// of what enqueue() would have done for each connection. Connections past
+// the low watermark are few, so flushing them early stays on the shard.
+void ChatServer::deliver_parallel(FanoutPool& pool, const std::vector<ClientRef>& targets, const Payload& msg,
+                                  int sender_fd_to_skip) {
+    metrics_.add(Counter::ParallelFanouts);
+    fanout_batches_.resize(pool.participants());
+    pool.run(fanout_chunks(targets.size()), [&](size_t participant, size_t chunk) {
+        FanoutBatch& batch = fanout_batches_[participant];
+        size_t end = std::min(targets.size(), (chunk + 1) * FanoutPool::CHUNK);
+        for (size_t i = chunk * FanoutPool::CHUNK; i < end; ++i) {
+            const ClientRef& target = targets[i];
+            Connection* conn = target.fd == sender_fd_to_skip ? nullptr : find_connection(target);
+            if (!conn || conn->closing) continue;
+            const MessageRef& out = conn->deflate ? msg.deflated(conn->protocol) : msg.encoded(conn->protocol);
+            if (!out) {
+                batch.unshared.push_back(target.fd);
+                continue;
             }
+            ++batch.messages;
+            batch.queued_bytes += out.size();
+            conn->out.push(out);
+            if (!conn->dirty) {
+                conn->dirty = true;
+                batch.dirty.push_back(target.fd);
+            }
+            if (conn->out.bytes() > config_.outbound.low_watermark) batch.crowded.push_back(target.fd);
+        }
+    });
+
+    for (FanoutBatch& batch : fanout_batches_) {
+        metrics_.add(Counter::MessagesOut, batch.messages);
+        metrics_.add(Gauge::OutboundBytes, static_cast<int64_t>(batch.queued_bytes));
+        if (dirty_fds_.empty() && !batch.dirty.empty()) flush_at_ = now_ms_ + config_.flush_delay;
+        dirty_fds_.insert(dirty_fds_.end(), batch.dirty.begin(), batch.dirty.end());
+        for (int fd : batch.unshared) send_to_client(fd, msg);
+        for (int fd : batch.crowded) {
+            Connection& conn = *find_connection(fd);
+            if (conn.closing) continue;
+            flush_connection(conn);
+            if (conn.out.bytes() > config_.outbound.high_watermark) apply_backpressure(conn);
+        }
+        batch.clear();
+    }
+}
+
+// --- Cross-shard plumbing ---
+
+void ChatServer::post(ShardMessage msg) {
+    inbox_.push(std::move(msg));
+    // Only the first producer after a drain pays for the eventfd write.
+    if (!wake_pending_.exchange(true, std::memory_order_acq_rel)) {
+        uint64_t one = 1;
+        if (::write(wake_fd_.get(), &one, sizeof one) < 0 && errno != EAGAIN) {
+            static LogRateLimit failures;
+            log_error(&failures) << "eventfd write: " << errno_text(errno);
+        }
+    }
+}
+
+void ChatServer::send_to_shard(uint32_t shard, ShardMessage msg) {
+    if (shard == shard_id_) {
+        dispatch(msg);
+    } else {
+        metrics_.add(Counter::ShardMessagesSent);
+        group_.shard(shard).post(std::move(msg));
+    }
+}
+
+// Returns whether there were any messages.
+bool ChatServer::drain_inbox() {
+    uint64_t count;
+    while (::read(wake_fd_.get(), &count, sizeof count) > 0) {}
+    // Clear the flag before draining so a push racing with the drain
+    // re-signals the eventfd instead of being missed.
+    wake_pending_.store(false, std::memory_order_release);
+    bool any = false;
+    while (auto msg = inbox_.pop()) {
+        metrics_.add(Counter::ShardMessagesHandled);
+        dispatch(*msg);
+        any = true;
+    }
+    return any;
+}
+
+void ChatServer::dispatch(ShardMessage& msg) {
+    std::visit([this](auto& m) {
+        using T = std::decay_t<decltype(m)>;
+        if constexpr (std::is_same_v<T, JoinRoom>) on_join_room(m);
+        else if constexpr (std::is_same_v<T, LeaveRoom>) on_leave_room(m);
+        else if constexpr (std::is_same_v<T, ListMembers>) on_list_members(m);
+        else if constexpr (std::is_same_v<T, AppendHistory>) on_append_history(m);
+        else if constexpr (std::is_same_v<T, HistoryRequest>) on_history_request(m);
+        else if constexpr (std::is_same_v<T, Deliver>) on_deliver(m);
+        else if constexpr (std::is_same_v<T, ClusterDeliver>) on_cluster_deliver(m);
+        else if constexpr (std::is_same_v<T, Quiesce>) on_quiesce(m);
+    }, msg);
+}
+
+// Sends a message to a client on any shard.
+void ChatServer::reply(const ClientRef& client, Payload payload) {
+    if (client.shard == shard_id_) {
+        if (find_connection(client)) send_to_client(client.fd, payload);
+    } else {
+        metrics_.add(Counter::ShardMessagesSent);
+        group_.shard(client.shard).post(Deliver{{client}, nullptr, std::move(payload)});
+    }
+}
+
+Room* ChatServer::find_room(uint32_t room_id) {
+    return room_id < state_.rooms.size() ? state_.rooms[room_id].get() : nullptr;
+}
+
+// The directory is authoritative for existence; the owner materialises its
+// side of the room on first use.
+Room& ChatServer::materialize_room(uint32_t room_id) {
+    if (Room* room = find_room(room_id)) return *room;
+    if (room_id >= state_.rooms.size()) state_.rooms.resize(room_id + 1);
+    Room& room = *(state_.rooms[room_id] = std::make_unique<Room>(group_.directory().name_of(room_id), room_id));
+
+    // Each room's arena is charged against the global history budget up front.
+    const HistoryLimits& limits = config_.history;
+    if (limits.messages > 0 && limits.room_bytes > 0) {
+        if (group_.history_budget().reserve(limits.room_bytes)) {
+            room.history = std::make_unique<HistoryRing>(limits.messages, limits.room_bytes);
         } else {
-            member_list = "[Error]: You are not in a room.\n";
+            log_warn() << "History budget exhausted; room '" << room.name << "' keeps no history.";
+        }
+    }
+    return room;
+}
+
+// Copies the member list into a new snapshot and swaps it in. Shards that
+// are still reading the old one keep it alive until they are done.
+void ChatServer::publish_members(Room& room) {
+    auto list = std::make_shared<MemberList>();
+    list->room = room.id;
+    list->by_shard.resize(group_.size());
+    for (const ClientRef& member : room.members) list->by_shard[member.shard].push_back(member);
+    for (const WireFormat& format : room.member_formats) {
+        if (format.deflate) list->deflate[static_cast<size_t>(format.protocol)] = true;
+    }
+
+    group_.directory().members.publish(room.id, list.get());
+    group_.epochs().retire(shard_id_, std::exchange(room.published, std::move(list)));
+}
+
+void ChatServer::on_join_room(JoinRoom& msg) {
+    Room& room = materialize_room(msg.room);
+    if (room.hasMember(msg.client)) return;
+    room.addMember(msg.client, msg.name, msg.format);
+    publish_members(room);
+    group_.directory().add_members(room.id, +1);
+    if (ClusterNode* cluster = group_.cluster()) cluster->post(ClusterMemberJoined{room.id, msg.name});
+
+    std::string text = msg.name + " has joined the room.";
+    broadcast_to_room(room.id, encode_both([&](Protocol p) { return encode_notice(p, room.id, text); }), -1);
+    reply(msg.client, encode_both([&](Protocol p) { return encode_joined(p, room.id, room.name); }));
+    if (config_.history.replay_on_join > 0 && room.history && room.history->count() > 0) {
+        send_history(room, msg.client, msg.format.protocol, config_.history.replay_on_join);
+    }
+}
+
+void ChatServer::on_leave_room(LeaveRoom& msg) {
+    Room* room = find_room(msg.room);
+    if (!room || !room->hasMember(msg.client)) return;
+    room->removeMember(msg.client);
+    publish_members(*room);
+    group_.directory().add_members(room->id, -1);
+    if (ClusterNode* cluster = group_.cluster()) cluster->post(ClusterMemberLeft{room->id, msg.name});
+    if (msg.confirm) reply(msg.client, encode_both([&](Protocol p) { return encode_left(p, room->id, room->name); }));
+
+    std::string text = msg.name + " has left the room.";
+    broadcast_to_room(room->id, encode_both([&](Protocol p) { return encode_notice(p, room->id, text); }), -1);
+}
+
+void ChatServer::on_list_members(ListMembers& msg) {
+    Room& room = materialize_room(msg.room);
+    std::vector<std::string_view> names(room.member_names.begin(), room.member_names.end());
+    std::vector<std::string> remote = group_.directory().remote_names(room.id); // on other cluster nodes
+    names.insert(names.end(), remote.begin(), remote.end());
+    reply(msg.client, encode_both([&](Protocol p) { return encode_member_list(p, room.id, room.name, names); }));
+}
+
+// Only called during recovery, before the shard's thread starts.
+void ChatServer::restore_history(uint32_t room_id, const Payload& payload) {
+    Room& room = materialize_room(room_id);
+    if (room.history) room.history->append(payload);
+}
+
+void ChatServer::on_append_history(AppendHistory& msg) {
+    Room* room = find_room(msg.room);
+    if (room && room->history) room->history->append(msg.payload);
+}
+
+void ChatServer::on_history_request(HistoryRequest& msg) {
+    send_history(materialize_room(msg.room), msg.client, msg.protocol, msg.count);
+}
+
+// Replies with the last `count` messages as one buffer, encoded only for the
+// protocol the client speaks.
+void ChatServer::send_history(const Room& room, const ClientRef& client, Protocol protocol, size_t count) {
+    static const HistoryRing empty(0, 0);
+    const HistoryRing& history = room.history ? *room.history : empty;
+    Payload payload;
+    (protocol == Protocol::Binary ? payload.binary : payload.text) =
+        encode_history(protocol, room.id, room.name, history, count);
+    reply(client, std::move(payload));
+}
+
+void ChatServer::on_deliver(Deliver& msg) {
+    ScopedTimer timer(metrics_, Timer::Deliver);
+    for (const ClientRef& target : msg.targets) {
+        if (find_connection(target)) send_to_client(target.fd, msg.payload);
+    }
+    if (msg.members) deliver(msg.members->by_shard[shard_id_], msg.payload, -1);
+}
+
+void ChatServer::on_cluster_deliver(ClusterDeliver& msg) {
+    if (msg.record) {
+        Room& room = materialize_room(msg.room);
+        if (room.history) room.history->append(msg.payload);
+    }
+    broadcast_to_room(msg.room, std::move(msg.payload), -1);
+}
+
+void ChatServer::on_quiesce(Quiesce&) { stopping_ = true; }
+
+// --- Hot Upgrade ---
+
+bool ChatServer::settle() {
+    now_ms_ = monotonic_ms();
+    bool handled = drain_inbox();
+    finish_tick();
+    return handled;
+}
+
+// Records this shard's listener and connections, and in `index` where each
+// connection went, for save_room() on the rooms' owners.
+void ChatServer::save_clients(UpgradeSnapshot& snapshot, std::vector<int>& fds,
+                              std::unordered_map<uint64_t, uint32_t>& index) {
+    snapshot.listeners.push_back(static_cast<uint32_t>(fds.size()));
+    fds.push_back(listener_.get());
+    for (uint32_t fd = 0; fd < connections_.size(); ++fd) {
+        const Connection* conn = connections_.get(fd);
+        if (!conn || conn->closing) continue;
+        UpgradeClient client;
+        client.shard = shard_id_;
+        client.socket = static_cast<uint32_t>(fds.size());
+        client.pending = conn->pending;
+        client.name = conn->info.name;
+        auto color = std::find(COLORS.begin(), COLORS.end(), conn->info.color);
+        client.color = static_cast<uint8_t>(color == COLORS.end() ? 0 : color - COLORS.begin());
+        std::memcpy(client.session.data(), conn->info.session, client.session.size());
+        client.room = conn->room;
+        client.protocol = conn->protocol;
+        client.deflate = conn->deflate;
+        client.admin = conn->admin;
+        client.accepted_at = conn->accepted_at;
+        client.last_active = conn->last_active;
+        client.last_ping = conn->last_ping;
+        if (!conn->in.empty()) {
+            std::string scratch;
+            client.input = std::string(conn->in.view(0, conn->in.size(), scratch));
+        }
+        client.output = conn->out.unsent();
+
+        index[client_ref(static_cast<int>(fd)).key()] = static_cast<uint32_t>(snapshot.clients.size());
+        fds.push_back(static_cast<int>(fd));
+        snapshot.clients.push_back(std::move(client));
+    }
+}
+
+// Fills in the members and history of a room this shard owns.
+void ChatServer::save_room(UpgradeRoom& saved, const std::unordered_map<uint64_t, uint32_t>& index) {
+    const Room* room = find_room(saved.id);
+    if (!room) return;
+    for (const ClientRef& member : room->members) {
+        auto it = index.find(member.key());
+        if (it != index.end()) saved.members.push_back(it->second);
+    }
+    if (!room->history) return;
+    for (size_t i = 0; i < room->history->count(); ++i) {
+        saved.history.emplace_back(room->history->message(i, Protocol::Text),
+                                   room->history->message(i, Protocol::Binary));
+    }
+}
+
+// Takes over a connection from the process being replaced. It is in the
+// same state as it was there; reading resumes on the first tick, starting
+// with any input that was already read. Returns an empty ClientRef (fd -1)
+// if the socket cannot be registered.
+ClientRef ChatServer::adopt(Socket sock, const UpgradeClient& client) {
+    int fd = std::exchange(sock.fd, -1);
+    Connection& conn = connections_.emplace(fd, fd, config_.max_line);
+    conn.pending = client.pending;
+    conn.info.name = client.name;
+    conn.info.color = COLORS[client.color % COLORS.size()];
+    std::memcpy(conn.info.session, client.session.data(), client.session.size());
+    conn.room = client.room;
+    conn.protocol = client.protocol;
+    conn.deflate = client.deflate;
+    conn.admin = client.admin;
+    conn.accepted_at = client.accepted_at;
+    conn.last_active = client.last_active;
+    conn.last_ping = client.last_ping;
+    conn.in.write(client.input);
+
+    bool registered = reactor_->completes_io() ? reactor_->receive(fd) : reactor_->add(fd);
+    if (!registered) {
+        connections_.erase(fd);
+        return {};
+    }
+    if (!client.output.empty()) enqueue(conn, fd, MessageRef::make(client.output));
+    arm_timer(conn);
+    resumed_fds_.push_back(fd);
+    return client_ref(fd);
+}
+
+// Rebuilds a room, with its members in their original order.
+void ChatServer::restore_room(const UpgradeRoom& saved, const std::vector<ClientRef>& clients,
+                              const std::vector<UpgradeClient>& records) {
+    Room& room = materialize_room(saved.id);
+    for (uint32_t i : saved.members) {
+        if (clients[i].fd < 0 || room.hasMember(clients[i])) continue;
+        room.addMember(clients[i], records[i].name, {records[i].protocol, records[i].deflate});
+    }
+    if (!room.members.empty()) {
+        publish_members(room);
+        group_.directory().add_members(room.id, static_cast<long>(room.members.size()));
+    }
+    if (room.history) {
+        for (const auto& [text, binary] : saved.history) {
+            room.history->append({MessageRef::make(text), MessageRef::make(binary)});
+        }
+    }
+}
+
+// --- RoomDirectory ---
+
+std::optional<uint32_t> RoomDirectory::try_create(std::string_view name) {
+    std::lock_guard<std::mutex> lk(mtx);
+    if (ids.contains(name)) return std::nullopt;
+    return create_locked(name);
+}
+
+// For rooms named by other cluster nodes, which exist there already.
+uint32_t RoomDirectory::find_or_create(std::string_view name, bool* created) {
+    std::lock_guard<std::mutex> lk(mtx);
+    auto it = ids.find(name);
+    *created = it == ids.end();
+    return *created ? create_locked(name) : it->second;
+}
+
+uint32_t RoomDirectory::create_locked(std::string_view name) {
+    uint32_t id = static_cast<uint32_t>(entries.size() + 1);
+    auto it = ids.emplace(std::string(name), id).first;
+    entries.push_back({it->first, 0, {}});
+    members.reserve(id);
+    flood.reserve(id);
+    remote_nodes.reserve(id);
+    return id;
+}
+
+std::optional<uint32_t> RoomDirectory::find(std::string_view name) {
+    std::lock_guard<std::mutex> lk(mtx);
+    auto it = ids.find(name);
+    if (it == ids.end()) return std::nullopt;
+    return it->second;
+}
+
+// Re-registers a room read back from the log under its original id.
+void RoomDirectory::restore(uint32_t id, std::string_view name) {
+    std::lock_guard<std::mutex> lk(mtx);
+    if (id == 0 || ids.contains(name)) return;
+    if (id > entries.size()) entries.resize(id, {"", 0, {}});
+    entries[id - 1] = {std::string(name), 0, {}};
+    ids.emplace(std::string(name), id);
+    members.reserve(id);
+    flood.reserve(id);
+    remote_nodes.reserve(id);
+}
+
+std::string RoomDirectory::name_of(uint32_t id) {
+    std::lock_guard<std::mutex> lk(mtx);
+    return id >= 1 && id <= entries.size() ? entries[id - 1].name : std::string();
+}
+
+void RoomDirectory::add_members(uint32_t id, long delta) {
+    std::lock_guard<std::mutex> lk(mtx);
+    if (id >= 1 && id <= entries.size()) entries[id - 1].members += delta;
+}
+
+std::vector<RoomSummary> RoomDirectory::summaries() {
+    std::lock_guard<std::mutex> lk(mtx);
+    std::vector<RoomSummary> out;
+    out.reserve(ids.size());
+    for (const auto& [name, id] : ids) {
+        const Entry& entry = entries[id - 1];
+        out.push_back({name, id, entry.members + entry.remote.size()});
+    }
+    return out;
+}
+
+bool RoomDirectory::add_remote(uint32_t id, uint32_t node, std::string_view name) {
+    std::lock_guard<std::mutex> lk(mtx);
+    if (id < 1 || id > entries.size()) return false;
+    auto& remote = entries[id - 1].remote;
+    auto same = [&](const RemoteMember& m) { return m.node == node && m.name == name; };
+    if (std::any_of(remote.begin(), remote.end(), same)) return false;
+    remote.push_back({node, std::string(name)});
+    update_remote_nodes(id);
+    return true;
+}
+
+// Removes one member of that name on that node; false if there was none.
+bool RoomDirectory::remove_remote(uint32_t id, uint32_t node, std::string_view name) {
+    std::lock_guard<std::mutex> lk(mtx);
+    if (id < 1 || id > entries.size()) return false;
+    auto& remote = entries[id - 1].remote;
+    auto it = std::find_if(remote.begin(), remote.end(),
+                           [&](const RemoteMember& m) { return m.node == node && m.name == name; });
+    if (it == remote.end()) return false;
+    *it = std::move(remote.back());
+    remote.pop_back();
+    update_remote_nodes(id);
+    return true;
+}
+
+std::vector<std::pair<uint32_t, size_t>> RoomDirectory::remove_node(uint32_t node) {
+    std::lock_guard<std::mutex> lk(mtx);
+    std::vector<std::pair<uint32_t, size_t>> removed;
+    for (uint32_t id = 1; id <= entries.size(); ++id) {
+        if (!(remote_nodes_of(id) & (uint64_t{1} << node))) continue;
+        auto& remote = entries[id - 1].remote;
+        auto gone = std::stable_partition(remote.begin(), remote.end(),
+                                          [&](const RemoteMember& m) { return m.node != node; });
+        removed.emplace_back(id, static_cast<size_t>(remote.end() - gone));
+        remote.erase(gone, remote.end());
+        update_remote_nodes(id);
+    }
+    return removed;
+}
+
+std::vector<std::string> RoomDirectory::remote_names(uint32_t id) {
+    std::lock_guard<std::mutex> lk(mtx);
+    std::vector<std::string> names;
+    if (id < 1 || id > entries.size()) return names;
+    for (const RemoteMember& member : entries[id - 1].remote) names.push_back(member.name);
+    return names;
+}
+
+void RoomDirectory::update_remote_nodes(uint32_t id) {
+    uint64_t mask = 0;
+    for (const RemoteMember& member : entries[id - 1].remote) mask |= uint64_t{1} << member.node;
+    remote_nodes.find(id)->store(mask, std::memory_order_release);
+}
+
+// --- UserDirectory ---
+
+static bool same_client(const ClientRef& a, const ClientRef& b) {
+    return a.key() == b.key() && a.generation == b.generation;
+}
+
+bool UserDirectory::claim(std::string_view name, const ClientRef& client) {
+    std::lock_guard lock(mtx);
+    auto [it, inserted] = by_name.try_emplace(std::string(name), client);
+    if (inserted) sorted.insert(it->first);
+    return inserted;
+}
+
+void UserDirectory::release(std::string_view name, const ClientRef& client) {
+    std::lock_guard lock(mtx);
+    auto it = by_name.find(name);
+    if (it == by_name.end() || !same_client(it->second, client)) return;
+    sorted.erase(it->first);
+    by_name.erase(it);
+}
+
+std::optional<ClientRef> UserDirectory::find(std::string_view name) {
+    std::lock_guard lock(mtx);
+    auto it = by_name.find(name);
+    if (it == by_name.end()) return std::nullopt;
+    return it->second;
+}
+
+std::vector<std::string> UserDirectory::with_prefix(std::string_view prefix, size_t limit, bool& truncated) {
+    std::vector<std::string> names;
+    std::lock_guard lock(mtx);
+    truncated = false;
+    for (auto it = sorted.lower_bound(prefix); it != sorted.end() && it->starts_with(prefix); ++it) {
+        if (names.size() == limit) {
+            truncated = true;
+            break;
+        }
+        names.emplace_back(*it);
+    }
+    return names;
+}
+
+// --- ShardGroup ---
+
+static unsigned shard_count(const ServerConfig& config) {
+    return config.threads ? config.threads : std::max(1u, std::thread::hardware_concurrency());
+}
+
+ShardGroup::ShardGroup(const ServerConfig& config)
+    : config_(config), epochs_(shard_count(config)), history_budget_(config.history.total_bytes),
+      metrics_(shard_count(config)) {
+    // A frame of exactly --max-line bytes must be accepted, not fill the
+    // ring and get its sender dropped.
+    if (RecvRing(Connection::ring_bytes(config.max_line)).capacity() < varint_size(config.max_line) + config.max_line) {
+        throw std::logic_error("Receive ring too small for a frame of --max-line bytes.");
+    }
+
+    // Started by a hot upgrade: take the old process's sockets and state.
+    UpgradeSnapshot snapshot;
+    std::vector<Socket> inherited;
+    Socket channel(config.upgrade.fd);
+    if (channel) {
+        std::string bytes;
+        if (!take_over(channel.get(), bytes, inherited) || !decode_snapshot(bytes, inherited.size(), snapshot)) {
+            throw std::runtime_error("Hot upgrade: failed to receive the old process's state.");
         }
     }
-    send_all(client_fd, member_list);
+
+    // The scrape endpoint only listens on loopback.
+    if (snapshot.metrics_listener) {
+        metrics_listener_ = std::move(inherited[*snapshot.metrics_listener]);
+    } else if (!config.metrics_port.empty()) {
+        metrics_listener_ = get_listener_socket(config.metrics_port.c_str(), false, "127.0.0.1");
+        if (!metrics_listener_) throw std::runtime_error("Failed to initialize metrics listener socket.");
+    }
+    if (config.fanout.workers > 0) fanout_ = std::make_unique<FanoutPool>(config.fanout.workers);
+    unsigned threads = shard_count(config);
+    ServerConfig shard_config = config;
+    shard_config.threads = threads;
+    for (uint32_t id = 0; id < threads; ++id) {
+        Socket listener;
+        if (id < snapshot.listeners.size()) listener = std::move(inherited[snapshot.listeners[id]]);
+        shards_.push_back(std::make_unique<ChatServer>(shard_config, *this, id, std::move(listener)));
+    }
+    // History comes with the snapshot, which is newer than the log.
+    if (!config.wal.dir.empty()) recover(config, !channel);
+    if (channel) {
+        resume(snapshot, inherited);
+        report_resumed(channel.get());
+    }
+    if (!config.cluster.port.empty()) cluster_ = std::make_unique<ClusterNode>(config.cluster, config.max_line, *this);
 }
 
-void ChatServer::broadcast_to_room(const std::string& room_name, std::string_view msg, int sender_fd_to_skip) {
-    std::lock_guard<std::mutex> lock(state_.mtx);
-    if (state_.rooms.count(room_name)) {
-        const auto& room = state_.rooms.at(room_name);
-        for (int member_fd : room.members) {
-            send_all(member_fd, msg);
+// Rebuilds rooms and, unless `history` is false, recent history from the
+// log before any shard runs.
+void ShardGroup::recover(const ServerConfig& config, bool history) {
+    auto start = std::chrono::steady_clock::now();
+    wal_ = std::make_unique<WriteAheadLog>(config.wal, metrics_.wal());
+    size_t rooms = 0, messages = 0;
+    wal_->recover(
+        config.history,
+        [&](uint32_t id, std::string_view name) {
+            directory_.restore(id, name);
+            ++rooms;
+        },
+        [&](uint32_t room, const Payload& payload) {
+            if (!history) return;
+            shards_[owner_of(room)]->restore_history(room, payload);
+            ++messages;
+        });
+    wal_->start();
+
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    log_info() << "Recovered " << rooms << " rooms and " << messages << " messages from " << config.wal.dir
+               << " in " << ms.count() << " ms.";
+}
+
+void ShardGroup::run() {
+    if (metrics_listener_) {
+        std::thread([this] { serve_metrics(metrics_listener_.get(), metrics_); }).detach();
+    }
+    if (cluster_) cluster_->start();
+    while (true) {
+        run_shards();
+        if (!upgrading_.load()) return;
+        if (hand_off()) return; // the new process has taken over
+        log_error() << "Hot upgrade failed; resuming service.";
+        stop_successor(successor_);
+        upgrade_channel_ = Socket{};
+        upgrading_.store(false);
+    }
+}
+
+void ShardGroup::run_shards() {
+    std::vector<std::thread> threads;
+    for (size_t id = 1; id < shards_.size(); ++id) {
+        threads.emplace_back([this, id] { shards_[id]->run(); });
+    }
+    shards_[0]->run();
+    for (auto& t : threads) t.join();
+}
+
+// Starts the successor, then, once it is ready, stops the shards; run()
+// does the rest. Shards keep serving while the new binary starts up.
+void ShardGroup::upgrade() {
+    if (cluster_) {
+        log_warn() << "Hot upgrade is not supported in a cluster.";
+        return;
+    }
+    if (config_.backend == ReactorBackend::IoUring) {
+        log_warn() << "Hot upgrade needs the epoll or poll backend.";
+        return;
+    }
+    if (upgrading_.load()) {
+        log_warn() << "A hot upgrade is already in progress.";
+        return;
+    }
+    log_info() << "Hot upgrade: starting " << config_.upgrade.command.front() << ".";
+    pid_t child;
+    Socket channel = spawn_successor(config_.upgrade.command, child);
+    if (!channel) return;
+    upgrade_channel_ = std::move(channel);
+    successor_ = child;
+    upgrading_.store(true);
+    for (auto& shard : shards_) shard->post(Quiesce{});
+}
+
+// Runs on the main thread once every shard has stopped. True once the new
+// process has resumed; otherwise this process can carry on.
+bool ShardGroup::hand_off() {
+    // Shards may have sent each other messages as they stopped.
+    for (bool busy = true; busy;) {
+        busy = false;
+        for (auto& shard : shards_) busy |= shard->settle();
+    }
+    // The writer finishes what is queued; the new process reopens the log.
+    wal_.reset();
+
+    UpgradeSnapshot snapshot;
+    std::vector<int> fds;
+    std::unordered_map<uint64_t, uint32_t> index; // ClientRef::key() -> position in snapshot.clients
+    for (auto& shard : shards_) shard->save_clients(snapshot, fds, index);
+    if (metrics_listener_) {
+        snapshot.metrics_listener = static_cast<uint32_t>(fds.size());
+        fds.push_back(metrics_listener_.get());
+    }
+    for (const RoomSummary& summary : directory_.summaries()) {
+        UpgradeRoom room{summary.id, summary.name};
+        shards_[owner_of(room.id)]->save_room(room, index);
+        snapshot.rooms.push_back(std::move(room));
+    }
+    std::string bytes = encode_snapshot(snapshot);
+    log_info() << "Hot upgrade: handing over " << snapshot.clients.size() << " connections and "
+               << snapshot.rooms.size() << " rooms (" << bytes.size() << " bytes).";
+    if (hand_over(upgrade_channel_.get(), bytes, fds)) {
+        log_info() << "Hot upgrade complete; exiting.";
+        return true;
+    }
+
+    if (!config_.wal.dir.empty()) {
+        wal_ = std::make_unique<WriteAheadLog>(config_.wal, metrics_.wal());
+        wal_->recover(config_.history, [](uint32_t, std::string_view) {}, [](uint32_t, const Payload&) {});
+        wal_->start();
+    }
+    return false;
+}
+
+// Rebuilds the old process's connections and rooms before any shard runs.
+// A connection stays on the shard it was on, if there are as many now.
+void ShardGroup::resume(const UpgradeSnapshot& snapshot, std::vector<Socket>& inherited) {
+    std::vector<ClientRef> clients;
+    clients.reserve(snapshot.clients.size());
+    for (const UpgradeClient& client : snapshot.clients) {
+        ChatServer& shard = *shards_[client.shard % shards_.size()];
+        clients.push_back(shard.adopt(std::move(inherited[client.socket]), client));
+        if (!client.pending && clients.back().fd >= 0) users_.claim(client.name, clients.back());
+    }
+    for (const UpgradeRoom& room : snapshot.rooms) {
+        directory_.restore(room.id, room.name);
+        shards_[owner_of(room.id)]->restore_room(room, clients, snapshot.clients);
+    }
+    log_info() << "Hot upgrade: resumed " << clients.size() << " connections and " << snapshot.rooms.size()
+               << " rooms.";
+}
+
+// Room ids are handed out sequentially, so this spreads rooms evenly.
+uint32_t ShardGroup::owner_of(uint32_t room_id) const {
+    return static_cast<uint32_t>(room_id % shards_.size());
+}
+
+static void print_usage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [options]\n"
+              << "  --port=N                 listen port (default " << PORT << ")\n"
+              << "  --backend=NAME           event backend: epoll, poll or io_uring\n"
+              << "  --threads=N              event-loop threads, 0 = one per core (default 1)\n"
+              << "  --outbuf-high=BYTES      per-client output queue high watermark\n"
+              << "  --outbuf-low=BYTES       low watermark at which paused reads resume\n"
+              << "  --slow-consumer=POLICY   drop-oldest | disconnect | pause-reads\n"
+              << "  --tcp-nodelay=on|off     disable Nagle's algorithm on client sockets (default on)\n"
+              << "  --tcp-cork=on|off        hold partial segments until each flush completes (default off)\n"
+              << "  --sndbuf=BYTES           socket send buffer size, 0 = kernel default\n"
+              << "  --rcvbuf=BYTES           socket receive buffer size, 0 = kernel default\n"
+              << "  --fanout-workers=N       threads that help fan out to very large rooms (default 0)\n"
+              << "  --fanout-threshold=N     members on one shard above which fan-out is split (default 4096)\n"
+              << "  --flush-delay=MS         hold output up to MS ms to coalesce it, 0 = flush every tick\n"
+              << "  --max-line=BYTES         longest accepted input line (default 4096)\n"
+              << "  --handshake-timeout=S    close clients that send no name within S seconds (default 10)\n"
+              << "  --idle-timeout=S         close clients silent for S seconds, 0 = never (default 0)\n"
+              << "  --ping-interval=S        ping clients silent for S seconds, 0 = never (default 0)\n"
+              << "  --rate-chat=N[:BURST]    chat messages a client may send per second, 0 = unlimited\n"
+              << "  --rate-membership=N[:B]  $create, $join and $leave per client per second\n"
+              << "  --rate-query=N[:BURST]   other commands per client per second\n"
+              << "  --rate-room=N[:BURST]    chat messages per room per second, from all senders\n"
+              << "  --flood-policy=POLICY    drop | pause: what happens to input over a limit\n"
+              << "  --history-messages=N     messages kept per room, 0 = no history (default 100)\n"
+              << "  --history-bytes=BYTES    history arena per room (default 65536)\n"
+              << "  --history-total=BYTES    history memory across all rooms (default 64 MiB)\n"
+              << "  --history-replay=N       messages replayed to a client on join (default 0)\n"
+              << "  --wal-dir=PATH           keep a durable log of rooms and messages in PATH\n"
+              << "  --wal-segment-bytes=N    size of each log segment file (default 64 MiB)\n"
+              << "  --admin-token=TOKEN      lets clients that send $auth TOKEN use $stats\n"
+              << "  --metrics-port=N         serve plain-text metrics on 127.0.0.1:N\n"
+              << "  --compression=on|off     let clients negotiate compress=deflate (default on)\n"
+              << "  --node-id=N              this node's id in a cluster, 1-63\n"
+              << "  --cluster-port=N         listen for other cluster nodes on port N\n"
+              << "  --cluster-peers=LIST     other nodes, as ID@HOST:PORT,...\n"
+              << "  --log-level=LEVEL        debug | info | warn | error (default info)\n"
+              << "  --chat-log=on|off        log chat message contents (default on)\n"
+              << "  --upgrade-fd=N           (internal) take over from the process being replaced\n"
+              << "Send SIGUSR1 to log allocator statistics, SIGUSR2 to restart from the binary on disk\n"
+              << "without dropping any connection.\n";
+}
+
+// Parses --key=value options; returns false on anything unrecognised.
+static bool parse_args(int argc, char** argv, ServerConfig& config) {
+    unsigned long number;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        auto eq = arg.find('=');
+        std::string_view key = arg.substr(0, eq);
+        std::string_view value = eq == std::string_view::npos ? std::string_view{} : arg.substr(eq + 1);
+
+        if (key == "--port" && !value.empty()) {
+            config.port = std::string(value);
+        } else if (key == "--backend") {
+            if (!parse_reactor_backend(value, config.backend)) return false;
+        } else if (key == "--threads" && parse_number(value, number)) {
+            config.threads = static_cast<unsigned>(number);
+        } else if (key == "--outbuf-high" && parse_number(value, number)) {
+            config.outbound.high_watermark = number;
+        } else if (key == "--outbuf-low" && parse_number(value, number)) {
+            config.outbound.low_watermark = number;
+        } else if (key == "--tcp-nodelay" && (value == "on" || value == "off")) {
+            config.socket.nodelay = value == "on";
+        } else if (key == "--tcp-cork" && (value == "on" || value == "off")) {
+            config.socket.cork = value == "on";
+        } else if (key == "--sndbuf" && parse_number(value, number) && number <= INT_MAX) {
+            config.socket.send_buffer = static_cast<int>(number);
+        } else if (key == "--rcvbuf" && parse_number(value, number) && number <= INT_MAX) {
+            config.socket.recv_buffer = static_cast<int>(number);
+        } else if (key == "--fanout-workers" && parse_number(value, number) && number <= 1024) {
+            config.fanout.workers = static_cast<unsigned>(number);
+        } else if (key == "--fanout-threshold" && parse_number(value, number) && number > 0) {
+            config.fanout.threshold = number;
+        } else if (key == "--flush-delay" && parse_number(value, number)) {
+            config.flush_delay = number;
+        } else if (key == "--max-line" && parse_number(value, number) && number > 0) {
+            config.max_line = number;
+        } else if (key == "--handshake-timeout" && parse_number(value, number)) {
+            config.timeouts.handshake = number * 1000;
+        } else if (key == "--idle-timeout" && parse_number(value, number)) {
+            config.timeouts.idle = number * 1000;
+        } else if (key == "--ping-interval" && parse_number(value, number)) {
+            config.timeouts.ping = number * 1000;
+        } else if (key == "--rate-chat") {
+            if (!parse_rate_limit(value, config.flood.client[static_cast<size_t>(RateClass::Chat)])) return false;
+        } else if (key == "--rate-membership") {
+            if (!parse_rate_limit(value, config.flood.client[static_cast<size_t>(RateClass::Membership)])) return false;
+        } else if (key == "--rate-query") {
+            if (!parse_rate_limit(value, config.flood.client[static_cast<size_t>(RateClass::Query)])) return false;
+        } else if (key == "--rate-room") {
+            if (!parse_rate_limit(value, config.flood.room)) return false;
+        } else if (key == "--flood-policy") {
+            if (!parse_flood_policy(value, config.flood.policy)) return false;
+        } else if (key == "--history-messages" && parse_number(value, number)) {
+            config.history.messages = number;
+        } else if (key == "--history-bytes" && parse_number(value, number)) {
+            config.history.room_bytes = number;
+        } else if (key == "--history-total" && parse_number(value, number)) {
+            config.history.total_bytes = number;
+        } else if (key == "--history-replay" && parse_number(value, number)) {
+            config.history.replay_on_join = number;
+        } else if (key == "--wal-dir" && !value.empty()) {
+            config.wal.dir = std::string(value);
+        } else if (key == "--wal-segment-bytes" && parse_number(value, number) && valid_wal_segment_size(number)) {
+            config.wal.segment_bytes = number;
+        } else if (key == "--admin-token" && !value.empty()) {
+            config.admin_token = std::string(value);
+        } else if (key == "--metrics-port" && !value.empty()) {
+            config.metrics_port = std::string(value);
+        } else if (key == "--compression" && (value == "on" || value == "off")) {
+            config.compression = value == "on";
+        } else if (key == "--node-id" && parse_number(value, number) && number > 0 && number < MAX_CLUSTER_NODES) {
+            config.cluster.node_id = static_cast<uint32_t>(number);
+        } else if (key == "--cluster-port" && !value.empty()) {
+            config.cluster.port = std::string(value);
+        } else if (key == "--cluster-peers") {
+            if (!parse_cluster_peers(value, config.cluster.peers)) return false;
+        } else if (key == "--log-level") {
+            if (!parse_log_level(value, config.log.level)) return false;
+        } else if (key == "--chat-log" && (value == "on" || value == "off")) {
+            config.log.chat = value == "on";
+        } else if (key == "--upgrade-fd" && parse_number(value, number) && number <= INT_MAX) {
+            config.upgrade.fd = static_cast<int>(number);
+        } else if (key == "--slow-consumer") {
+            if (!parse_slow_consumer_policy(value, config.outbound.policy)) return false;
+        } else {
+            return false;
         }
     }
+    // A cluster node needs an id and a port to be found on.
+    if (!config.cluster.port.empty() || !config.cluster.peers.empty()) {
+        if (config.cluster.node_id == 0 || config.cluster.port.empty()) return false;
+    }
+    return config.outbound.low_watermark <= config.outbound.high_watermark;
+}
+
+static std::atomic<ShardGroup*> running_server{nullptr};
+
+// Prints allocator statistics whenever the process gets SIGUSR1, and starts
+// a hot upgrade on SIGUSR2. The signals are blocked before any shard
+// starts, so every thread inherits the mask and only this one, waiting in
+// sigwait(), ever takes them.
+static void start_signal_handler() {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+    std::thread([set] {
+        int sig;
+        while (sigwait(&set, &sig) == 0) {
+            if (sig == SIGUSR1) {
+                std::ostringstream stats;
+                write_pool_stats(stats);
+                log_info() << stats.str();
+            } else if (ShardGroup* server = running_server.load()) {
+                server->upgrade();
+            }
+        }
+    }).detach();
 }
 
-int main() {
+int main(int argc, char** argv) {
+    ServerConfig config;
+    if (!parse_args(argc, argv, config)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    // A successor is started the same way, minus the channel to this process.
+    for (int i = 0; i < argc; ++i) {
+        if (!std::string_view(argv[i]).starts_with("--upgrade-fd=")) config.upgrade.command.push_back(argv[i]);
+    }
+    start_signal_handler();
+    log_start(config.log);
     try {
-        ChatServer server(PORT);
+        ShardGroup server(config);
+        running_server.store(&server);
         server.run();
+        running_server.store(nullptr);
     } catch (const std::exception& e) {
+        log_stop();
         std::cerr << "Fatal Error: " << e.what() << std::endl;
         return 1;
     }
+    log_stop();
     return 0;
-}
\ No newline at end of file
+}
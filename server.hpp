@@ -1,77 +1,494 @@
 #include "network_utils.hpp"
+#include "reactor.hpp"
+#include "mpsc_queue.hpp"
+#include "outbound_queue.hpp"
+#include "recv_buffer.hpp"
+#include "protocol.hpp"
+#include "command_table.hpp"
+#include "slot_array.hpp"
+#include "epoch.hpp"
+#include "membership.hpp"
+#include "history.hpp"
+#include "wal.hpp"
+#include "pool.hpp"
+#include "metrics.hpp"
+#include "log.hpp"
+#include "timer_wheel.hpp"
+#include "rate_limit.hpp"
+#include "cluster.hpp"
+#include "compression.hpp"
+#include "fanout.hpp"
+#include "upgrade.hpp"
+#include <memory>
+#include <thread>
+#include <variant>
 #include <vector>
 #include <map>
 #include <mutex>
-#include <string>
 #include <set>
-#include <poll.h>
+#include <string>
+#include <unordered_map>
 #include "uuid.h"
 #include <optional>
 
 const std::vector<std::string> COLORS = {"\033[31m", "\033[32m", "\033[33m", "\033[34m", "\033[35m", "\033[36m"};
-const std::string RESET = "\033[0m";
 
+// Filled in by the handshake.
 struct ClientInfo {
     std::string name;
-    std::string color;
+    std::string_view color;
+    uuid_t session; // random 128-bit id: the client's stable external identity
 };
 
-struct ClientRegistry {
-    std::mutex mtx;
-    std::map<int, ClientInfo> clients; // fd -> info
+// How a client's output is encoded.
+struct WireFormat {
+    Protocol protocol = Protocol::Text;
+    bool deflate = false; // in compressed envelopes
 };
 
+// Rooms live on the shard that owns them; members may be on any shard.
+// Members are kept in a contiguous vector for fan-out, with names and wire
+// formats in parallel vectors so broadcasts never touch them. Removal swaps
+// the last member into the gap. Other shards see the members through
+// `published`.
 struct Room {
     std::string name;
-    std::set<int> members; // Store the unique fds of clients in the room
-    explicit Room(std::string name) : name(std::move(name)) {}
-    bool hasMember(int fd) { return members.contains(fd); }
-    void addMember(int fd) { members.insert(fd); }
-    void removeMember(int fd) { members.erase(fd); }
-
+    uint32_t id;
+    std::vector<ClientRef> members;
+    std::vector<std::string> member_names;         // parallel to members
+    std::vector<WireFormat> member_formats;        // parallel to members
+    std::unordered_map<uint64_t, uint32_t> index;  // ClientRef::key() -> position in members
+    std::shared_ptr<const MemberList> published;   // snapshot in RoomDirectory::members
+    std::unique_ptr<HistoryRing> history;          // null if disabled or over the global budget
+    Room(std::string name, uint32_t id) : name(std::move(name)), id(id) {}
+    bool hasMember(const ClientRef& ref) const { return index.contains(ref.key()); }
+    void addMember(const ClientRef& ref, std::string name, WireFormat format) {
+        index[ref.key()] = static_cast<uint32_t>(members.size());
+        members.push_back(ref);
+        member_names.push_back(std::move(name));
+        member_formats.push_back(format);
+    }
+    void removeMember(const ClientRef& ref) {
+        auto it = index.find(ref.key());
+        if (it == index.end()) return;
+        uint32_t pos = it->second;
+        index.erase(it);
+        if (pos + 1 != members.size()) {
+            members[pos] = members.back();
+            member_names[pos] = std::move(member_names.back());
+            member_formats[pos] = member_formats.back();
+            index[members[pos].key()] = pos;
+        }
+        members.pop_back();
+        member_names.pop_back();
+        member_formats.pop_back();
+    }
 };
 
+// Per-shard state. Only the shard's own thread touches it.
 struct ServerState {
+    std::vector<std::unique_ptr<Room>> rooms; // room id -> Room (rooms owned by this shard)
+};
+
+// Names, ids and sizes of every room across all shards. Rooms are created
+// here first, so existence checks and $list_rooms never need a cross-shard
+// hop. Names are interned to dense ids starting at 1 (0 means "no room"),
+// and everything past the command handlers refers to rooms by id. The mutex
+// is only taken on create/join/leave/list; the message path reads member
+// snapshots from `members` without locking.
+//
+// In a cluster the directory also holds the members other nodes have
+// reported, and per room a mask of the nodes that have any: the chat path
+// reads it without locking to decide whether a message leaves this node.
+struct RoomDirectory {
+    struct RemoteMember {
+        uint32_t node;
+        std::string name;
+    };
+    struct Entry {
+        std::string name;
+        size_t members;
+        std::vector<RemoteMember> remote; // members on other cluster nodes
+    };
+
     std::mutex mtx;
-    std::map<int, ClientInfo> clients;           // fd -> ClientInfo
-    std::map<std::string, Room> rooms;           // name -> Room
-    std::map<int, std::string> client_to_room_name; // fd -> roomName
-    std::set<int> pending_clients;
+    std::map<std::string, uint32_t, std::less<>> ids; // name -> id
+    std::vector<Entry> entries;                        // id - 1 -> entry
+    MembershipTable members;                           // id -> published member snapshot
+    SegmentedTable<SharedTokenBucket> flood;           // id -> chat rate from all senders
+    SegmentedTable<std::atomic<uint64_t>> remote_nodes; // id -> bit per node with members
+
+    std::optional<uint32_t> try_create(std::string_view name);
+    uint32_t find_or_create(std::string_view name, bool* created);
+    std::optional<uint32_t> find(std::string_view name);
+    void restore(uint32_t id, std::string_view name);
+    std::string name_of(uint32_t id);
+    void add_members(uint32_t id, long delta);
+    std::vector<RoomSummary> summaries();
+
+    // Cluster membership, as reported over the links.
+    bool add_remote(uint32_t id, uint32_t node, std::string_view name); // false if already known
+    bool remove_remote(uint32_t id, uint32_t node, std::string_view name);
+    std::vector<std::pair<uint32_t, size_t>> remove_node(uint32_t node); // (room, members removed)
+    std::vector<std::string> remote_names(uint32_t id);
+    uint64_t remote_nodes_of(uint32_t id) const {
+        auto* mask = remote_nodes.find(id);
+        return mask ? mask->load(std::memory_order_acquire) : 0;
+    }
+
+private:
+    uint32_t create_locked(std::string_view name); // mtx held; name must be new
+    void update_remote_nodes(uint32_t id);         // mtx held
 };
 
-struct Command {
-    std::string name;
-    std::vector<std::string> args;
+// Every named client across all shards, for $msg and $who. A hash index
+// answers exact lookups in O(1); a sorted set of views into its keys serves
+// prefix searches in O(log n + matches). Names are claimed at the end of
+// the handshake and released on disconnect, so no two clients on this node
+// share one. The mutex is only taken for those and for lookups, never on
+// the room message path.
+struct UserDirectory {
+    struct NameHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view name) const { return std::hash<std::string_view>{}(name); }
+    };
+
+    std::mutex mtx;
+    std::unordered_map<std::string, ClientRef, NameHash, std::equal_to<>> by_name;
+    std::set<std::string_view> sorted; // views of by_name's keys
+
+    bool claim(std::string_view name, const ClientRef& client); // false if taken
+    void release(std::string_view name, const ClientRef& client);
+    std::optional<ClientRef> find(std::string_view name);
+    // Up to `limit` names starting with `prefix`, in order; `truncated` is
+    // set if there are more.
+    std::vector<std::string> with_prefix(std::string_view prefix, size_t limit, bool& truncated);
+};
+
+// One accepted socket and the client behind it. The server keeps these in a
+// slot array indexed by fd.
+struct Connection {
+    Socket sock;
+    bool pending = true; // awaiting the name handshake
+    ClientInfo info;
+    uint32_t room = 0;   // id of the joined room, 0 if none
+    Protocol protocol = Protocol::Text;
+    bool deflate = false; // negotiated compress=deflate
+    RecvRing in;
+    LineFramer framer;
+    BinaryFramer binary_framer;
+    OutboundQueue out;
+    bool reads_paused = false; // slow-consumer backpressure
+    bool throttled = false;    // over a rate limit under --flood-policy=pause
+    bool closing = false;      // scheduled for removal at the end of the tick
+    bool dirty = false;        // has output to flush at the end of the tick
+    bool want_write = false;   // blocked on a full socket buffer
+    size_t dropped = 0;        // messages shed by the drop-oldest policy
+    bool admin = false;        // authenticated with $auth
+
+    // Handshake, idle and ping deadlines share one timer, keyed by fd.
+    // Times are monotonic milliseconds.
+    TimerNode timer;
+    uint64_t accepted_at = 0;
+    uint64_t last_active = 0; // last input from the client
+    uint64_t last_ping = 0;
+    uint64_t throttled_until = 0;
+
+    // Flood control: a bucket per rate class.
+    std::array<TokenBucket, static_cast<size_t>(RateClass::COUNT)> buckets;
+    uint64_t last_flood_notice = 0; // ms
+
+    // Completion-based backends only: input the backend has received but
+    // the framers have not taken yet, and the send the backend is working
+    // on, which must outlive it.
+    struct ReceivedChunk {
+        uint16_t buffer;
+        std::string_view bytes;
+    };
+    struct PendingSend {
+        msghdr msg{};
+        std::vector<iovec> iov;
+    };
+    std::vector<ReceivedChunk> received;
+    std::unique_ptr<PendingSend> send;
+    bool send_in_flight = false;
+    bool reap_after_send = false; // removed; erase once the send completes
+
+    // Room for the longest line and its newline, or the longest frame, its
+    // opcode byte included, and its length prefix. A smaller ring fills up
+    // before either framer can take the input, and the client is dropped.
+    static size_t ring_bytes(size_t max_line) { return max_line + 1 + BinaryFramer::MAX_HEADER; }
+
+    Connection(int fd, size_t max_line)
+        : sock(fd), in(ring_bytes(max_line)), framer(max_line), binary_framer(max_line), timer(static_cast<uint64_t>(fd)) {}
+
+    // Connections come and go with every client; they live in a slab pool.
+    static void* operator new(size_t size);
+    static void operator delete(void* p);
+
+    bool can_read() const { return !closing && !reads_paused && !throttled; }
+};
+
+// Connection deadlines, in milliseconds; 0 turns one off.
+struct TimeoutOptions {
+    uint64_t handshake = 10000; // to send a name after connecting
+    uint64_t idle = 0;          // of silence before a client is disconnected
+    uint64_t ping = 0;          // of silence before the server pings
+};
+
+struct ServerConfig {
+    std::string port = PORT;
+    ReactorBackend backend = ReactorBackend::Epoll;
+    unsigned threads = 1; // event-loop shards; 0 = one per core
+    OutboundLimits outbound;
+    SocketOptions socket;
+    uint64_t flush_delay = 0; // ms output may wait to be coalesced with later output; 0 = flush every tick
+    size_t max_line = 4096; // longest accepted input line, excluding '\n'
+    TimeoutOptions timeouts;
+    FloodLimits flood;
+    HistoryLimits history;
+    WalOptions wal;
+    std::string admin_token;  // unlocks $stats via $auth; empty = admin commands disabled
+    std::string metrics_port; // local plain-text scrape endpoint; empty = off
+    bool compression = true;  // clients may negotiate compress=deflate
+    LogOptions log;
+    ClusterOptions cluster;
+    FanoutOptions fanout;
+    UpgradeOptions upgrade;
 };
 
+// --- Cross-shard messages ---
+// Membership changes are executed by the shard that owns the room. Messages
+// are fanned out by the sender's shard from the room's published snapshot,
+// and written to clients by the shard that owns each connection.
+struct JoinRoom { uint32_t room; ClientRef client; WireFormat format; std::string name; };
+struct LeaveRoom { uint32_t room; ClientRef client; std::string name; bool confirm; };
+struct ListMembers { uint32_t room; ClientRef client; };
+struct AppendHistory { uint32_t room; Payload payload; };
+struct HistoryRequest { uint32_t room; ClientRef client; Protocol protocol; size_t count; };
+
+// Sent to every shard with members in a room: the recipients are `targets`
+// plus this shard's part of `members`.
+struct Deliver {
+    std::vector<ClientRef> targets;
+    std::shared_ptr<const MemberList> members;
+    Payload payload;
+};
+
+// A message or notice from another cluster node, for the room's owner to
+// fan out to this node's members (and record, if it is a message).
+struct ClusterDeliver { uint32_t room; Payload payload; bool record; };
+
+// A hot upgrade has begun: stop at the end of this tick.
+struct Quiesce {};
+
+using ShardMessage = std::variant<std::monostate, JoinRoom, LeaveRoom, ListMembers, AppendHistory, HistoryRequest,
+                                  Deliver, ClusterDeliver, Quiesce>;
+
+class ShardGroup;
+
 class ChatServer {
 public:
-    explicit ChatServer(const std::string& port);
+    // Listens on `listener` if it is set (one handed over by a hot upgrade),
+    // or on a new socket.
+    ChatServer(const ServerConfig& config, ShardGroup& group, uint32_t shard_id, Socket listener = Socket{});
     void run();
 
+    // Thread-safe: queue a message for this shard's event loop.
+    void post(ShardMessage msg);
+
+    // Adds a message read back from the log to a room's history.
+    void restore_history(uint32_t room_id, const Payload& payload);
+
+    // Hot upgrade, old process: once every shard has stopped, settle()
+    // handles what the others sent this one while stopping, then the save
+    // functions add this shard's part to the snapshot.
+    bool settle();
+    void save_clients(UpgradeSnapshot& snapshot, std::vector<int>& fds, std::unordered_map<uint64_t, uint32_t>& index);
+    void save_room(UpgradeRoom& saved, const std::unordered_map<uint64_t, uint32_t>& index);
+
+    // Hot upgrade, new process, before the shard's thread starts.
+    ClientRef adopt(Socket sock, const UpgradeClient& client);
+    void restore_room(const UpgradeRoom& saved, const std::vector<ClientRef>& clients,
+                      const std::vector<UpgradeClient>& records);
+
 private:
     // Core I/O handlers
     void handle_new_connection();
-    void handle_client_data(size_t client_index);
-    void remove_client(size_t client_index);
+    void add_connection(int client_fd);
+    void handle_client_data(int client_fd);
+    void handle_received(const ReactorEvent& ev);
+    void handle_sent(const ReactorEvent& ev);
+    void process_received(Connection& conn);
+    void process_input(Connection& conn);
+    void process_frames(Connection& conn);
+    void handle_handshake(int client_fd, std::string_view line);
+    void handle_line(int client_fd, std::string_view line);
+    void handle_frame(int client_fd, Opcode op, std::string_view body);
+    void remove_client(int client_fd);
+    void close_later(Connection& conn);
+    void finish_tick();
+    void resume_reads();
+    void close_pending();
+    Connection* find_connection(int fd);
+
+    // Deadlines
+    void arm_timer(Connection& conn);
+    void handle_timeout(int client_fd);
+
+    // Flood control
+    bool admit(int client_fd, RateClass rate_class);
+    bool admit_to_room(Connection& conn);
+    void throttle(Connection& conn, uint64_t until_ns);
+    void shed(Connection& conn, std::string_view notice);
+
+    // Output path: never blocks. Messages are queued by reference and
+    // flushed once per tick with one gathered write per connection.
+    void send_to_client(int client_fd, MessageRef msg);
+    void send_to_client(int client_fd, const Payload& payload);
+    void send_system(int client_fd, std::string_view text);
+    void send_error(int client_fd, std::string_view text);
+    Protocol protocol_of(int client_fd);
+    void enqueue(Connection& conn, int client_fd, MessageRef msg);
+    MessageRef deflate(const MessageRef& msg);
+    void deflate_payload(Payload& payload, const std::array<bool, 2>& wanted);
+    void flush_dirty();
+    void flush_parallel(FanoutPool& pool);
+    void flush_connection(Connection& conn);
+    void flushed(Connection& conn);
+    int wait_timeout();
+    void handle_writable(int client_fd);
+    void apply_backpressure(Connection& conn);
+    Connection* find_connection(const ClientRef& ref);
+    ClientRef client_ref(int client_fd);
+
+    // Cross-shard plumbing
+    void send_to_shard(uint32_t shard, ShardMessage msg);
+    bool drain_inbox();
+    void dispatch(ShardMessage& msg);
+    void on_join_room(JoinRoom& msg);
+    void on_leave_room(LeaveRoom& msg);
+    void on_list_members(ListMembers& msg);
+    void on_append_history(AppendHistory& msg);
+    void on_history_request(HistoryRequest& msg);
+    void on_deliver(Deliver& msg);
+    void on_cluster_deliver(ClusterDeliver& msg);
+    void on_quiesce(Quiesce& msg);
+    Room* find_room(uint32_t room_id);
+    Room& materialize_room(uint32_t room_id);
+    void publish_members(Room& room);
+    void reply(const ClientRef& client, Payload payload);
+    void send_history(const Room& room, const ClientRef& client, Protocol protocol, size_t count);
     
     // Logic dispatchers
-    std::optional<Command> parse_command(const std::string& line);
-    void handle_command(int client_fd, const Command& command);
-    void handle_chat_message(int client_fd, const std::string& msg);
+    void handle_command(int client_fd, const CommandLine& command);
+    void handle_chat_message(int client_fd, std::string_view msg);
+
+    // Text command entry points, looked up by name in COMMANDS
+    using CommandHandler = void (ChatServer::*)(int client_fd, const CommandLine& command);
+    struct Command {
+        CommandHandler handler = nullptr;
+        Timer timer = Timer::Unknown;
+        RateClass rate_class = RateClass::Query;
+    };
+    static const CommandTable<Command, 11> COMMANDS;
+    void command_create(int client_fd, const CommandLine& command);
+    void command_join(int client_fd, const CommandLine& command);
+    void command_leave(int client_fd, const CommandLine& command);
+    void command_list_rooms(int client_fd, const CommandLine& command);
+    void command_list_members(int client_fd, const CommandLine& command);
+    void command_history(int client_fd, const CommandLine& command);
+    void command_auth(int client_fd, const CommandLine& command);
+    void command_stats(int client_fd, const CommandLine& command);
+    void command_pong(int client_fd, const CommandLine& command);
+    void command_msg(int client_fd, const CommandLine& command);
+    void command_who(int client_fd, const CommandLine& command);
 
-    // Specific command handlers
-    bool handle_create_command(int client_fd, const std::vector<std::string>& args);
-    void handle_join_command(int client_fd, const std::vector<std::string>& args);
+    // Specific command handlers (shared by the text and binary protocols)
+    bool handle_create_command(int client_fd, std::string_view room_name);
+    void handle_join_command(int client_fd, std::string_view room_name);
     void handle_leave_command(int client_fd);
+    void leave_current_room(int client_fd, bool confirm = false);
     void handle_list_rooms_command(int client_fd);
     void handle_list_members_command(int client_fd);
+    void handle_history_command(int client_fd, size_t count);
+    void handle_auth_command(int client_fd, std::string_view token);
+    void handle_stats_command(int client_fd);
+    void handle_direct_message(int client_fd, std::string_view recipient, std::string_view text);
+    void handle_who_command(int client_fd, std::string_view prefix);
 
     // Messaging
-    void broadcast_to_room(const std::string& room_name, std::string_view msg, int sender_fd_to_skip);
+    void broadcast_to_room(uint32_t room_id, Payload msg, int sender_fd_to_skip);
+    void deliver(const std::vector<ClientRef>& targets, const Payload& msg, int sender_fd_to_skip);
+    void deliver_parallel(FanoutPool& pool, const std::vector<ClientRef>& targets, const Payload& msg,
+                          int sender_fd_to_skip);
 
     // Member variables
+    ServerConfig config_;
+    ShardGroup& group_;
+    uint32_t shard_id_;
+    ShardMetrics& metrics_; // this shard's; only its thread writes them
     Socket listener_;
-    std::vector<pollfd> fds_;
+    Socket wake_fd_; // eventfd signalled when the inbox becomes non-empty
+    MpscQueue<ShardMessage> inbox_;
+    std::atomic<bool> wake_pending_{false};
+    std::unique_ptr<Reactor> reactor_;
+    SlotArray<Connection> connections_; // fd -> connection
+    std::vector<int> closing_fds_;  // removed once the current tick's events are handled
+    std::vector<int> resumed_fds_;  // reads re-enabled after draining; read at end of tick
+    std::vector<int> dirty_fds_;    // connections with output queued since the last flush
+    uint64_t flush_at_ = 0;         // when dirty_fds_ must be flushed, under --flush-delay
+    uint64_t now_ms_;               // monotonic time the current tick started
+    TimerWheel timers_;             // one timer per connection
+    bool stopping_ = false;         // a Quiesce arrived; run() returns after this tick
+    std::vector<FanoutBatch> fanout_batches_; // one per FanoutPool participant, reused
     ServerState state_;
-};
\ No newline at end of file
+};
+
+// Runs one ChatServer per event-loop thread. Each shard has its own
+// SO_REUSEPORT listener, so the kernel spreads new connections across them.
+class ShardGroup {
+public:
+    explicit ShardGroup(const ServerConfig& config);
+    void run();
+
+    // Hands everything over to a new copy of the server (see upgrade.hpp).
+    // Called from the signal thread on SIGUSR2.
+    void upgrade();
+
+    size_t size() const { return shards_.size(); }
+    ChatServer& shard(uint32_t id) { return *shards_[id]; }
+    uint32_t owner_of(uint32_t room_id) const;
+    RoomDirectory& directory() { return directory_; }
+    UserDirectory& users() { return users_; }
+    EpochDomain& epochs() { return epochs_; }
+    HistoryBudget& history_budget() { return history_budget_; }
+    WriteAheadLog* wal() { return wal_.get(); } // null unless --wal-dir is set
+    ClusterNode* cluster() { return cluster_.get(); } // null unless --cluster-port is set
+    FanoutPool* fanout() { return fanout_.get(); }     // null unless --fanout-workers is set
+    Metrics& metrics() { return metrics_; }
+
+private:
+    void recover(const ServerConfig& config, bool history);
+    void run_shards();
+    bool hand_off();
+    void resume(const UpgradeSnapshot& snapshot, std::vector<Socket>& inherited);
+
+    ServerConfig config_;
+
+    RoomDirectory directory_;
+    UserDirectory users_;
+    EpochDomain epochs_; // one participant per shard
+    HistoryBudget history_budget_;
+    Metrics metrics_; // outlives the log's writer thread, which records into it
+    std::unique_ptr<WriteAheadLog> wal_;
+    Socket metrics_listener_; // set with --metrics-port
+    std::unique_ptr<FanoutPool> fanout_; // outlives the shards using it
+    std::vector<std::unique_ptr<ChatServer>> shards_;
+    std::unique_ptr<ClusterNode> cluster_;
+
+    // Set by upgrade() once the successor is ready, before the shards stop.
+    std::atomic<bool> upgrading_{false};
+    Socket upgrade_channel_;
+    pid_t successor_ = -1;
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// --- Generational Slot Array ---
+// Objects stored at caller-chosen small integer slots (the server uses the
+// socket fd, which the kernel keeps dense). Every time a slot is refilled its
+// generation is bumped, so a (slot, generation) pair held elsewhere, e.g. in
+// another shard's message queue, can tell that its object has gone even
+// after the slot has been reused.
+template <typename T>
+class SlotArray {
+public:
+    T* get(uint32_t slot) const {
+        return slot < slots_.size() ? slots_[slot].value.get() : nullptr;
+    }
+
+    // Null unless the slot still holds the object from `generation`.
+    T* get(uint32_t slot, uint32_t generation) const {
+        if (slot >= slots_.size() || slots_[slot].generation != generation) return nullptr;
+        return slots_[slot].value.get();
+    }
+
+    uint32_t generation(uint32_t slot) const { return slots_[slot].generation; }
+
+    // One past the highest slot ever filled.
+    uint32_t size() const { return static_cast<uint32_t>(slots_.size()); }
+
+    // Replaces whatever is in `slot` with a new T and starts a new generation.
+    template <typename... Args>
+    T& emplace(uint32_t slot, Args&&... args) {
+        if (slot >= slots_.size()) slots_.resize(slot + 1);
+        Slot& s = slots_[slot];
+        ++s.generation;
+        s.value = std::make_unique<T>(std::forward<Args>(args)...);
+        return *s.value;
+    }
+
+    void erase(uint32_t slot) {
+        if (slot < slots_.size()) slots_[slot].value.reset();
+    }
+
+private:
+    struct Slot {
+        uint32_t generation = 0;
+        std::unique_ptr<T> value;
+    };
+
+    std::vector<Slot> slots_;
+};
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <climits>
+#include <cstdint>
+
+// --- Hierarchical Timing Wheel ---
+// Deadlines in whole ticks (the server uses milliseconds) kept in five
+// levels of 64 slots. Level L holds timers due within the current
+// 64^(L+1)-tick block, one slot per 64^L ticks; when the clock enters a
+// slot's range its timers move down a level. Arming, re-arming and
+// cancelling are O(1) list operations on a node the owner embeds, so a
+// timer costs no allocation. The clock jumps straight to the next occupied
+// slot, so an idle wheel costs nothing however long it sleeps.
+//
+// Delays beyond the wheel's span (2^30 ticks, about 12 days in ms) are cut
+// to it.
+
+// Intrusive list link for one timer. Destroying an armed node cancels it.
+class TimerNode {
+public:
+    explicit TimerNode(uint64_t key = 0) : key(key) {}
+    ~TimerNode() { cancel(); }
+
+    TimerNode(const TimerNode&) = delete;
+    TimerNode& operator=(const TimerNode&) = delete;
+
+    bool armed() const { return next_ != nullptr; }
+    uint64_t expiry() const { return expiry_; }
+
+    void cancel() {
+        if (!next_) return;
+        prev_->next_ = next_;
+        next_->prev_ = prev_;
+        prev_ = next_ = nullptr;
+    }
+
+    uint64_t key; // the owner's; handed back on expiry
+
+private:
+    friend class TimerWheel;
+
+    // List heads point at themselves when empty.
+    void make_head() { prev_ = next_ = this; }
+    bool empty_head() const { return next_ == this; }
+    void link_before(TimerNode& head) {
+        prev_ = head.prev_;
+        next_ = &head;
+        head.prev_->next_ = this;
+        head.prev_ = this;
+    }
+
+    TimerNode* prev_ = nullptr;
+    TimerNode* next_ = nullptr;
+    uint64_t expiry_ = 0;
+};
+
+class TimerWheel {
+public:
+    static constexpr unsigned BITS = 6;
+    static constexpr unsigned LEVELS = 5;
+    static constexpr uint64_t SLOTS = uint64_t{1} << BITS;
+    static constexpr uint64_t MASK = SLOTS - 1;
+    static constexpr uint64_t NONE = UINT64_MAX;
+    // Keeps a top-level timer out of the slot the clock is in.
+    static constexpr uint64_t MAX_DELAY = (uint64_t{1} << (BITS * LEVELS)) - (uint64_t{1} << (BITS * (LEVELS - 1)));
+
+    explicit TimerWheel(uint64_t now) : now_(now) {
+        for (auto& level : slots_) {
+            for (TimerNode& head : level) head.make_head();
+        }
+    }
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    uint64_t now() const { return now_; }
+
+    // (Re)arms `node` to fire at tick `expiry`; past deadlines fire on the
+    // next advance().
+    void schedule(TimerNode& node, uint64_t expiry) {
+        node.cancel();
+        node.expiry_ = std::clamp(expiry, now_ + 1, now_ + MAX_DELAY);
+        place(node);
+    }
+
+    // Moves the clock to `now`, calling expire(node) for every timer that
+    // falls due, in deadline order. The node is disarmed first, so the
+    // callback may re-arm it or cancel other timers.
+    template <typename Expire>
+    void advance(uint64_t now, Expire&& expire) {
+        while (true) {
+            uint64_t next = next_event();
+            if (next > now) break;
+            now_ = next;
+            cascade();
+            TimerNode& head = slots_[0][now_ & MASK];
+            occupied_[0] &= ~(uint64_t{1} << (now_ & MASK));
+            while (!head.empty_head()) {
+                TimerNode& node = *head.next_;
+                node.cancel();
+                expire(node);
+            }
+        }
+        now_ = std::max(now_, now);
+    }
+
+    // Milliseconds until the next advance() has work, for a poll timeout:
+    // -1 if nothing is armed. May be early, never late.
+    int timeout(uint64_t now) {
+        uint64_t next = next_event();
+        if (next == NONE) return -1;
+        if (next <= now) return 0;
+        return static_cast<int>(std::min<uint64_t>(next - now, INT_MAX));
+    }
+
+private:
+    void place(TimerNode& node) {
+        uint64_t diff = node.expiry_ ^ now_;
+        unsigned level = diff < SLOTS ? 0 : (static_cast<unsigned>(std::bit_width(diff)) - 1) / BITS;
+        level = std::min(level, LEVELS - 1);
+        uint64_t slot = (node.expiry_ >> (BITS * level)) & MASK;
+        node.link_before(slots_[level][slot]);
+        occupied_[level] |= uint64_t{1} << slot;
+    }
+
+    // Moves down the timers of every level whose slot starts at now_,
+    // highest first so they can land in the slots emptied below.
+    void cascade() {
+        for (unsigned level = LEVELS - 1; level > 0; --level) {
+            unsigned shift = BITS * level;
+            if (now_ & ((uint64_t{1} << shift) - 1)) continue;
+            uint64_t slot = (now_ >> shift) & MASK;
+            occupied_[level] &= ~(uint64_t{1} << slot);
+            TimerNode& head = slots_[level][slot];
+            while (!head.empty_head()) {
+                TimerNode& node = *head.next_;
+                node.cancel();
+                place(node);
+            }
+        }
+    }
+
+    // The first tick after now_ at which a slot fires or cascades. Slots
+    // emptied by cancel() are only noticed here, so their bits are cleared
+    // as they are found.
+    uint64_t next_event() {
+        uint64_t best = NONE;
+        for (unsigned level = 0; level < LEVELS; ++level) {
+            unsigned shift = BITS * level;
+            uint64_t block = now_ >> shift; // slot of now_ at this level, counted from 0
+            uint64_t index = block & MASK;
+            while (uint64_t bits = occupied_[level]) {
+                uint64_t ahead = index == MASK ? 0 : bits & (~uint64_t{0} << (index + 1));
+                uint64_t slot;
+                uint64_t start;
+                if (ahead) {
+                    slot = static_cast<uint64_t>(std::countr_zero(ahead));
+                    start = (block - index + slot) << shift;
+                } else if (level == LEVELS - 1) {
+                    // Only the top level wraps; a slot behind the clock
+                    // belongs to the next turn.
+                    slot = static_cast<uint64_t>(std::countr_zero(bits));
+                    start = (block - index + SLOTS + slot) << shift;
+                } else {
+                    break;
+                }
+                if (slots_[level][slot].empty_head()) {
+                    occupied_[level] &= ~(uint64_t{1} << slot);
+                    continue;
+                }
+                best = std::min(best, start);
+                break;
+            }
+        }
+        return best;
+    }
+
+    uint64_t now_; // every timer due at or before this tick has fired
+    std::array<std::array<TimerNode, SLOTS>, LEVELS> slots_;
+    std::array<uint64_t, LEVELS> occupied_{}; // bit per slot that may be non-empty
+};
@@ -0,0 +1,332 @@
+#include "upgrade.hpp"
+#include "log.hpp"
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+constexpr std::string_view MAGIC = "CHATSNAP";
+constexpr uint64_t VERSION = 1;
+
+// Messages on the channel. SOCK_SEQPACKET keeps each one, and the
+// descriptors attached to it, separate from the next.
+constexpr char READY = 'R';   // child -> old: started, waiting for the snapshot
+constexpr char HEADER = 'H';  // old -> child: varint snapshot bytes, varint descriptors
+constexpr char CHUNK = 'C';   // old -> child: the next snapshot bytes, with the next descriptors attached
+constexpr char RESUMED = 'A'; // child -> old: serving; the old process may exit
+
+constexpr int CHILD_FD = 3;               // where the successor finds the channel
+constexpr size_t CHUNK_BYTES = 64 * 1024; // snapshot bytes per message
+constexpr size_t CHUNK_FDS = 250;         // under the kernel's SCM_MAX_FD of 253
+constexpr int READY_TIMEOUT_MS = 10000;
+constexpr int RESUME_TIMEOUT_MS = 60000;
+
+// --- Snapshot Encoding ---
+// Varints and length-prefixed strings, as in the binary protocol.
+
+void put(std::string& out, uint64_t v) { append_varint(out, v); }
+
+void put(std::string& out, std::string_view s) {
+    append_varint(out, s.size());
+    out += s;
+}
+
+struct Reader {
+    std::string_view in;
+    bool ok = true;
+
+    uint64_t number() {
+        uint64_t v = 0;
+        if (ok && !read_varint(in, v)) ok = false;
+        return v;
+    }
+    uint32_t u32() {
+        uint64_t v = number();
+        if (v > UINT32_MAX) ok = false;
+        return static_cast<uint32_t>(v);
+    }
+    bool flag() { return number() != 0; }
+    std::string str() {
+        std::string_view s;
+        if (ok && !read_str(in, s)) ok = false;
+        return std::string(s);
+    }
+};
+
+// --- Channel ---
+
+bool send_tag(int channel, char tag) {
+    return ::send(channel, &tag, 1, MSG_NOSIGNAL) == 1;
+}
+
+// Waits up to `timeout_ms` (-1 = forever) for a one-byte message.
+bool await_tag(int channel, char tag, int timeout_ms) {
+    pollfd pfd{channel, POLLIN, 0};
+    int ready;
+    do {
+        ready = ::poll(&pfd, 1, timeout_ms);
+    } while (ready < 0 && errno == EINTR);
+    if (ready <= 0) return false;
+    char got = 0;
+    return ::recv(channel, &got, 1, 0) == 1 && got == tag;
+}
+
+bool send_chunk(int channel, std::string_view data, const int* fds, size_t fd_count) {
+    char tag = CHUNK;
+    iovec iov[2] = {{&tag, 1}, {const_cast<char*>(data.data()), data.size()}};
+    msghdr msg{};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    alignas(cmsghdr) char control[CMSG_SPACE(CHUNK_FDS * sizeof(int))];
+    if (fd_count > 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(fd_count * sizeof(int));
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), fds, fd_count * sizeof(int));
+    }
+    ssize_t n;
+    do {
+        n = ::sendmsg(channel, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    return n == static_cast<ssize_t>(1 + data.size());
+}
+
+// Appends one chunk's bytes and descriptors. Received descriptors are
+// close-on-exec, like every other socket the server holds.
+bool receive_chunk(int channel, std::string& data, std::vector<Socket>& fds) {
+    std::string buf(1 + CHUNK_BYTES, '\0');
+    iovec iov{buf.data(), buf.size()};
+    alignas(cmsghdr) char control[CMSG_SPACE(CHUNK_FDS * sizeof(int))];
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+
+    ssize_t n;
+    do {
+        n = ::recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); n > 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; ++i) {
+            int fd;
+            std::memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof fd);
+            fds.emplace_back(fd);
+        }
+    }
+    if (n < 1 || buf[0] != CHUNK || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) return false;
+    data.append(buf.data() + 1, static_cast<size_t>(n) - 1);
+    return true;
+}
+
+} // namespace
+
+std::string encode_snapshot(const UpgradeSnapshot& snapshot) {
+    std::string out(MAGIC);
+    put(out, VERSION);
+
+    put(out, snapshot.listeners.size());
+    for (uint32_t listener : snapshot.listeners) put(out, listener);
+    put(out, snapshot.metrics_listener.has_value());
+    if (snapshot.metrics_listener) put(out, *snapshot.metrics_listener);
+
+    put(out, snapshot.rooms.size());
+    for (const UpgradeRoom& room : snapshot.rooms) {
+        put(out, room.id);
+        put(out, room.name);
+        put(out, room.members.size());
+        for (uint32_t member : room.members) put(out, member);
+        put(out, room.history.size());
+        for (const auto& [text, binary] : room.history) {
+            put(out, text);
+            put(out, binary);
+        }
+    }
+
+    put(out, snapshot.clients.size());
+    for (const UpgradeClient& client : snapshot.clients) {
+        put(out, client.shard);
+        put(out, client.socket);
+        put(out, client.pending);
+        put(out, client.name);
+        put(out, client.color);
+        out.append(reinterpret_cast<const char*>(client.session.data()), client.session.size());
+        put(out, client.room);
+        put(out, static_cast<uint64_t>(client.protocol));
+        put(out, client.deflate);
+        put(out, client.admin);
+        put(out, client.accepted_at);
+        put(out, client.last_active);
+        put(out, client.last_ping);
+        put(out, client.input);
+        put(out, client.output);
+    }
+    return out;
+}
+
+bool decode_snapshot(std::string_view in, size_t descriptors, UpgradeSnapshot& snapshot) {
+    if (!in.starts_with(MAGIC)) return false;
+    Reader r{in.substr(MAGIC.size())};
+    if (r.number() != VERSION) return false;
+
+    // Counts are checked against the bytes left, so a corrupt one cannot
+    // make us reserve a huge vector.
+    auto count = [&r] {
+        uint64_t n = r.number();
+        if (n > r.in.size()) r.ok = false;
+        return r.ok ? static_cast<size_t>(n) : 0;
+    };
+
+    snapshot.listeners.resize(count());
+    for (uint32_t& listener : snapshot.listeners) listener = r.u32();
+    if (r.flag()) snapshot.metrics_listener = r.u32();
+
+    snapshot.rooms.resize(count());
+    for (UpgradeRoom& room : snapshot.rooms) {
+        room.id = r.u32();
+        room.name = r.str();
+        room.members.resize(count());
+        for (uint32_t& member : room.members) member = r.u32();
+        room.history.resize(count());
+        for (auto& [text, binary] : room.history) {
+            text = r.str();
+            binary = r.str();
+        }
+    }
+
+    snapshot.clients.resize(count());
+    for (UpgradeClient& client : snapshot.clients) {
+        client.shard = r.u32();
+        client.socket = r.u32();
+        client.pending = r.flag();
+        client.name = r.str();
+        client.color = static_cast<uint8_t>(r.number());
+        if (r.ok && r.in.size() >= client.session.size()) {
+            std::memcpy(client.session.data(), r.in.data(), client.session.size());
+            r.in.remove_prefix(client.session.size());
+        } else {
+            r.ok = false;
+        }
+        client.room = r.u32();
+        client.protocol = r.number() == static_cast<uint64_t>(Protocol::Binary) ? Protocol::Binary : Protocol::Text;
+        client.deflate = r.flag();
+        client.admin = r.flag();
+        client.accepted_at = r.number();
+        client.last_active = r.number();
+        client.last_ping = r.number();
+        client.input = r.str();
+        client.output = r.str();
+    }
+    if (!r.ok || !r.in.empty()) return false;
+
+    auto fits = [](uint64_t index, size_t size) { return index < size; };
+    bool valid = std::all_of(snapshot.listeners.begin(), snapshot.listeners.end(),
+                             [&](uint32_t i) { return fits(i, descriptors); }) &&
+                 (!snapshot.metrics_listener || fits(*snapshot.metrics_listener, descriptors));
+    for (const UpgradeRoom& room : snapshot.rooms) {
+        for (uint32_t member : room.members) valid = valid && fits(member, snapshot.clients.size());
+    }
+    for (const UpgradeClient& client : snapshot.clients) valid = valid && fits(client.socket, descriptors);
+    return valid;
+}
+
+Socket spawn_successor(const std::vector<std::string>& command, pid_t& child) {
+    int pair[2];
+    if (command.empty() || ::socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) < 0) {
+        log_error() << "Hot upgrade: socketpair: " << errno_text(errno);
+        return Socket{};
+    }
+    Socket ours(pair[0]), theirs(pair[1]);
+
+    // Built before fork(): the child may only make async-signal-safe calls.
+    std::vector<std::string> args = command;
+    args.push_back("--upgrade-fd=" + std::to_string(CHILD_FD));
+    std::vector<char*> argv;
+    for (std::string& arg : args) argv.push_back(arg.data());
+    argv.push_back(nullptr);
+
+    child = ::fork();
+    if (child < 0) {
+        log_error() << "Hot upgrade: fork: " << errno_text(errno);
+        return Socket{};
+    }
+    if (child == 0) {
+        // Nothing but the channel (and stdio) survives into the new binary.
+        if (theirs.get() == CHILD_FD) {
+            ::fcntl(CHILD_FD, F_SETFD, 0);
+        } else if (::dup2(theirs.get(), CHILD_FD) < 0) {
+            ::_exit(127);
+        }
+        ::close_range(CHILD_FD + 1, ~0u, 0);
+        ::execvp(argv[0], argv.data());
+        ::_exit(127);
+    }
+
+    theirs = Socket{};
+    if (!await_tag(ours.get(), READY, READY_TIMEOUT_MS)) {
+        log_error() << "Hot upgrade: " << args[0] << " did not start.";
+        stop_successor(child);
+        return Socket{};
+    }
+    return ours;
+}
+
+bool hand_over(int channel, std::string_view snapshot, const std::vector<int>& fds) {
+    std::string header(1, HEADER);
+    put(header, snapshot.size());
+    put(header, fds.size());
+    if (::send(channel, header.data(), header.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(header.size())) {
+        return false;
+    }
+    size_t sent_bytes = 0, sent_fds = 0;
+    while (sent_bytes < snapshot.size() || sent_fds < fds.size()) {
+        size_t bytes = std::min(CHUNK_BYTES, snapshot.size() - sent_bytes);
+        size_t fd_count = std::min(CHUNK_FDS, fds.size() - sent_fds);
+        if (!send_chunk(channel, snapshot.substr(sent_bytes, bytes), fds.data() + sent_fds, fd_count)) return false;
+        sent_bytes += bytes;
+        sent_fds += fd_count;
+    }
+    return await_tag(channel, RESUMED, RESUME_TIMEOUT_MS);
+}
+
+bool take_over(int channel, std::string& snapshot, std::vector<Socket>& fds) {
+    if (!send_tag(channel, READY)) return false;
+
+    // The old process stops its shards before sending; that takes as long
+    // as it takes.
+    char header[32];
+    ssize_t n;
+    do {
+        n = ::recv(channel, header, sizeof header, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n < 1 || header[0] != HEADER) return false;
+    std::string_view rest(header + 1, static_cast<size_t>(n) - 1);
+    uint64_t bytes, fd_count;
+    if (!read_varint(rest, bytes) || !read_varint(rest, fd_count)) return false;
+
+    snapshot.reserve(bytes);
+    fds.reserve(fd_count);
+    while (snapshot.size() < bytes || fds.size() < fd_count) {
+        if (!receive_chunk(channel, snapshot, fds)) return false;
+    }
+    return snapshot.size() == bytes && fds.size() == fd_count;
+}
+
+bool report_resumed(int channel) { return send_tag(channel, RESUMED); }
+
+void stop_successor(pid_t child) {
+    ::kill(child, SIGKILL);
+    while (::waitpid(child, nullptr, 0) < 0 && errno == EINTR) {}
+}
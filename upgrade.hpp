@@ -0,0 +1,94 @@
+#pragma once
+
+#include "network_utils.hpp"
+#include "protocol.hpp"
+#include <sys/types.h>
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// --- Hot Upgrade ---
+// On SIGUSR2 the server starts a fresh copy of itself, from the binary now
+// at argv[0], and hands its clients over without closing a socket:
+//
+//   1. The old process forks and execs the new one with --upgrade-fd, the
+//      child's end of a SOCK_SEQPACKET socketpair, and keeps serving until
+//      the child reports Ready.
+//   2. The old process stops every shard and lets the messages they still
+//      had in flight settle. It then stops the WAL writer, serializes its
+//      state into a snapshot and sends it with every listener and client
+//      socket attached (SCM_RIGHTS).
+//   3. The new process rebuilds its shards from the snapshot, on the same
+//      listeners, and reports Resumed. The old process then exits. Its
+//      copies of the sockets close without a FIN, since the new process
+//      still holds them.
+//
+// If the child never reports Ready or Resumed, the old process kills it and
+// carries on as before. Clients only see a pause of one snapshot round trip.
+//
+// The snapshot holds every connection, pending ones included, with the
+// input it has read but not handled and the output it has queued but not
+// written, and every room with its members (in join order) and history.
+// Rate-limit buckets and counters start afresh in the new process.
+
+struct UpgradeOptions {
+    std::vector<std::string> command; // how to start the successor: this process's argv
+    int fd = -1;                      // --upgrade-fd: channel from the process being replaced
+};
+
+struct UpgradeClient {
+    uint32_t shard = 0;  // in the old process
+    uint32_t socket = 0; // index into the handed-over descriptors
+    bool pending = true;
+    std::string name;
+    uint8_t color = 0; // index into COLORS
+    std::array<unsigned char, 16> session{};
+    uint32_t room = 0;
+    Protocol protocol = Protocol::Text;
+    bool deflate = false;
+    bool admin = false;
+    uint64_t accepted_at = 0; // monotonic ms, which both processes share
+    uint64_t last_active = 0;
+    uint64_t last_ping = 0;
+    std::string input;  // read but not yet handled
+    std::string output; // queued but not yet written
+};
+
+struct UpgradeRoom {
+    uint32_t id = 0;
+    std::string name;
+    std::vector<uint32_t> members;                         // indices into clients, in join order
+    std::vector<std::pair<std::string, std::string>> history; // text and binary encodings, oldest first
+};
+
+struct UpgradeSnapshot {
+    std::vector<uint32_t> listeners;          // per old shard: index into the descriptors
+    std::optional<uint32_t> metrics_listener; // likewise, with --metrics-port
+    std::vector<UpgradeRoom> rooms;
+    std::vector<UpgradeClient> clients;
+};
+
+std::string encode_snapshot(const UpgradeSnapshot& snapshot);
+// Also checks that every index is in range, given the descriptor count.
+bool decode_snapshot(std::string_view in, size_t descriptors, UpgradeSnapshot& snapshot);
+
+// Old process: forks and execs `command` with --upgrade-fd appended. Returns
+// its end of the channel once the child is Ready, or an empty Socket (having
+// reaped the child) if it failed to start.
+Socket spawn_successor(const std::vector<std::string>& command, pid_t& child);
+
+// Old process: sends the snapshot and descriptors, then waits for Resumed.
+bool hand_over(int channel, std::string_view snapshot, const std::vector<int>& fds);
+
+// Old process: kills and reaps a successor that failed to take over.
+void stop_successor(pid_t child);
+
+// New process: reports Ready and receives the snapshot and descriptors.
+bool take_over(int channel, std::string& snapshot, std::vector<Socket>& fds);
+
+// New process: tells the old one it may exit.
+bool report_resumed(int channel);
@@ -0,0 +1,507 @@
+#include "uring_reactor.hpp"
+#include "log.hpp"
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+inline constexpr unsigned SQ_ENTRIES = 1024;
+inline constexpr unsigned CQ_ENTRIES = 4096;    // multishot requests complete many times per submission
+inline constexpr unsigned RECV_BUFFERS = 1024;  // power of two
+inline constexpr unsigned RECV_BUFFER_SIZE = 4096;
+inline constexpr uint16_t BUFFER_GROUP = 0;
+// Input handed out per wait(). Output is only submitted between ticks, so
+// handing out a fast sender's whole backlog at once would queue far more
+// for its room in one tick than a readiness backend, which writes as it
+// reads, ever holds. Other completions, sends in particular, are never held
+// back.
+inline constexpr size_t MAX_RECEIVED_BYTES = 64 * 1024;
+
+// Ring indices are shared with the kernel; only the head/tail handoffs need
+// ordering.
+static unsigned load_acquire(unsigned* p) { return std::atomic_ref<unsigned>(*p).load(std::memory_order_acquire); }
+static void store_release(unsigned* p, unsigned v) { std::atomic_ref<unsigned>(*p).store(v, std::memory_order_release); }
+
+static int io_uring_setup(unsigned entries, io_uring_params* p) {
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void* arg, size_t size) {
+    return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, size));
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+UringReactor::UringReactor() {
+    if (!setup()) teardown();
+}
+
+bool UringReactor::setup() {
+    io_uring_params params{};
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG;
+    params.cq_entries = CQ_ENTRIES;
+    ring_fd_ = io_uring_setup(SQ_ENTRIES, &params);
+    if (ring_fd_ < 0 && errno == EINVAL) {
+        // Kernels before 5.19 reject the optional flags; nothing relies on them.
+        params = {};
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = CQ_ENTRIES;
+        ring_fd_ = io_uring_setup(SQ_ENTRIES, &params);
+    }
+    if (ring_fd_ < 0) {
+        perror("io_uring_setup");
+        ring_fd_ = -1;
+        return false;
+    }
+
+    const unsigned needed = IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG | IORING_FEAT_FAST_POLL;
+    if ((params.features & needed) != needed) {
+        std::cerr << "io_uring: kernel lacks required features\n";
+        return false;
+    }
+
+    // Map the rings. Newer kernels share one mapping for both.
+    sq_map_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_map_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) sq_map_size_ = cq_map_size_ = std::max(sq_map_size_, cq_map_size_);
+    sq_map_ = ::mmap(nullptr, sq_map_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+                     IORING_OFF_SQ_RING);
+    if (sq_map_ == MAP_FAILED) {
+        sq_map_ = nullptr;
+        perror("io_uring mmap");
+        return false;
+    }
+    cq_map_ = single ? sq_map_
+                     : ::mmap(nullptr, cq_map_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+                              IORING_OFF_CQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+                        IORING_OFF_SQES);
+    if (cq_map_ == MAP_FAILED || sqes == MAP_FAILED) {
+        if (cq_map_ == MAP_FAILED) cq_map_ = nullptr;
+        if (sqes != MAP_FAILED) sqes_ = static_cast<io_uring_sqe*>(sqes);
+        perror("io_uring mmap");
+        return false;
+    }
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+    char* sq = static_cast<char*>(sq_map_);
+    sq_khead_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_ktail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_kflags_ = reinterpret_cast<unsigned*>(sq + params.sq_off.flags);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_entries_ = params.sq_entries;
+    sq_tail_ = *sq_ktail_;
+    // SQEs are always used in ring order, so the indirection array is fixed.
+    unsigned* array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    for (unsigned i = 0; i < sq_entries_; ++i) array[i] = i;
+
+    char* cq = static_cast<char*>(cq_map_);
+    cq_khead_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_ktail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    // Multishot recv arrived in the same release as zero-copy send, which
+    // the probe can see; the flag itself cannot be probed.
+    constexpr unsigned PROBE_OPS = 256;
+    auto probe_mem = std::make_unique<char[]>(sizeof(io_uring_probe) + PROBE_OPS * sizeof(io_uring_probe_op));
+    std::memset(probe_mem.get(), 0, sizeof(io_uring_probe) + PROBE_OPS * sizeof(io_uring_probe_op));
+    auto* probe = reinterpret_cast<io_uring_probe*>(probe_mem.get());
+    if (io_uring_register(ring_fd_, IORING_REGISTER_PROBE, probe, PROBE_OPS) < 0) {
+        perror("io_uring probe");
+        return false;
+    }
+    for (int op : {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL,
+                   IORING_OP_SEND_ZC}) {
+        if (op >= probe->ops_len || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            std::cerr << "io_uring: kernel lacks multishot receive support\n";
+            return false;
+        }
+    }
+
+    // Provided buffers: the kernel picks one for each receive and we put it
+    // back once its bytes have been consumed. A buffer ring makes that a
+    // plain store; some kernels accept the ring but never hand out its
+    // buffers, so it is checked with a real receive, and the older
+    // IORING_OP_PROVIDE_BUFFERS takes over if it fails.
+    buffers_ = std::make_unique<char[]>(size_t{RECV_BUFFERS} * RECV_BUFFER_SIZE);
+    lent_ = RECV_BUFFERS;
+    buf_ring_size_ = RECV_BUFFERS * sizeof(io_uring_buf);
+    void* ring = ::mmap(nullptr, buf_ring_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+    buf_ring_ = static_cast<io_uring_buf_ring*>(ring);
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring_);
+    reg.ring_entries = RECV_BUFFERS;
+    reg.bgid = BUFFER_GROUP;
+    if (io_uring_register(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) == 0) {
+        for (unsigned i = 0; i < RECV_BUFFERS; ++i) release_buffer(static_cast<uint16_t>(i));
+        if (buffer_ring_works()) return true;
+        io_uring_register(ring_fd_, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    }
+    ::munmap(buf_ring_, buf_ring_size_);
+    buf_ring_ = nullptr;
+    release_buffers(0, RECV_BUFFERS);
+    lent_ = 0;
+    return true;
+}
+
+// Receives one byte through the buffer ring, before anything else is queued.
+bool UringReactor::buffer_ring_works() {
+    int pair[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) return false;
+    char byte = 0;
+    bool ok = false;
+    if (::write(pair[1], &byte, 1) == 1) {
+        io_uring_sqe* sqe = next_sqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = pair[0];
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUFFER_GROUP;
+        if (enter(1, 1000) && load_acquire(cq_ktail_) != *cq_khead_) {
+            const io_uring_cqe& cqe = cqes_[*cq_khead_ & cq_mask_];
+            ok = cqe.res == 1 && (cqe.flags & IORING_CQE_F_BUFFER);
+            if (ok) ++lent_;
+            if (ok) release_buffer(static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+            store_release(cq_khead_, *cq_khead_ + 1);
+        }
+    }
+    ::close(pair[0]);
+    ::close(pair[1]);
+    return ok;
+}
+
+UringReactor::~UringReactor() {
+    teardown();
+}
+
+void UringReactor::teardown() {
+    if (buf_ring_) ::munmap(buf_ring_, buf_ring_size_);
+    if (sqes_) ::munmap(sqes_, sqes_size_);
+    if (cq_map_ && cq_map_ != sq_map_) ::munmap(cq_map_, cq_map_size_);
+    if (sq_map_) ::munmap(sq_map_, sq_map_size_);
+    if (ring_fd_ != -1) ::close(ring_fd_);
+    buf_ring_ = nullptr;
+    sqes_ = nullptr;
+    cq_map_ = sq_map_ = nullptr;
+    ring_fd_ = -1;
+}
+
+// --- Request tags ---
+// user_data layout: op in bits 0-7, fd in 8-39, registration count in 40-63.
+
+uint64_t UringReactor::tag(Op op, int fd, uint32_t seq) {
+    return (uint64_t(seq & 0xffffff) << 40) | (uint64_t(uint32_t(fd)) << 8) | uint64_t(op);
+}
+
+UringReactor::FdState* UringReactor::state(int fd, bool create) {
+    if (fd < 0) return nullptr;
+    if (static_cast<size_t>(fd) >= fds_.size()) {
+        if (!create) return nullptr;
+        fds_.resize(fd + 1);
+    }
+    return &fds_[fd];
+}
+
+// --- Registration ---
+
+bool UringReactor::add(int fd) {
+    FdState* s = state(fd, true);
+    if (!s || s->active) return false;
+    *s = {s->seq, true, true};
+    arm_poll(fd, s->seq);
+    return true;
+}
+
+bool UringReactor::accept(int listen_fd) {
+    if (listen_fd < 0) return false;
+    arm_accept(listen_fd);
+    return true;
+}
+
+bool UringReactor::receive(int fd) {
+    FdState* s = state(fd, true);
+    if (!s || s->active) return false;
+    *s = {s->seq, true, false, true};
+    arm_recv(fd, *s);
+    return true;
+}
+
+void UringReactor::remove(int fd) {
+    FdState* s = state(fd);
+    if (!s || !s->active) return;
+    // Cancelled by tag, since the fd itself may be closed before the
+    // cancellation is submitted.
+    if (s->poll) {
+        cancel(tag(Op::Poll, fd, s->seq));
+    } else if (s->recv_armed) {
+        cancel(tag(Op::Recv, fd, s->seq));
+    }
+    cancel(tag(Op::Send, fd, s->seq));
+    *s = {s->seq + 1};
+}
+
+void UringReactor::set_interest(int fd, bool read, bool) {
+    // Sends are submitted when there is output, so only reads need arming.
+    FdState* s = state(fd);
+    if (!s || !s->active || s->poll || s->want_recv == read) return;
+    s->want_recv = read;
+    if (read && !s->recv_armed && !s->starved) {
+        arm_recv(fd, *s);
+    } else if (!read && s->recv_armed) {
+        cancel(tag(Op::Recv, fd, s->seq));
+    }
+}
+
+bool UringReactor::send(int fd, const msghdr* msg) {
+    FdState* s = state(fd);
+    if (!s || !s->active) return false;
+    io_uring_sqe* sqe = next_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(msg);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = tag(Op::Send, fd, s->seq);
+    return true;
+}
+
+void UringReactor::release_buffer(uint16_t buffer) {
+    --lent_;
+    if (buf_ring_) {
+        io_uring_buf& b = buf_ring_->bufs[buf_tail_ & (RECV_BUFFERS - 1)];
+        b.addr = reinterpret_cast<uint64_t>(buffers_.get() + size_t{buffer} * RECV_BUFFER_SIZE);
+        b.len = RECV_BUFFER_SIZE;
+        b.bid = buffer;
+        std::atomic_ref<uint16_t>(buf_ring_->tail).store(++buf_tail_, std::memory_order_release);
+    } else {
+        release_buffers(buffer, 1);
+    }
+
+    // Receives that ran dry can start again.
+    while (!starved_fds_.empty()) {
+        int fd = starved_fds_.back();
+        starved_fds_.pop_back();
+        FdState* s = state(fd);
+        if (!s || !s->starved) continue;
+        s->starved = false;
+        if (s->active && s->want_recv && !s->recv_armed) arm_recv(fd, *s);
+    }
+}
+
+// Returns buffers [first, first + count) with IORING_OP_PROVIDE_BUFFERS,
+// extending the previous request while it is still unsubmitted, so a tick's
+// worth of consecutive buffers goes back in one SQE.
+void UringReactor::release_buffers(uint16_t first, unsigned count) {
+    if (provide_sqe_ && provide_sqe_->off + provide_sqe_->fd == first) {
+        provide_sqe_->fd += static_cast<int>(count);
+    } else {
+        io_uring_sqe* sqe = next_sqe();
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = static_cast<int>(count); // number of buffers
+        sqe->addr = reinterpret_cast<uint64_t>(buffers_.get() + size_t{first} * RECV_BUFFER_SIZE);
+        sqe->len = RECV_BUFFER_SIZE;
+        sqe->off = first;
+        sqe->buf_group = BUFFER_GROUP;
+        sqe->user_data = tag(Op::Provide, -1, 0);
+        provide_sqe_ = sqe;
+    }
+}
+
+// --- Submission ---
+
+io_uring_sqe* UringReactor::next_sqe() {
+    if (sq_tail_ - load_acquire(sq_khead_) == sq_entries_) enter(0, 0);
+    io_uring_sqe* sqe = &sqes_[sq_tail_ & sq_mask_];
+    std::memset(sqe, 0, sizeof *sqe);
+    ++sq_tail_;
+    ++unsubmitted_;
+    return sqe;
+}
+
+void UringReactor::arm_accept(int fd) {
+    io_uring_sqe* sqe = next_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    // Non-blocking like the other backends' sockets; the ring polls them
+    // itself when they are not ready.
+    sqe->accept_flags = SOCK_CLOEXEC | SOCK_NONBLOCK;
+    sqe->user_data = tag(Op::Accept, fd, 0);
+}
+
+void UringReactor::arm_poll(int fd, uint32_t seq) {
+    io_uring_sqe* sqe = next_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = tag(Op::Poll, fd, seq);
+}
+
+void UringReactor::arm_recv(int fd, FdState& s) {
+    io_uring_sqe* sqe = next_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = tag(Op::Recv, fd, s.seq);
+    s.recv_armed = true;
+}
+
+void UringReactor::cancel(uint64_t target) {
+    io_uring_sqe* sqe = next_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = tag(Op::Cancel, -1, 0);
+}
+
+// Publishes queued SQEs and, if wait_nr > 0, blocks for that many
+// completions or timeout_ms (-1 = forever).
+bool UringReactor::enter(unsigned wait_nr, int timeout_ms) {
+    store_release(sq_ktail_, sq_tail_);
+    unsigned flags = 0;
+    io_uring_getevents_arg arg{};
+    __kernel_timespec ts{};
+    if (wait_nr > 0) {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        arg.sigmask_sz = _NSIG / 8;
+        if (timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+            arg.ts = reinterpret_cast<uint64_t>(&ts);
+        }
+    }
+    while (true) {
+        int n = io_uring_enter(ring_fd_, unsubmitted_, wait_nr, flags, flags ? &arg : nullptr,
+                               flags ? sizeof arg : 0);
+        if (n >= 0) {
+            unsubmitted_ -= std::min(unsubmitted_, static_cast<unsigned>(n));
+            if (unsubmitted_ == 0) provide_sqe_ = nullptr;
+            return true;
+        }
+        // Interrupted or timed out: report whatever has completed. EBUSY
+        // means the completion queue is full and must be reaped first.
+        if (errno == EINTR || errno == ETIME || errno == EBUSY) return true;
+        if (errno != EAGAIN) {
+            log_error() << "io_uring_enter: " << errno_text(errno);
+            return false;
+        }
+    }
+}
+
+// --- Completion ---
+
+int UringReactor::wait(std::vector<ReactorEvent>& events, int timeout_ms) {
+    events.clear();
+    bool ready = load_acquire(cq_ktail_) != *cq_khead_ || !backlog_.empty();
+    bool kernel_work = load_acquire(sq_kflags_) & (IORING_SQ_CQ_OVERFLOW | IORING_SQ_TASKRUN);
+    if (!ready || unsubmitted_ > 0 || kernel_work) {
+        if (!enter(ready ? 0 : 1, timeout_ms)) return -1;
+    }
+    reap(events);
+    return static_cast<int>(events.size());
+}
+
+// Empties the completion queue. Receives over the byte budget wait, in
+// order, in backlog_ for the next call.
+void UringReactor::reap(std::vector<ReactorEvent>& events) {
+    size_t received = 0;
+    auto take = [&](const io_uring_cqe& cqe) {
+        if (static_cast<Op>(cqe.user_data & 0xff) != Op::Recv) return complete(cqe, events);
+        if (!backlog_.empty() || received >= MAX_RECEIVED_BYTES) return backlog_.push_back(cqe);
+        received += std::max(cqe.res, 0);
+        complete(cqe, events);
+    };
+
+    while (!backlog_.empty() && received < MAX_RECEIVED_BYTES) {
+        io_uring_cqe cqe = backlog_.front();
+        backlog_.pop_front();
+        received += std::max(cqe.res, 0);
+        complete(cqe, events);
+    }
+
+    unsigned head = *cq_khead_;
+    unsigned tail = load_acquire(cq_ktail_);
+    for (; head != tail; ++head) {
+        const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+        if (cqe.flags & IORING_CQE_F_BUFFER) ++lent_;
+        take(cqe);
+    }
+    store_release(cq_khead_, head);
+}
+
+void UringReactor::complete(const io_uring_cqe& cqe, std::vector<ReactorEvent>& events) {
+    Op op = static_cast<Op>(cqe.user_data & 0xff);
+    int fd = static_cast<int>(static_cast<uint32_t>(cqe.user_data >> 8));
+    uint32_t seq = static_cast<uint32_t>(cqe.user_data >> 40);
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+
+    // Null if the request belongs to an earlier registration of fd.
+    FdState* s = state(fd);
+    if (s && (!s->active || (s->seq & 0xffffff) != seq)) s = nullptr;
+
+    switch (op) {
+    case Op::Cancel:
+    case Op::Provide:
+        return;
+    case Op::Send:
+        // Always reported: the caller owns the message memory.
+        events.push_back({fd, false, true, cqe.res < 0, ReactorEvent::Kind::Sent, cqe.res});
+        return;
+    case Op::Accept:
+        if (cqe.res != -ECANCELED) events.push_back({fd, true, false, false, ReactorEvent::Kind::Accepted, cqe.res});
+        if (!more) arm_accept(fd);
+        return;
+    case Op::Poll:
+        if (!s) return;
+        if (cqe.res >= 0) {
+            events.push_back({fd, (cqe.res & POLLIN) != 0, false, (cqe.res & (POLLERR | POLLHUP)) != 0});
+        }
+        if (!more) arm_poll(fd, s->seq);
+        return;
+    case Op::Recv:
+        break;
+    }
+
+    bool has_buffer = cqe.flags & IORING_CQE_F_BUFFER;
+    uint16_t buffer = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+    if (!s) {
+        if (has_buffer) release_buffer(buffer);
+        return;
+    }
+    if (!more) s->recv_armed = false;
+
+    if (cqe.res > 0 && has_buffer) {
+        events.push_back({fd, true, false, false, ReactorEvent::Kind::Received, cqe.res,
+                          buffers_.get() + size_t{buffer} * RECV_BUFFER_SIZE, buffer});
+    } else if (cqe.res == -ENOBUFS) {
+        // Every buffer was lent out; start again when one comes back. Some
+        // may have come back while this completion sat in the backlog, in
+        // which case the recv is simply re-armed below.
+        if (lent_ == RECV_BUFFERS) {
+            s->starved = true;
+            starved_fds_.push_back(fd);
+        }
+    } else if (cqe.res != -ECANCELED) {
+        // EOF or a receive error: the server closes the connection.
+        s->want_recv = false;
+        events.push_back({fd, false, false, true, ReactorEvent::Kind::Received, cqe.res});
+    }
+    if (!s->recv_armed && s->want_recv && !s->starved) arm_recv(fd, *s);
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "reactor.hpp"
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include <linux/io_uring.h>
+
+// --- io_uring(7) ---
+// Completion-based backend, built on the raw io_uring system calls so it
+// needs nothing beyond the kernel headers. Listeners use one multishot
+// accept and clients one multishot recv each, receiving into provided
+// buffers (a registered buffer ring where the kernel supports it) that the
+// server hands back once it has framed their bytes. Sends are queued as
+// SQEs, and everything queued during a tick is submitted by the same
+// io_uring_enter that waits for the next completions,
+// so a busy loop makes about one system call per tick however many
+// messages it moves.
+//
+// The constructor probes for every feature used here (multishot recv and
+// provided buffer rings need Linux 6.0); valid() is false if any is missing
+// and make_reactor() falls back to epoll.
+class UringReactor : public Reactor {
+public:
+    UringReactor();
+    ~UringReactor() override;
+
+    UringReactor(const UringReactor&) = delete;
+    UringReactor& operator=(const UringReactor&) = delete;
+
+    bool valid() const { return ring_fd_ != -1; }
+
+    // add() watches an fd for readability with a multishot poll; used for
+    // fds the server reads itself, such as its wakeup eventfd.
+    bool add(int fd) override;
+    void remove(int fd) override;
+    void set_interest(int fd, bool read, bool write) override;
+    int wait(std::vector<ReactorEvent>& events, int timeout_ms) override;
+    const char* name() const override { return "io_uring"; }
+
+    bool completes_io() const override { return true; }
+    bool accept(int listen_fd) override;
+    bool receive(int fd) override;
+    bool send(int fd, const msghdr* msg) override;
+    void release_buffer(uint16_t buffer) override;
+
+private:
+    enum class Op : uint8_t { Accept, Poll, Recv, Send, Cancel, Provide };
+
+    // Every request is tagged with its fd and the fd's registration count,
+    // so completions that arrive after remove() (or after the fd number
+    // has been reused) are recognised as stale.
+    struct FdState {
+        uint32_t seq = 0;
+        bool active = false;
+        bool poll = false;       // registered with add() rather than receive()
+        bool want_recv = false;  // receiving is not paused
+        bool recv_armed = false; // a multishot recv is outstanding
+        bool starved = false;    // the recv stopped for lack of buffers
+    };
+
+    bool setup();
+    bool buffer_ring_works();
+    void teardown();
+    static uint64_t tag(Op op, int fd, uint32_t seq);
+    FdState* state(int fd, bool create = false);
+
+    io_uring_sqe* next_sqe();
+    bool enter(unsigned wait_nr, int timeout_ms);
+    void reap(std::vector<ReactorEvent>& events);
+    void complete(const io_uring_cqe& cqe, std::vector<ReactorEvent>& events);
+    void arm_accept(int fd);
+    void arm_poll(int fd, uint32_t seq);
+    void arm_recv(int fd, FdState& s);
+    void cancel(uint64_t target);
+    void release_buffers(uint16_t first, unsigned count);
+
+    int ring_fd_ = -1;
+
+    // Submission queue
+    void* sq_map_ = nullptr;
+    size_t sq_map_size_ = 0;
+    unsigned* sq_khead_ = nullptr;
+    unsigned* sq_ktail_ = nullptr;
+    unsigned* sq_kflags_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned sq_entries_ = 0;
+    unsigned sq_tail_ = 0;    // next free entry; published to the kernel on enter
+    unsigned unsubmitted_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+
+    // Completion queue
+    void* cq_map_ = nullptr; // == sq_map_ when the kernel maps both rings at once
+    size_t cq_map_size_ = 0;
+    unsigned* cq_khead_ = nullptr;
+    unsigned* cq_ktail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+    std::deque<io_uring_cqe> backlog_; // receives held back by the per-wait input budget
+
+    // Provided receive buffers
+    io_uring_buf_ring* buf_ring_ = nullptr; // null when returned with PROVIDE_BUFFERS instead
+    io_uring_sqe* provide_sqe_ = nullptr;   // unsubmitted PROVIDE_BUFFERS that can be extended
+    size_t buf_ring_size_ = 0;
+    uint16_t buf_tail_ = 0;
+    unsigned lent_ = 0;                     // buffers received into and not yet released
+    std::unique_ptr<char[]> buffers_;
+    std::vector<int> starved_fds_;
+
+    std::vector<FdState> fds_; // fd -> state
+};
@@ -0,0 +1,526 @@
+#include "wal.hpp"
+#include "log.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iostream>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <zlib.h>
+
+namespace {
+
+// --- On-disk Format ---
+// segment file:  header page | record | record | ... | zeroes
+// record:        RecordHeader | text | binary | zero padding | RecordTrailer
+// Records are 8-byte aligned. The CRC covers everything after the crc field,
+// trailer included; a zeroed or torn record never validates.
+
+constexpr uint64_t SEGMENT_MAGIC = 0x31474f4c54414843; // "CHATLOG1"
+constexpr uint32_t TRAILER_MAGIC = 0x444e4552;         // "REND"
+constexpr size_t HEADER_PAGE = 4096;
+
+enum class RecordType : uint32_t { Room = 1, Message = 2 };
+
+struct RecordHeader {
+    uint32_t crc;
+    uint32_t size; // whole record, header to trailer
+    uint64_t seq;  // 0 for room records
+    uint32_t room;
+    RecordType type;
+    uint32_t text_len; // room records keep the name here
+    uint32_t binary_len;
+};
+
+struct RecordTrailer {
+    uint32_t size;
+    uint32_t magic;
+};
+
+struct IndexEntry {
+    uint64_t seq;
+    uint32_t offset;
+    uint32_t reserved;
+};
+
+constexpr size_t INDEX_SLOTS = (HEADER_PAGE - 24) / sizeof(IndexEntry);
+
+struct SegmentHeader {
+    uint64_t magic;
+    uint64_t first_seq;
+    uint32_t sealed_end; // end of the last record once the segment is full; 0 while active
+    uint32_t index_count;
+    IndexEntry index[INDEX_SLOTS];
+};
+static_assert(sizeof(SegmentHeader) <= HEADER_PAGE);
+
+size_t record_size(size_t payload) {
+    return (sizeof(RecordHeader) + payload + sizeof(RecordTrailer) + 7) & ~size_t{7};
+}
+
+uint32_t record_crc(const char* record, size_t size) {
+    return static_cast<uint32_t>(::crc32(0, reinterpret_cast<const Bytef*>(record + 4), static_cast<uInt>(size - 4)));
+}
+
+// Writes a complete record at `out`, which must have record_size() bytes.
+void encode_record(char* out, RecordType type, uint64_t seq, uint32_t room, std::string_view text,
+                   std::string_view binary) {
+    size_t size = record_size(text.size() + binary.size());
+    RecordHeader header{0, static_cast<uint32_t>(size), seq, room, type, static_cast<uint32_t>(text.size()),
+                        static_cast<uint32_t>(binary.size())};
+    char* p = out + sizeof header;
+    std::memcpy(p, text.data(), text.size());
+    std::memcpy(p + text.size(), binary.data(), binary.size());
+    char* trailer_at = out + size - sizeof(RecordTrailer);
+    p += text.size() + binary.size();
+    std::memset(p, 0, trailer_at - p);
+    RecordTrailer trailer{static_cast<uint32_t>(size), TRAILER_MAGIC};
+    std::memcpy(trailer_at, &trailer, sizeof trailer);
+    std::memcpy(out, &header, sizeof header);
+    header.crc = record_crc(out, size);
+    std::memcpy(out, &header.crc, sizeof header.crc);
+}
+
+// Checks the record at `offset` against the `limit` bytes available.
+bool read_record(const char* base, size_t offset, size_t limit, RecordHeader& header) {
+    if (offset + sizeof header > limit) return false;
+    std::memcpy(&header, base + offset, sizeof header);
+    size_t size = header.size;
+    if (size < record_size(0) || size % 8 != 0 || size > limit - offset) return false;
+    if (sizeof header + size_t{header.text_len} + header.binary_len + sizeof(RecordTrailer) > size) return false;
+    RecordTrailer trailer;
+    std::memcpy(&trailer, base + offset + size - sizeof trailer, sizeof trailer);
+    if (trailer.size != size || trailer.magic != TRAILER_MAGIC) return false;
+    return record_crc(base + offset, size) == header.crc;
+}
+
+std::string_view record_text(const char* base, size_t offset, const RecordHeader& h) {
+    return {base + offset + sizeof h, h.text_len};
+}
+
+std::string_view record_binary(const char* base, size_t offset, const RecordHeader& h) {
+    return {base + offset + sizeof h + h.text_len, h.binary_len};
+}
+
+SegmentHeader* segment_header(char* base) { return reinterpret_cast<SegmentHeader*>(base); }
+
+std::string segment_path(const std::string& dir, uint64_t first_seq) {
+    char name[40];
+    std::snprintf(name, sizeof name, "segment-%020llu.wal", static_cast<unsigned long long>(first_seq));
+    return dir + "/" + name;
+}
+
+bool write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = ::write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+} // namespace
+
+WriteAheadLog::WriteAheadLog(const WalOptions& options, ShardMetrics& metrics)
+    : options_(options), metrics_(metrics), index_interval_((options.segment_bytes - HEADER_PAGE) / INDEX_SLOTS) {
+    if (::mkdir(options_.dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        perror("mkdir");
+        throw std::runtime_error("Failed to create log directory " + options_.dir);
+    }
+
+    if (DIR* dir = ::opendir(options_.dir.c_str())) {
+        while (dirent* ent = ::readdir(dir)) {
+            unsigned long long seq;
+            char tail;
+            if (std::sscanf(ent->d_name, "segment-%20llu.wa%c", &seq, &tail) == 2 && tail == 'l') {
+                segment_files_.emplace_back(seq, options_.dir + "/" + ent->d_name);
+            }
+        }
+        ::closedir(dir);
+    }
+    std::sort(segment_files_.begin(), segment_files_.end());
+
+    rooms_fd_ = ::open((options_.dir + "/rooms.wal").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    wake_fd_ = ::eventfd(0, EFD_CLOEXEC);
+    if (rooms_fd_ < 0 || wake_fd_ < 0) {
+        perror("open log");
+        throw std::runtime_error("Failed to open log in " + options_.dir);
+    }
+}
+
+WriteAheadLog::~WriteAheadLog() {
+    if (writer_.joinable()) {
+        stopping_.store(true);
+        uint64_t one = 1;
+        if (::write(wake_fd_, &one, sizeof one) < 0) perror("eventfd write");
+        writer_.join();
+    }
+    unmap_segment(active_);
+    if (rooms_fd_ >= 0) ::close(rooms_fd_);
+    if (wake_fd_ >= 0) ::close(wake_fd_);
+}
+
+// --- Segments ---
+
+bool WriteAheadLog::map_segment(Segment& seg, bool writable) {
+    seg.fd = ::open(seg.path.c_str(), (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (seg.fd < 0) {
+        perror("open segment");
+        return false;
+    }
+    struct stat st;
+    if (::fstat(seg.fd, &st) < 0 || static_cast<size_t>(st.st_size) < HEADER_PAGE) {
+        std::cerr << "Ignoring truncated log segment " << seg.path << "\n";
+        unmap_segment(seg);
+        return false;
+    }
+    seg.size = static_cast<size_t>(st.st_size);
+    void* p = ::mmap(nullptr, seg.size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, seg.fd, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap segment");
+        unmap_segment(seg);
+        return false;
+    }
+    seg.base = static_cast<char*>(p);
+    if (segment_header(seg.base)->magic != SEGMENT_MAGIC) {
+        std::cerr << "Ignoring log segment with a bad header: " << seg.path << "\n";
+        unmap_segment(seg);
+        return false;
+    }
+    return true;
+}
+
+void WriteAheadLog::unmap_segment(Segment& seg) {
+    if (seg.base) ::munmap(seg.base, seg.size);
+    if (seg.fd >= 0) ::close(seg.fd);
+    seg.base = nullptr;
+    seg.fd = -1;
+}
+
+// A file left behind by a failed attempt is removed; the next attempt would
+// truncate it anyway, and recovery would only skip it.
+bool WriteAheadLog::create_segment(uint64_t first_seq) {
+    static LogRateLimit failures;
+    Segment seg;
+    seg.path = segment_path(options_.dir, first_seq);
+    seg.first_seq = first_seq;
+    seg.fd = ::open(seg.path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (seg.fd < 0) {
+        log_error(&failures) << "create log segment " << seg.path << ": " << errno_text(errno);
+        return false;
+    }
+    // Preallocate so appends never extend the file (and never hit ENOSPC
+    // through a mapping, which would be SIGBUS). Only a filesystem that
+    // cannot preallocate gets a sparse file instead; a full one fails.
+    int err = ::posix_fallocate(seg.fd, 0, static_cast<off_t>(options_.segment_bytes));
+    if (err == EOPNOTSUPP || err == EINVAL) {
+        err = ::ftruncate(seg.fd, static_cast<off_t>(options_.segment_bytes)) < 0 ? errno : 0;
+    }
+    if (err != 0) {
+        log_error(&failures) << "allocate log segment " << seg.path << ": " << errno_text(err);
+        unmap_segment(seg);
+        ::unlink(seg.path.c_str());
+        return false;
+    }
+    seg.size = options_.segment_bytes;
+    void* p = ::mmap(nullptr, seg.size, PROT_READ | PROT_WRITE, MAP_SHARED, seg.fd, 0);
+    if (p == MAP_FAILED) {
+        log_error(&failures) << "map log segment " << seg.path << ": " << errno_text(errno);
+        unmap_segment(seg);
+        ::unlink(seg.path.c_str());
+        return false;
+    }
+    seg.base = static_cast<char*>(p);
+    SegmentHeader* header = segment_header(seg.base);
+    header->magic = SEGMENT_MAGIC;
+    header->first_seq = first_seq;
+    header->sealed_end = 0;
+    header->index_count = 0;
+    seg.end = HEADER_PAGE;
+    seg.last_seq = first_seq - 1;
+
+    unmap_segment(active_);
+    active_ = std::move(seg);
+    segment_files_.emplace_back(first_seq, active_.path);
+    return true;
+}
+
+// Offset of the last indexed record at or before `seq` (the header page end
+// if there is none). Only valid records are trusted: an index entry may have
+// reached the disk before its record did.
+size_t WriteAheadLog::seek(const Segment& seg, uint64_t seq) const {
+    const SegmentHeader* header = segment_header(seg.base);
+    size_t count = std::min<size_t>(header->index_count, INDEX_SLOTS);
+    const IndexEntry* first = header->index;
+    const IndexEntry* it = std::upper_bound(first, first + count, seq,
+                                            [](uint64_t s, const IndexEntry& e) { return s < e.seq; });
+    RecordHeader record;
+    while (it != first) {
+        --it;
+        if (read_record(seg.base, it->offset, seg.size, record) && record.seq == it->seq) return it->offset;
+    }
+    return HEADER_PAGE;
+}
+
+// Finds the end of the valid records: the sealed end for a full segment,
+// otherwise a forward scan from the last index entry.
+void WriteAheadLog::find_end(Segment& seg) {
+    const SegmentHeader* header = segment_header(seg.base);
+    seg.first_seq = header->first_seq;
+    seg.last_seq = seg.first_seq - 1;
+
+    bool sealed = header->sealed_end >= HEADER_PAGE && header->sealed_end <= seg.size;
+    size_t offset = sealed ? header->sealed_end : seek(seg, UINT64_MAX);
+    RecordHeader record;
+    if (sealed) {
+        // Trust the seal, but still learn the last sequence number.
+        RecordTrailer trailer;
+        std::memcpy(&trailer, seg.base + offset - sizeof trailer, sizeof trailer);
+        if (offset > HEADER_PAGE && trailer.size <= offset - HEADER_PAGE &&
+            read_record(seg.base, offset - trailer.size, seg.size, record)) {
+            seg.last_seq = record.seq;
+        }
+        seg.end = offset;
+        return;
+    }
+    while (read_record(seg.base, offset, seg.size, record)) {
+        seg.last_seq = record.seq;
+        offset += record.size;
+    }
+    seg.end = offset;
+}
+
+// --- Recovery ---
+
+size_t WriteAheadLog::recover_rooms(const RoomFn& on_room) {
+    struct stat st;
+    if (::fstat(rooms_fd_, &st) < 0) return 0;
+    std::string data(static_cast<size_t>(st.st_size), '\0');
+    size_t got = 0;
+    while (got < data.size()) {
+        ssize_t n = ::pread(rooms_fd_, data.data() + got, data.size() - got, static_cast<off_t>(got));
+        if (n <= 0) break;
+        got += static_cast<size_t>(n);
+    }
+
+    size_t offset = 0, rooms = 0;
+    RecordHeader record;
+    while (read_record(data.data(), offset, got, record) && record.type == RecordType::Room) {
+        on_room(record.room, record_text(data.data(), offset, record));
+        offset += record.size;
+        ++rooms;
+    }
+    // Drop a torn tail so new records follow the last good one.
+    if (offset != data.size() && ::ftruncate(rooms_fd_, static_cast<off_t>(offset)) < 0) perror("ftruncate");
+    ::lseek(rooms_fd_, static_cast<off_t>(offset), SEEK_SET);
+    return rooms;
+}
+
+void WriteAheadLog::recover(const HistoryLimits& limits, const RoomFn& on_room, const MessageFn& on_message) {
+    size_t room_count = recover_rooms(on_room);
+
+    // Reopen the newest segment for appending.
+    while (!segment_files_.empty()) {
+        active_.first_seq = segment_files_.back().first;
+        active_.path = segment_files_.back().second;
+        if (map_segment(active_, true)) break;
+        segment_files_.pop_back();
+    }
+    if (!active_.base) {
+        if (!create_segment(1)) throw std::runtime_error("Failed to create log segment in " + options_.dir);
+    } else {
+        find_end(active_);
+    }
+    next_seq_ = active_.last_seq + 1;
+
+    if (limits.messages == 0 || limits.room_bytes == 0) return;
+
+    // Walk backwards from the end, newest message first, taking at most a
+    // room's worth of history per room. Stop once every room is full or the
+    // global history budget has been scanned.
+    struct Collected {
+        size_t bytes = 0;
+        bool full = false;
+        std::vector<std::pair<std::string_view, std::string_view>> messages; // newest first
+    };
+    std::unordered_map<uint32_t, Collected> rooms;
+    std::vector<Segment> mapped; // older segments, unmapped once replayed
+    size_t scanned = 0, full_rooms = 0;
+    auto done = [&] { return scanned >= limits.total_bytes || (room_count > 0 && full_rooms >= room_count); };
+
+    const Segment* seg = &active_;
+    size_t file = segment_files_.size() - 1;
+    while (seg && !done()) {
+        size_t end = seg->end;
+        while (end > HEADER_PAGE && !done()) {
+            RecordTrailer trailer;
+            std::memcpy(&trailer, seg->base + end - sizeof trailer, sizeof trailer);
+            RecordHeader record;
+            if (trailer.size > end - HEADER_PAGE || !read_record(seg->base, end - trailer.size, seg->size, record)) {
+                break;
+            }
+            end -= record.size;
+            scanned += record.size;
+
+            Collected& room = rooms[record.room];
+            size_t bytes = size_t{record.text_len} + record.binary_len;
+            if (room.full) continue;
+            if (room.bytes + bytes > limits.room_bytes) {
+                room.full = true;
+                ++full_rooms;
+                continue;
+            }
+            room.bytes += bytes;
+            room.messages.emplace_back(record_text(seg->base, end, record), record_binary(seg->base, end, record));
+            if (room.messages.size() == limits.messages) {
+                room.full = true;
+                ++full_rooms;
+            }
+        }
+
+        seg = nullptr;
+        while (file > 0 && !seg) {
+            --file;
+            Segment older;
+            older.path = segment_files_[file].second;
+            if (map_segment(older, false)) {
+                find_end(older);
+                mapped.push_back(std::move(older));
+                seg = &mapped.back();
+            }
+        }
+    }
+
+    for (auto& [room, collected] : rooms) {
+        for (auto it = collected.messages.rbegin(); it != collected.messages.rend(); ++it) {
+            on_message(room, Payload{MessageRef::make(it->first), MessageRef::make(it->second)});
+        }
+    }
+    for (Segment& s : mapped) unmap_segment(s);
+}
+
+// --- Appending ---
+
+void WriteAheadLog::start() {
+    writer_ = std::thread([this] { writer_loop(); });
+}
+
+void WriteAheadLog::append_room(uint32_t id, std::string_view name) {
+    push(Entry{id, std::string(name), {}});
+}
+
+void WriteAheadLog::append_message(uint32_t room, const Payload& payload) {
+    push(Entry{room, {}, payload});
+}
+
+void WriteAheadLog::push(Entry entry) {
+    queue_.push(std::move(entry));
+    if (!wake_pending_.exchange(true, std::memory_order_acq_rel)) {
+        uint64_t one = 1;
+        if (::write(wake_fd_, &one, sizeof one) < 0) {
+            static LogRateLimit failures;
+            log_error(&failures) << "log eventfd write: " << errno_text(errno);
+        }
+    }
+}
+
+// Each wakeup writes everything queued so far and makes it durable with one
+// fdatasync per file: messages that arrive during a sync simply ride in the
+// next batch.
+void WriteAheadLog::writer_loop() {
+    std::string room_batch;
+    while (true) {
+        uint64_t count;
+        if (::read(wake_fd_, &count, sizeof count) < 0 && errno != EINTR) {
+            perror("eventfd read");
+            return;
+        }
+        wake_pending_.store(false, std::memory_order_release);
+
+        create_failed_ = false; // retry a segment that could not be created
+        bool wrote = false;
+        while (auto entry = queue_.pop()) {
+            if (!entry->name.empty()) {
+                size_t at = room_batch.size();
+                room_batch.resize(at + record_size(entry->name.size()));
+                encode_record(room_batch.data() + at, RecordType::Room, 0, entry->room, entry->name, {});
+            } else {
+                write_message(entry->room, entry->payload);
+                wrote = true;
+            }
+        }
+
+        if (!room_batch.empty()) {
+            if (!write_all(rooms_fd_, room_batch.data(), room_batch.size()) || ::fdatasync(rooms_fd_) < 0) {
+                perror("write rooms log");
+            }
+            room_batch.clear();
+        }
+        if (wrote && active_.base && ::fdatasync(active_.fd) < 0) perror("fdatasync");
+        if (stopping_.load()) return;
+    }
+}
+
+void WriteAheadLog::write_message(uint32_t room, const Payload& payload) {
+    size_t size = record_size(payload.text.size() + payload.binary.size());
+    if (size > options_.segment_bytes - HEADER_PAGE) {
+        // Only with a --max-line close to --wal-segment-bytes.
+        static LogRateLimit oversized;
+        metrics_.add(Counter::WalDropped);
+        log_error(&oversized) << "Log: dropped a " << size << "-byte message, larger than a segment.";
+        return;
+    }
+    if (active_.base && active_.end + size > active_.size) roll_segment();
+    if (!active_.base && !create_failed_) open_segment();
+    if (!active_.base) {
+        metrics_.add(Counter::WalDropped);
+        ++dropped_;
+        return;
+    }
+
+    uint64_t seq = next_seq_++;
+    size_t offset = active_.end;
+    encode_record(active_.base + offset, RecordType::Message, seq, room, payload.text.view(), payload.binary.view());
+    active_.end += size;
+    active_.last_seq = seq;
+
+    SegmentHeader* header = segment_header(active_.base);
+    size_t last_indexed = header->index_count ? header->index[header->index_count - 1].offset : HEADER_PAGE;
+    if (header->index_count < INDEX_SLOTS && (offset - last_indexed >= index_interval_ || header->index_count == 0)) {
+        header->index[header->index_count] = {seq, static_cast<uint32_t>(offset), 0};
+        ++header->index_count;
+    }
+}
+
+// Seals the full segment (recording where its records end) and continues in
+// a new one named after the next sequence number.
+void WriteAheadLog::roll_segment() {
+    segment_header(active_.base)->sealed_end = static_cast<uint32_t>(active_.end);
+    if (::fdatasync(active_.fd) < 0) perror("fdatasync");
+    unmap_segment(active_);
+    open_segment();
+}
+
+// Without a segment, messages are dropped (and counted) until the next batch
+// tries again: a full disk or descriptor table may have recovered by then.
+void WriteAheadLog::open_segment() {
+    if (create_segment(next_seq_)) {
+        if (dropped_ > 0) log_warn() << "Log: writing again after dropping " << dropped_ << " messages.";
+        dropped_ = 0;
+        return;
+    }
+    create_failed_ = true;
+    static LogRateLimit failures;
+    log_error(&failures) << "Log: no segment to write to; dropping messages until one can be created.";
+}
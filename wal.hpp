@@ -0,0 +1,115 @@
+#pragma once
+
+#include "history.hpp"
+#include "metrics.hpp"
+#include "mpsc_queue.hpp"
+#include "protocol.hpp"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// --- Write-Ahead Log ---
+// Optional durable record of rooms and chat messages, so a restarted server
+// comes back with its rooms and recent history.
+//
+// Messages go to fixed-size segment files (segment-<first seq>.wal) that are
+// preallocated and memory-mapped; appending is a memcpy. A dedicated writer
+// thread drains whatever the shards queued, copies it in and then issues one
+// fdatasync for the whole batch (group commit), so the disk sees one flush
+// per batch rather than per message. Room creations go to a small rooms.wal
+// that is read in full at startup. If the next segment cannot be created (a
+// full disk, no free descriptors), messages are dropped, logged and counted
+// in chat_wal_dropped_total until a later batch manages to create it.
+//
+// Every record carries a CRC and ends with a trailer holding its size, so the
+// log can be walked backwards from its end. The first page of each segment
+// holds a sparse index of (sequence number, offset) pairs. Recovery uses it
+// to find the end of the last segment without scanning it, then walks back
+// only as far as the history that will be kept. Startup time therefore
+// depends on the history limits, not on the size of the log.
+
+struct WalOptions {
+    std::string dir;                      // empty = no log
+    size_t segment_bytes = 64 * 1024 * 1024;
+};
+
+class WriteAheadLog {
+public:
+    using RoomFn = std::function<void(uint32_t id, std::string_view name)>;
+    using MessageFn = std::function<void(uint32_t room, const Payload& payload)>;
+
+    // Opens or creates the log in options.dir. Throws std::runtime_error if
+    // the directory or a segment cannot be set up. Messages the writer has to
+    // drop are counted in `metrics`, which only it records into.
+    WriteAheadLog(const WalOptions& options, ShardMetrics& metrics);
+    ~WriteAheadLog();
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    // Replays every room, then, oldest first, up to `limits` worth of recent
+    // messages per room. Must be called once, before start().
+    void recover(const HistoryLimits& limits, const RoomFn& on_room, const MessageFn& on_message);
+
+    // Starts the writer thread.
+    void start();
+
+    // Thread-safe; the records become durable with the writer's next batch.
+    void append_room(uint32_t id, std::string_view name);
+    void append_message(uint32_t room, const Payload& payload);
+
+private:
+    struct Segment {
+        std::string path;
+        uint64_t first_seq = 0;
+        int fd = -1;
+        char* base = nullptr; // the whole file, mapped
+        size_t size = 0;
+        size_t end = 0;       // offset just past the last valid record
+        uint64_t last_seq = 0;
+    };
+
+    struct Entry {
+        uint32_t room = 0;
+        std::string name; // set for a room record
+        Payload payload;  // set for a message
+    };
+
+    bool map_segment(Segment& seg, bool writable);
+    void unmap_segment(Segment& seg);
+    bool create_segment(uint64_t first_seq);
+    void find_end(Segment& seg);
+    size_t seek(const Segment& seg, uint64_t seq) const;
+    size_t recover_rooms(const RoomFn& on_room);
+
+    void push(Entry entry);
+    void writer_loop();
+    void write_message(uint32_t room, const Payload& payload);
+    void roll_segment();
+    void open_segment();
+
+    WalOptions options_;
+    ShardMetrics& metrics_;
+    std::vector<std::pair<uint64_t, std::string>> segment_files_; // first seq -> path, ascending
+    Segment active_;             // unmapped while no new segment can be created
+    bool create_failed_ = false; // this batch tried and failed; the next retries
+    uint64_t dropped_ = 0;       // messages dropped since the last segment opened
+    uint64_t next_seq_ = 1;
+    size_t index_interval_;
+    int rooms_fd_ = -1;
+
+    MpscQueue<Entry> queue_;
+    int wake_fd_ = -1;
+    std::atomic<bool> wake_pending_{false};
+    std::atomic<bool> stopping_{false};
+    std::thread writer_;
+};
+
+// Segments need room for the header page and a useful number of records, and
+// offsets within them are 32-bit.
+inline bool valid_wal_segment_size(size_t bytes) { return bytes >= 64 * 1024 && bytes < (size_t{1} << 32); }